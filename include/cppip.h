@@ -35,6 +35,7 @@
 #include <sys/time.h>
 #include <time.h>
 #include <math.h>
+#include <sys/mman.h>
 #include "bgzf.h"
 
 /** mode symbolics */
@@ -43,6 +44,10 @@
 #define EXTRACT       0x05
 #define VERIFY        0x06
 #define DUMP          0x07
+#define CATALOG       0x08
+#define CATALOG_EXTRACT 0x09
+#define MERGE         0x0a
+#define SERVE         0x0b
 
 #define V_DETAILED    0x01
 #define V_DUMP        0x02
@@ -68,6 +73,71 @@ struct pcap_offline_pkthdr
 typedef struct pcap_offline_pkthdr pcap_offline_pkthdr_t;
 #define PCAP_PKTH_SIZ sizeof(struct pcap_offline_pkthdr)
 
+/** pcap file magic, as it reads on this host */
+#define PCAP_MAGIC          0xa1b2c3d4  /** microsecond timestamps */
+#define PCAP_MAGIC_NSEC     0xa1b23c4d  /** nanosecond timestamps */
+#define PCAP_MAGIC_SWAP     0xd4c3b2a1  /** microseconds, other byte order */
+#define PCAP_MAGIC_NSEC_SWAP 0x4d3cb2a1 /** nanoseconds, other byte order */
+
+/**
+ * Turns a record header read from a pcap that isn't in our byte order or
+ * has nanosecond timestamps into one that is, in microseconds. Picked once
+ * by extract_open() for the capture, see pcap_dec_*() in extract.c; the one
+ * for native pcaps leaves the header alone, so callers never test for it.
+ * returns:     the nanoseconds past the microsecond, 0 if there are none
+ */
+typedef uint32_t (*pcap_dec_t)(pcap_offline_pkthdr_t *pcap_h);
+
+struct cppip_control_context;
+/**
+ * Reads a packet's header at the current position of c->pcap, decoded.
+ * Picked once by extract_open(): native pcap, pcap through c->pcap_dec, or
+ * pcapng_hdr(). Called by extract_hdr().
+ * returns:     the bytes read, see extract_hdr()
+ */
+typedef int (*pcap_hdr_t)(struct cppip_control_context *c,
+        pcap_offline_pkthdr_t *pcap_h);
+
+/**
+ * pcapng, the blocks we look at. A pcap.gz starting with a Section Header
+ * Block is read block by block, Enhanced Packet Blocks are its packets and
+ * the Interface Description Blocks before them say how to read those.
+ */
+#define PCAPNG_SHB          0x0a0d0d0a
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_PB           0x00000002  /** obsolete packet block */
+#define PCAPNG_SPB          0x00000003
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_BOM          0x1a2b3c4d  /** SHB byte order magic */
+#define PCAPNG_BH_SIZ       8           /** block type and total length */
+#define PCAPNG_EPB_SIZ      20          /** EPB fields before the packet */
+#define PCAPNG_IF_MAX       64          /** interfaces per capture */
+
+/** an interface from an IDB, how its packets' timestamps are read */
+struct pcapng_if
+{
+    uint32_t linktype;          /** pcap link type */
+    uint64_t units;             /** timestamp units per second */
+    uint8_t shift;              /** units is 1 << shift, 0 if a power of 10 */
+    int64_t tsoffset;           /** seconds added to every timestamp */
+};
+typedef struct pcapng_if pcapng_if_t;
+
+/**
+ * BGZF block framing. Every block is a gzip member with an 18-byte header
+ * whose "BC" extra subfield carries BSIZE (total block size - 1) and an
+ * 8-byte footer of CRC32 and ISIZE (uncompressed size). We read these
+ * ourselves to hop over blocks without inflating them.
+ */
+#define BGZF_BLOCK_HDR_SIZ  18
+#define BGZF_BLOCK_FTR_SIZ  8
+#define BGZF_BLOCK_MAX_SIZ  0x10000 /** a whole block, compressed */
+#define BGZF_BLOCK_DATA_SIZ 0xff00  /** data per block, as bgzip does it */
+
+/** compressed bytes read ahead at a time, and how many chunks by default */
+#define READAHEAD_CHUNK_SIZ (1024 * 1024)
+#define READAHEAD_DEF_DEPTH 4
+
 /*
  * File Header:
  *
@@ -95,6 +165,10 @@ struct cppip_file_hdr
     uint8_t index_mode;        /** index mode(s) */
 #define CPPIP_INDEX_PN  0x01   /** indexed by packet number */
 #define CPPIP_INDEX_TS  0x02   /** indexed by packet timestamp */
+#define CPPIP_INDEX_EF  0x04   /** every packet offset, Elias-Fano coded */
+#define CPPIP_INDEX_FLOW 0x08  /** packets of each 5-tuple flow */
+#define CPPIP_INDEX_HOST 0x10  /** hosts and ports seen per interval */
+#define CPPIP_INDEX_BYTES 0x20 /** pkt-num and timestamp every so many bytes */
     uint8_t hdr_size;          /** number of 32 bit words ala IPv4 */
     uint32_t pkt_cnt;          /** number of packets in pcap.gz */
     struct timeval ts_created; /** timestamp of when this index was created */
@@ -196,20 +270,495 @@ struct cppip_record_ts
 typedef struct cppip_record_ts cppip_record_ts_t;
 #define CPPIP_REC_TS_SIZ sizeof(struct cppip_record_ts)
 
+/** buffered writer, turns lots of small writes into a few big ones */
+struct writer
+{
+    int fd;                     /** where the data goes */
+    off_t off;                  /** file offset of the next flush */
+    uint8_t *buf;               /** pending data */
+    size_t len;                 /** bytes pending in buf */
+    size_t siz;                 /** capacity of buf */
+    int seq;                    /** no offsets, write() where the fd is */
+    uint32_t writes;            /** write syscalls issued */
+    uint64_t bytes;             /** bytes written */
+};
+typedef struct writer writer_t;
+#define WRITER_BUF_SIZ  (1024 * 1024)
+
+/** bgzip compressed output, see zout.c */
+struct zout
+{
+    int fd;                     /** where the blocks go */
+    z_stream zs;                /** deflate state, reset for each block */
+    uint8_t *ubuf;              /** data waiting to fill a block */
+    size_t ulen;                /** bytes waiting in ubuf */
+    uint8_t *cbuf;              /** the block being compressed */
+    void *pool;                 /** compression threads, if any */
+    uint64_t blocks;            /** blocks written */
+    uint64_t copied;            /** compressed bytes copied as is */
+};
+typedef struct zout zout_t;
+
+/** inflated pcap.gz blocks shared between extractions, see bcache.c */
+typedef struct bcache bcache_t;
+#define BCACHE_DEF_SIZ  (64 * 1024 * 1024)
+
+/*
+ * Version 2 index format. Everything is little endian regardless of the
+ * host, there is no padding and the whole file is meant to be mmap()ed and
+ * searched in place. The v1 structures above are still read.
+ *
+ * File Header:
+ *
+ *   0                   1                   2                   3   
+ *   0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                         Magic Number                          |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |  Maj Version  |  Min Version  |  Index Mode   |  Endianness   |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                   Packet Count (64 bits)                      |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |             Index Creation Timestamp, seconds (64 bits)       |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |             Index Creation Timestamp, microseconds            |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                        Section Count                          |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * Followed by Section Count section table entries:
+ *
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |         Section Type          |            Flags              |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                           Reserved                            |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                  Section File Offset (64 bits)                |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                     Section Length (64 bits)                  |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * Section types are the index modes. A record stream section (pkt-num,
+ * timestamp) starts with a 32 byte header:
+ *
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                    Record Count (64 bits)                     |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                   Records per Seek Block                      |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                      Seek Block Count                         |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |         Index Level (packets or microseconds, 64 bits)        |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |    Fields     |                    Reserved                   |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                           Reserved                            |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * then a directory of one 32 byte entry per seek block holding the block's
+ * first record in full (packet number, timestamp in microseconds, BGZF
+ * offset, 64 bits each) and the offset of the rest of the block in the
+ * data area, then the data area. Inside a seek block every record after the
+ * first is stored as varints of the deltas from the one before it, for
+ * each field present in the stream:
+ *
+ *   packet number:  delta
+ *   timestamp:      zigzag delta (microseconds)
+ *   BGZF offset:    compressed block delta, then the in-block offset as a
+ *                   delta if the block is the same, absolute if not
+ *
+ * Finding record i is O(1) to its seek block plus at most (records per
+ * block - 1) varint decodes.
+ */
+#define CPPIP_FORMAT_V1         1
+#define CPPIP_FORMAT_V2         2
+#define CPPIP_V2_ENDIAN_LE      0x01
+#define CPPIP_V2_FH_SIZ         32
+#define CPPIP_V2_SECT_SIZ       24
+#define CPPIP_V2_STREAM_H_SIZ   32
+#define CPPIP_V2_DIR_SIZ        32
+#define CPPIP_V2_BLK_RECS       64
+
+/** fields present in a record stream */
+#define CPPIP_REC_F_PKT         0x01
+#define CPPIP_REC_F_TS          0x02
+#define CPPIP_REC_F_OFF         0x04
+#define CPPIP_REC_F_NSEC        0x08    /** timestamps in nanoseconds */
+
+/** an index record in memory, whatever mode or format it came from */
+struct cppip_record
+{
+    uint64_t pkt_num;           /** the packet number */
+    struct timeval pkt_ts;      /** packet timestamp */
+    uint32_t pkt_ns;            /** nanoseconds past pkt_ts, ns captures */
+    uint64_t bgzf_offset;       /** its offset into bgzf file */
+};
+typedef struct cppip_record cppip_record_t;
+
+/** a stream of index records being built, see index_v2_* */
+struct index_v2_stream
+{
+    int mode;                   /** section type */
+    int fields;                 /** CPPIP_REC_F_* present */
+    uint64_t level;             /** index level: packets, usec or bytes */
+    uint64_t rec_cnt;           /** records so far */
+    cppip_record_t prev;        /** last record added */
+    FILE *spool;                /** encoded seek block data */
+    writer_t w;                 /** buffers writes to spool */
+    uint8_t *dir;               /** encoded directory */
+    size_t dir_len;             /** bytes used in dir */
+    size_t dir_siz;             /** capacity of dir */
+};
+typedef struct index_v2_stream index_v2_stream_t;
+
+/** a section to be written by index_v2_write() */
+struct index_v2_section
+{
+    int type;                   /** section type (index mode) */
+    uint64_t len;               /** exact number of bytes out() writes */
+    int (*out)(void *arg, writer_t *w, char *errbuf);
+    void *arg;                  /** passed to out() */
+};
+typedef struct index_v2_section index_v2_section_t;
+
+/*
+ * Packet offset (Elias-Fano) section:
+ *
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                   Packet Count (64 bits)                      |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                    High Bits (64 bits)                        |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                        Low Bit Width                          |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                      BGZF Block Count                         |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                         Sample Count                          |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                           Reserved                            |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * followed by, as arrays of 64 bit words: the compressed address of every
+ * BGZF block a packet starts in, the select samples, the low bits and the
+ * high bits. Packet i's offset is coded as (block number << 16 | offset in
+ * block) which grows by about one packet's size per packet, so the
+ * sequence packs into roughly 2 + log2(average packet size) bits each.
+ * Sample k is the high bits position of packet k * CPPIP_EF_SAMPLE so a
+ * lookup scans a few words at most.
+ */
+#define CPPIP_EF_H_SIZ      32
+#define CPPIP_EF_SAMPLE     256
+
+/** builds the packet offset section while walking the pcap */
+struct index_ef_build
+{
+    uint64_t n;                 /** packets so far */
+    uint64_t *blks;             /** compressed address of each block */
+    uint32_t blk_cnt;           /** blocks in blks */
+    uint32_t blk_siz;           /** capacity of blks */
+    FILE *spool;                /** (block number << 16 | offset) per pkt */
+    writer_t w;                 /** buffers writes to spool */
+    uint32_t l;                 /** once finished: low bit width */
+    uint64_t hi_bits;           /** once finished: high bits length */
+    uint64_t *low;              /** once finished: low bits */
+    uint64_t *high;             /** once finished: high bits */
+    uint64_t *samples;          /** once finished: select samples */
+    uint64_t sample_cnt;        /** once finished: number of samples */
+};
+typedef struct index_ef_build index_ef_build_t;
+
+/** a packet offset section being read, points into the mmap()ed index */
+struct index_ef
+{
+    uint64_t n;                 /** number of packets */
+    uint32_t l;                 /** low bit width */
+    uint32_t blk_cnt;           /** number of blocks */
+    uint64_t hi_words;          /** 64 bit words of high bits */
+    uint64_t sample_cnt;        /** number of samples */
+    const uint8_t *blks;        /** block addresses */
+    const uint8_t *samples;     /** select samples */
+    const uint8_t *low;         /** low bits */
+    const uint8_t *high;        /** high bits */
+};
+typedef struct index_ef index_ef_t;
+
+/** a stream of index records being read, v1 or v2 */
+struct index_stream
+{
+    int mode;                   /** CPPIP_INDEX_* */
+    int fields;                 /** CPPIP_REC_F_* present */
+    uint64_t rec_cnt;           /** number of records */
+    uint64_t level;             /** v2: index level from the section header */
+    off_t v1_off;               /** v1: file offset of the first record */
+    const uint8_t *dir;         /** v2: seek block directory */
+    const uint8_t *data;        /** v2: seek block data */
+    const uint8_t *end;         /** v2: end of the section */
+    uint32_t blk_recs;          /** v2: records per seek block */
+    uint32_t blk_cnt;           /** v2: number of seek blocks */
+    uint64_t cur_i;             /** v2: index of cur, for sequential reads */
+    const uint8_t *cur_p;       /** v2: where the record after cur starts */
+    cppip_record_t cur;         /** v2: last record decoded */
+};
+typedef struct index_stream index_stream_t;
+
+/**
+ * Link types we can find IP headers in, from the pcap file header. We don't
+ * pull in pcap.h for a handful of numbers.
+ */
+#define CPPIP_DLT_NULL      0
+#define CPPIP_DLT_EN10MB    1
+#define CPPIP_DLT_RAW_BSD   12
+#define CPPIP_DLT_RAW_OBSD  14
+#define CPPIP_DLT_RAW       101
+#define CPPIP_DLT_LOOP      108
+#define CPPIP_DLT_LINUX_SLL 113
+
+/** bytes of each packet we look at to find its flow */
+#define FLOW_SNAP           256
+
+/**
+ * A bidirectional 5-tuple. Addresses are IPv6 or IPv4-mapped IPv6, ports
+ * are in network byte order and are 0 for protocols without them (and for
+ * non-first fragments). Endpoints are ordered so both directions of a
+ * conversation make the same key. All bytes, so it's the same in memory
+ * and on disk.
+ */
+struct flow_endpoint
+{
+    uint8_t addr[16];
+    uint8_t port[2];
+};
+
+struct flow_key
+{
+    struct flow_endpoint a;     /** the lower endpoint */
+    struct flow_endpoint b;     /** the higher endpoint */
+    uint8_t proto;              /** IP protocol */
+    uint8_t pad[3];             /** always 0 */
+};
+typedef struct flow_key flow_key_t;
+#define FLOW_KEY_SIZ sizeof(struct flow_key)
+
+/*
+ * Flow section:
+ *
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                     Flow Count (64 bits)                      |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                    Bucket Count (64 bits)                     |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                  Postings Length (64 bits)                    |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                       Reserved (64 bits)                      |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * followed by Bucket Count + 1 64 bit bucket starts, Flow Count 64 byte
+ * flow entries (the flow key, then 64 bit packet count, postings offset and
+ * postings length) grouped by bucket, and the postings. A flow lives in
+ * bucket hash(key) & (Bucket Count - 1). Its postings are the virtual
+ * offsets of its packets, in file order, coded like the BGZF offsets of a
+ * record stream: a varint compressed block delta then a varint in-block
+ * offset, delta coded when the block is the same.
+ */
+#define CPPIP_FLOW_H_SIZ    32
+#define CPPIP_FLOW_ENT_SIZ  64
+
+/** a flow seen while indexing */
+struct index_flow_ent
+{
+    flow_key_t key;
+    uint64_t hash;              /** flow_hash(key) */
+    uint64_t pkt_cnt;           /** packets so far */
+    uint64_t len;               /** bytes of postings so far */
+    uint64_t prev;              /** offset of the last packet */
+    uint64_t cur;               /** writing postings: where the next goes */
+};
+
+/** builds the flow section while walking the pcap */
+struct index_flow_build
+{
+    struct index_flow_ent *flows;   /** in order of first appearance */
+    uint32_t flow_cnt;          /** flows in flows */
+    uint32_t flow_siz;          /** capacity of flows */
+    uint32_t *table;            /** open addressing, flow number + 1 */
+    uint64_t table_siz;         /** slots in table, a power of 2 */
+    uint64_t bucket_cnt;        /** once finished: on-disk buckets */
+    uint32_t *order;            /** once finished: flows by bucket */
+    FILE *spool;                /** (flow number, offset) per packet */
+    writer_t w;                 /** buffers writes to spool */
+};
+typedef struct index_flow_build index_flow_build_t;
+
+/** a flow section being read, points into the mmap()ed index */
+struct index_flow
+{
+    uint64_t flow_cnt;          /** number of flows */
+    uint64_t bucket_cnt;        /** number of buckets */
+    const uint8_t *buckets;     /** bucket starts */
+    const uint8_t *flows;       /** flow entries */
+    const uint8_t *postings;    /** postings */
+    uint64_t postings_len;      /** bytes of postings */
+};
+typedef struct index_flow index_flow_t;
+
+/*
+ * Catalog file, describes many pcap.gz files and their indices:
+ *
+ *   0                   1                   2                   3   
+ *   0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                     Magic Number (32 bits)                    |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |    Version    |                   Reserved                    |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                    Capture Count (64 bits)                    |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                  String Table Length (64 bits)                |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                       Reserved (64 bits)                      |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * followed by Capture Count 64 byte entries and a string table of NUL
+ * terminated file names, all little endian. An entry is the first and last
+ * packet timestamps (microseconds), the largest last timestamp of it and
+ * every entry before it, the packet count, the index's mtime and the
+ * string table offsets of the pcap.gz and index names, 64 bits each plus
+ * 64 reserved. Entries are sorted by first timestamp; with the running
+ * maximum that finds the captures overlapping a time range by binary search.
+ */
+#define CPPIP_CATALOG_MAGIC   0xa1b2c3fc
+#define CPPIP_CATALOG_VERSION 1
+#define CPPIP_CATALOG_H_SIZ   32
+#define CPPIP_CATALOG_ENT_SIZ 64
+
+/** a catalog entry in memory */
+struct catalog_ent
+{
+    uint64_t first;             /** first packet timestamp, microseconds */
+    uint64_t last;              /** last packet timestamp, microseconds */
+    uint64_t max_last;          /** largest last of this and those before */
+    uint64_t pkt_cnt;           /** packets in the capture */
+    uint64_t mtime;             /** index mtime when it was catalogued */
+    char *pcap;                 /** pcap.gz file name */
+    char *index;                /** index file name */
+};
+typedef struct catalog_ent catalog_ent_t;
+
+/** walks one flow's postings */
+struct index_flow_iter
+{
+    const uint8_t *p;           /** next posting */
+    const uint8_t *end;         /** end of this flow's postings */
+    uint64_t offset;            /** last offset decoded */
+    uint64_t pkt_cnt;           /** packets in the flow */
+};
+typedef struct index_flow_iter index_flow_iter_t;
+
+/*
+ * Host section:
+ *
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                   Interval Count (64 bits)                    |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                    Index Level (32 bits)                      |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                      Reserved (32 bits)                       |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                   Filter Blocks (64 bits)                     |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |                       Reserved (64 bits)                      |
+ *  |                                                               |
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * followed by Interval Count 32 byte interval entries (64 bit first packet
+ * number, 64 bit virtual offset of that packet, 64 bit first filter block,
+ * 32 bit packet count and 32 bit filter block count) and the filters. Every
+ * Index Level packets get a blocked Bloom filter of the addresses and ports
+ * they carry, sized to what's in them, made of 64 byte blocks. An item sets
+ * CPPIP_HOST_K bits all inside one block so a lookup touches one cache line.
+ */
+#define CPPIP_HOST_H_SIZ    32
+#define CPPIP_HOST_ENT_SIZ  32
+#define CPPIP_HOST_BLK_SIZ  64
+#define CPPIP_HOST_K        7
+#define CPPIP_HOST_BITS     12  /** filter bits per distinct item */
+
+/** builds the host section while walking the pcap */
+struct index_host_build
+{
+    uint32_t level;             /** packets per interval */
+    uint8_t *ents;              /** interval entries, on-disk layout */
+    uint64_t ent_cnt;           /** intervals in ents */
+    uint64_t ent_siz;           /** capacity of ents */
+    uint64_t blk_cnt;           /** filter blocks written so far */
+    uint64_t pkt_num;           /** current interval: first packet */
+    uint64_t offset;            /** current interval: its offset */
+    uint32_t pkt_cnt;           /** current interval: packets so far */
+    uint64_t *items;            /** current interval: item hashes */
+    uint64_t item_cnt;          /** items in items */
+    uint64_t item_siz;          /** capacity of items */
+    FILE *spool;                /** filters */
+    writer_t w;                 /** buffers writes to spool */
+};
+typedef struct index_host_build index_host_build_t;
+
+/** a host section being read, points into the mmap()ed index */
+struct index_host
+{
+    uint64_t ent_cnt;           /** number of intervals */
+    uint32_t level;             /** packets per interval */
+    uint64_t blk_cnt;           /** number of filter blocks */
+    const uint8_t *ents;        /** interval entries */
+    const uint8_t *blks;        /** filter blocks */
+};
+typedef struct index_host index_host_t;
+
+/** what a host extraction looks for */
+struct host_target
+{
+    struct flow_endpoint ep;    /** address and/or port */
+    uint8_t fields;             /** which of them are set */
+#define HOST_F_ADDR 0x01
+#define HOST_F_PORT 0x02
+};
+typedef struct host_target host_target_t;
+
 struct indexing_level
 {
     uint32_t num;               /** used for pkt-num indexing */
+    uint32_t host;              /** used for host indexing */
     struct timeval ts;          /** used for timestamp indexing */
+    uint64_t bytes;             /** used for bytes indexing, 0 every block */
 };
 typedef struct indexing_level index_level_t;
 
 struct extract_packets
 {
-    uint32_t pkt_start;         /** pkt-num: starting packet to extract */
-    uint32_t pkt_stop;          /** pkt-num: last packet to extract */
+    uint64_t pkt_start;         /** pkt-num: starting packet to extract */
+    uint64_t pkt_stop;          /** pkt-num: last packet to extract */
     struct timeval ts_start;    /** timestamp: starting packet to extract */
     struct timeval ts_stop;     /** timestamp: last packet to extract */
-    uint32_t pkts_w;            /** number of packets written to pcap_new */
+    uint64_t pkts_w;            /** number of packets written to pcap_new */
+    int copied;                 /** packets were copied, not counted */
+    flow_key_t flow;            /** flow: the flow to extract */
+    host_target_t host;         /** host: the host and/or port to extract */
 };
 typedef struct extract_packets extract_pkts_t;
 
@@ -219,22 +768,83 @@ struct cppip_control_context
     uint8_t flags;              /** control flags */
 #define CPPIP_CTRL_DEBUG    0x01
 #define CPPIP_CTRL_TS_FM    0x02/** timestamp: fuzzy matching enabled */
+#define CPPIP_CTRL_BGZF     0x04/** write bgzip compressed output */
+#define CPPIP_CTRL_SPLIT    0x08/** ranges: one new pcap per range */
     BGZF *pcap;                 /** BGZF compressed pcap file */
+    int pcap_fd;                /** its file descriptor, closed with it */
     int index;                  /** index file */
     int pcap_new;               /** new pcap file */
     char *index_fname;          /** filename of indez file */
     char *pcap_fname;           /** filename of BGZF compressed pcap file */
     char *pcap_new_fname;       /** filename of new pcap file */
     int index_mode;             /** index mode as defined above */
+    int threads;                /** worker threads, 1 is single threaded */
     extract_pkts_t e_pkts;      /** first and last pkts marked for extract */
     index_level_t index_level;  /** indexing level (as per mode) */
     cppip_file_hdr_t cppip_h;   /** the CPPIP file header */
     cppip_index_pn_hdr_t cppip_index_pn_hdr;  /** index hdr: pkt-num */
     cppip_index_ts_hdr_t cppip_index_ts_hdr;  /** index hdr: timestamp */
+    int format;                 /** index file format version */
+    uint64_t pkt_cnt;           /** packets in pcap, any format */
+    uint8_t *index_map;         /** v2: the mmap()ed index file */
+    size_t index_map_siz;       /** v2: its size */
+    index_stream_t pn_stream;   /** pkt-num records */
+    index_stream_t ts_stream;   /** timestamp records */
+    index_stream_t by_stream;   /** bytes records */
+    index_ef_t ef;              /** packet offsets */
+    index_flow_t flow;          /** flows */
+    index_host_t host;          /** hosts per interval */
+    uint32_t linktype;          /** pcap link type */
+    char *filter_s;             /** -F filter expression */
+    void *filter;               /** compiled -F filter, see filter.c */
+    char **dirs;                /** catalog: directories to catalog */
+    int dir_cnt;                /** catalog: number of them */
+    char **inputs;              /** merge: index, pcap.gz file name pairs */
+    int input_cnt;              /** merge: number of file names */
+    char *ranges_fname;         /** -e ranges: file of ranges to extract */
+    char *sock_fname;           /** serve: Unix socket to listen on */
+    zout_t *zout;               /** -z: compresses what goes to pcap_new */
+    writer_t *pcap_w;           /** otherwise buffers what goes to it */
+    uint8_t *arena;             /** packets that straddle pcap.gz blocks */
+    size_t arena_siz;           /** size of arena */
+    int ra_depth;               /** -R: megabytes to read ahead, 0 for none */
+    int64_t ra_off;             /** extraction: read ahead up to here */
+    bcache_t *bcache;           /** shared inflated block cache, or NULL */
+    uint64_t pcap_id;           /** pcap's key in it, 0 until needed */
+    int pcapng;                 /** the pcap.gz is pcapng, see pcapng.c */
+    int ng_be;                  /** pcapng: the section is big endian */
+    pcapng_if_t ng_if[PCAPNG_IF_MAX]; /** pcapng: interfaces, by id */
+    int ng_if_cnt;              /** pcapng: number of them */
+    uint8_t ng_bh[PCAPNG_BH_SIZ]; /** pcapng: its type and length */
+    uint32_t ng_len;            /** pcapng: the length, decoded */
+    const uint8_t *ng_blk;      /** pcapng: the rest of it, where it lies */
+    uint32_t pcap_magic;        /** pcap: the file's magic, as read */
+    int pcap_swap;              /** pcap: not in our byte order */
+    int pcap_nsec;              /** pcap: nanosecond timestamps */
+    pcap_dec_t pcap_dec;        /** pcap: header decoder */
+    pcap_hdr_t pcap_hdr;        /** header reader, for extraction */
+    uint8_t pcap_rh[PCAP_PKTH_SIZ]; /** pcap: last header as read, if so */
+    uint32_t pcap_ns;           /** pcap: last header's nanoseconds */
     char errbuf[BUFSIZ];        /** errors go here */
 };
 typedef struct cppip_control_context cppip_t;
 
+/**
+ * Packet walker callback
+ * c:           pointer to the cppip control context
+ * pkt_num:     packet number, starting at 1
+ * offset:      BGZF virtual offset of the packet's pcap header
+ * pcap_h:      the packet's pcap header, decoded as extract_hdr() does
+ *              with the nanoseconds in c->pcap_ns
+ * data:        the first data_len bytes of the packet
+ * data_len:    the smaller of caplen and the walk's snap length
+ * arg:         caller supplied state
+ * returns:     1 to keep walking, -1 on error (c->errbuf should be set)
+ */
+typedef int (*pcap_walk_cb_t)(cppip_t *c, uint64_t pkt_num, uint64_t offset,
+        pcap_offline_pkthdr_t *pcap_h, const uint8_t *data, uint32_t data_len,
+        void *arg);
+
 
 /** FUNCTION PROTOTYPES */
 
@@ -245,15 +855,41 @@ typedef struct cppip_control_context cppip_t;
  * Returns: number of records written on success, -1 on error
  *
  * Function creates a cppip index file for use in subsequent extractions.
+ * Every mode set in c->index_mode is built in a single pass over the pcap.
  */
-int
+int64_t
 index_create(cppip_t *c);
 
-int
-index_by_pn(cppip_t *c);
+/**
+ * Walk every packet in the pcap
+ * c:           pointer to the cppip control context
+ * snap:        bytes of each packet cb wants to see, 0 for none
+ * cb:          called once per packet, in file order
+ * arg:         passed through to cb
+ * returns:     number of packets walked on success, -1 on error
+ *
+ * Walks from the current position of c->pcap to EOF. pcapng goes to
+ * pcapng_walk(), otherwise if c->threads > 1 the work is handed to
+ * pcap_walk_mt(). Packet data past snap is skipped, not copied.
+ */
+int64_t
+pcap_walk(cppip_t *c, uint32_t snap, pcap_walk_cb_t cb, void *arg);
 
-int
-index_by_ts(cppip_t *c);
+/**
+ * Walk every packet in the pcap using a pool of inflate threads
+ * c:           pointer to the cppip control context
+ * cb:          called once per packet, in file order, on the calling thread
+ * arg:         passed through to cb
+ * returns:     number of packets walked on success, -1 on error
+ *
+ * Reads the compressed file in large chunks, has c->threads workers inflate
+ * the BGZF blocks of each chunk concurrently and stitches packet boundaries
+ * back together across blocks. Callbacks see exactly what pcap_walk() would
+ * hand them, offsets included. A reader thread keeps about c->ra_depth
+ * megabytes read ahead of the inflaters.
+ */
+int64_t
+pcap_walk_mt(cppip_t *c, uint32_t snap, pcap_walk_cb_t cb, void *arg);
 
 /** 
  * Verify an index file
@@ -291,81 +927,866 @@ int
 extract(cppip_t *c);
 
 /**
- * Simple help blurb 
+ * Initialize a buffered writer
+ * w:           writer to initialize
+ * fd:          file to write to
+ * off:         file offset the first byte will be written at
+ * siz:         size of the buffer, WRITER_BUF_SIZ is a good choice
+ * errbuf:      errors if any go here
+ * returns:     1 on success, -1 on error
+ *
+ * Writers use pwrite() at their own offset so headers can be filled in
+ * later without disturbing them. An off of -1 writes sequentially with
+ * write() instead, which works on pipes.
  */
 int
-usage();
+writer_init(writer_t *w, int fd, off_t off, size_t siz, char *errbuf);
 
-/** 
- * Skip BGZF bytes
- * f:           BGZF file pointer
- * skip_bytes:  number of bytes to skip
- * returns: 1 on success, -1 if bgzf_getc() fails
+/**
+ * Queue data on a buffered writer
+ * w:           writer
+ * data:        bytes to write
+ * len:         number of bytes
+ * errbuf:      errors if any go here
+ * returns:     1 on success, -1 on error
  *
- * Skip over portions of bgzf file we're not interested in 
+ * Data is copied into the buffer which is flushed with one write when full.
  */
 int
-bgzf_skip(BGZF *f, int skip_bytes);
+writer_add(writer_t *w, const void *data, size_t len, char *errbuf);
 
 /**
- * Linear search for start packet
- * in:          BGZF compressed pcap file
- * start:       starting packet
- * pkt_first:   first packet we're looking for to kick off the extraction
+ * Flush a buffered writer
+ * w:           writer
  * errbuf:      errors if any go here
  * returns:     1 on success, -1 on error
- *
- * Given a starting point it will sequentially step through the pcap until
- * finding the starting packet.
  */
 int
-linear_search(cppip_t *c, int start, int pkt_first);
+writer_flush(writer_t *w, char *errbuf);
 
-int
-linear_search_ts(cppip_t *c, struct timeval *, pcap_offline_pkthdr_t *pcap_h);
+/**
+ * Release a buffered writer's buffer (does not flush or close fd)
+ */
+void
+writer_free(writer_t *w);
 
 /**
- * Verify packet range from command line
- * pkt_range:   User supplied packet range
- * pkt_first:   will hold the first packet
- * pkt_last:    will hold the ending packet
+ * Start bgzip compressed output
+ * z:           output to initialize
+ * fd:          file to write to, at its current position
+ * threads:     compression threads, 1 compresses inline
+ * errbuf:      errors if any go here
  * returns:     1 on success, -1 on error
  *
- * Function will ensure user supplied packet range is legal and conforming (ie:
- * all numerics of the form: "n or n-m", first packet is less than second packet).
+ * With more than one thread full blocks are compressed in parallel and
+ * written back in order, zout_flush() waits for all of them.
  */
 int
-pkt_range_check(char *pkt_range, uint32_t *pkt_first, uint32_t *pkt_last);
+zout_init(zout_t *z, int fd, int threads, char *errbuf);
 
+/**
+ * Queue data on compressed output, each full block is compressed as it
+ * fills
+ * returns:     1 on success, -1 on error
+ */
 int
-opt_parse_extract(char *opt_s, cppip_t *c);
+zout_add(zout_t *z, const void *data, size_t len, char *errbuf);
 
+/**
+ * Compress and write whatever is waiting as a (short) block of its own
+ * returns:     1 on success, -1 on error
+ */
 int
-opt_parse_index(char *opt_s, cppip_t *c);
+zout_flush(zout_t *z, char *errbuf);
 
+/**
+ * Copy whole compressed blocks from another bgzip file as they are
+ * z:           output
+ * fd:          the bgzip file
+ * off:         file offset of the first block
+ * len:         bytes to copy, whole blocks only
+ * errbuf:      errors if any go here
+ * returns:     1 on success, -1 on error
+ *
+ * Anything waiting is flushed first so blocks stay in order.
+ */
 int
-extract_by_pn(cppip_t *c);
+zout_copy(zout_t *z, int fd, off_t off, off_t len, char *errbuf);
 
+/**
+ * Flush and end the output with the bgzip EOF block (fd stays open)
+ * returns:     1 on success, -1 on error
+ */
 int
-extract_by_ts(cppip_t *c);
-
-cppip_t *
-control_context_init(uint8_t flags, char *index_fname, char *pcap, char *pcap_new, 
-char *opt_s, int mode, char *errbuf);
+zout_close(zout_t *z, char *errbuf);
 
 void
-control_context_destroy(cppip_t *c);
+zout_free(zout_t *z);
 
-int
-cppip_dispatch(int mode, cppip_t *c);
+/**
+ * Start a cache of inflated pcap.gz blocks
+ * siz:         memory budget in bytes, at least one block is kept
+ * errbuf:      errors if any go here
+ * returns:     the cache, NULL on error
+ *
+ * Blocks are keyed by file and compressed offset and are evicted with the
+ * clock algorithm once the budget is used up. The cache is safe to share
+ * between threads, each with its own BGZF handles.
+ */
+bcache_t *
+bcache_new(size_t siz, char *errbuf);
 
-int 
-index_open(char *index_fname, int mode, cppip_t *c, char *errbuf);
+void
+bcache_free(bcache_t *bc);
 
-int
-index_dump_modes();
+/** the key of the file open on fd, the same for every handle on it */
+uint64_t
+bcache_id(int fd);
 
+/**
+ * Seek to a virtual offset and load its block, from the cache if it's there
+ * bc:          the cache
+ * id:          bcache_id() of f
+ * f:           BGZF file pointer
+ * fd:          its file descriptor, from bgzf_open_fd()
+ * offset:      virtual offset
+ * returns:     1 on success, 0 at EOF, -1 on error
+ */
+int
+bcache_load(bcache_t *bc, uint64_t id, BGZF *f, int fd, int64_t offset);
+
+/** bgzf_read() with every block it moves on to loaded by bcache_load() */
+int
+bcache_read(bcache_t *bc, uint64_t id, BGZF *f, int fd, void *buf, int len);
+
+/** bgzf_view() with every block it moves on to loaded by bcache_load() */
+const uint8_t *
+bcache_view(bcache_t *bc, uint64_t id, BGZF *f, int fd, int len,
+        uint8_t **arena, size_t *arena_siz);
+
+/** blocks found in and missing from the cache so far */
+void
+bcache_stats(bcache_t *bc, uint64_t *hits, uint64_t *misses);
+
+/**
+ * Simple help blurb 
+ */
+int
+usage();
+
+/** 
+ * Skip BGZF bytes
+ * f:           BGZF file pointer
+ * fd:          its file descriptor, from bgzf_open_fd()
+ * skip_bytes:  number of bytes to skip, no more than UINT32_MAX
+ * returns: 1 on success, -1 on error or if we run out of file
+ *
+ * Skip over portions of bgzf file we're not interested in. Skips that land
+ * inside the currently inflated block just move the block offset. Longer
+ * skips walk the compressed block headers/footers and only inflate the
+ * block the skip lands in.
+ */
+int
+bgzf_skip(BGZF *f, int fd, size_t skip_bytes);
+
+/**
+ * Look at the next BGZF bytes without copying them
+ * f:           BGZF file pointer
+ * fd:          its file descriptor, from bgzf_open_fd()
+ * len:         number of bytes
+ * arena:       buffer for bytes that straddle blocks, grown as needed
+ * arena_siz:   its size
+ * returns: the bytes, NULL on error or if we run out of file
+ *
+ * Bytes wholly inside the inflated block are handed out where they lie,
+ * only those that run into the next block are copied, into the arena. The
+ * pointer is good until the next read from f.
+ */
+const uint8_t *
+bgzf_view(BGZF *f, int fd, int len, uint8_t **arena, size_t *arena_siz);
+
+/**
+ * Keep the kernel reading the compressed file ahead of f
+ * f:           BGZF file pointer
+ * fd:          its file descriptor, from bgzf_open_fd()
+ * ahead:       file offset read ahead up to so far, 0 to start
+ * depth:       READAHEAD_CHUNK_SIZ chunks to keep ahead, 0 for none
+ *
+ * Cheap enough to call per packet, the kernel is asked for more a chunk at
+ * a time (posix_fadvise()) and reads it asynchronously while the blocks
+ * before it are inflated. A seek starts the window over.
+ */
+void
+bgzf_readahead(BGZF *f, int fd, int64_t *ahead, int depth);
+
+/**
+ * Read BGZF block framing
+ * fd:          file descriptor of the BGZF file, from bgzf_open_fd()
+ * addr:        compressed file offset of the block
+ * bsize:       will hold the total compressed size of the block
+ * isize:       will hold the uncompressed size of the block
+ * returns:     1 on success, 0 at EOF, -1 on error
+ *
+ * Peeks at a block's header and footer with pread() so the BGZF stream
+ * position is left untouched.
+ */
+int
+bgzf_block_info(int fd, int64_t addr, int *bsize, int *isize);
+
+/**
+ * Open a BGZF file for reading on a descriptor we keep
+ * fname:       file to open
+ * fd:          will hold its file descriptor
+ * returns:     the BGZF file pointer, NULL on error with errno set
+ *
+ * BGZF only fills in file_descriptor when tabix is built without knetfile,
+ * so anything that needs to pread(), fstat() or posix_fadvise() the file
+ * uses this descriptor instead. bgzf_close() closes it.
+ */
+BGZF *
+bgzf_open_fd(const char *fname, int *fd);
+
+/**
+ * Linear search for start packet
+ * in:          BGZF compressed pcap file
+ * start:       starting packet
+ * pkt_first:   first packet we're looking for to kick off the extraction
+ * errbuf:      errors if any go here
+ * returns:     1 on success, -1 on error
+ *
+ * Given a starting point it will sequentially step through the pcap until
+ * finding the starting packet.
+ */
+int
+linear_search(cppip_t *c, uint64_t start, uint64_t pkt_first);
+
+int
+linear_search_ts(cppip_t *c, struct timeval *, pcap_offline_pkthdr_t *pcap_h);
+
+/**
+ * Locate v1 index records
+ * c:           pointer to the cppip control context (index verified)
+ * mode:        CPPIP_INDEX_PN or CPPIP_INDEX_TS
+ * returns:     file offset of the first record for mode
+ */
+off_t
+index_records_offset(cppip_t *c, int mode);
+
+/**
+ * Fetch a record from an index stream
+ * c:           pointer to the cppip control context (index verified)
+ * s:           the stream, ie: &c->pn_stream
+ * i:           record number, from 0
+ * rec:         will hold the record
+ * returns:     1 on success, -1 on error
+ *
+ * Works for v1 and v2 index files. Reading a v2 stream sequentially only
+ * decodes each record once.
+ */
+int
+index_stream_get(cppip_t *c, index_stream_t *s, uint64_t i,
+        cppip_record_t *rec);
+
+/**
+ * Binary search an index stream
+ * c:           pointer to the cppip control context (index verified)
+ * s:           the stream, ie: &c->ts_stream
+ * key:         CPPIP_REC_F_PKT or CPPIP_REC_F_TS, the field to search on
+ * target:      holds the packet number or timestamp we're after
+ * rec:         will hold the last record with key <= target's, or the
+ *              first record if target comes before all of them
+ * returns:     index of rec on success, -1 on error
+ */
+int64_t
+index_stream_search(cppip_t *c, index_stream_t *s, int key,
+        cppip_record_t *target, cppip_record_t *rec);
+
+/**
+ * Find where to seek for the first packet stamped ts or later
+ * c:           pointer to the cppip control context (index verified)
+ * s:           the stream, ie: &c->ts_stream
+ * ts:          the timestamp we're after
+ * rec:         will hold the last record stamped before ts, or the first
+ *              record if there's none
+ * returns:     index of rec on success, -1 on error
+ */
+int64_t
+index_stream_search_ts(cppip_t *c, index_stream_t *s, struct timeval *ts,
+        cppip_record_t *rec);
+
+/**
+ * Verify a version 2 index file
+ * c:           pointer to the cppip control context
+ * returns:     1 on success, -1 on error
+ *
+ * mmap()s the index, checks the header and section table and sets up
+ * c->pn_stream / c->ts_stream. The v1 header structs in c are filled in
+ * too so existing reporting works.
+ */
+int
+index_verify_v2(cppip_t *c);
+
+/**
+ * Start a v2 record stream
+ * s:           stream to initialize
+ * mode:        section type (index mode)
+ * fields:      CPPIP_REC_F_* to store
+ * level:       index level to record in the section header
+ * errbuf:      errors if any go here
+ * returns:     1 on success, -1 on error
+ */
+int
+index_v2_stream_init(index_v2_stream_t *s, int mode, int fields,
+        uint64_t level, char *errbuf);
+
+/**
+ * Add a record to a v2 record stream
+ * returns:     1 on success, -1 on error
+ */
+int
+index_v2_stream_add(index_v2_stream_t *s, cppip_record_t *rec, char *errbuf);
+
+void
+index_v2_stream_free(index_v2_stream_t *s);
+
+/**
+ * Describe a finished v2 record stream as a section
+ * s:           the stream, its spool gets flushed
+ * sect:        will hold the section
+ * errbuf:      errors if any go here
+ * returns:     1 on success, -1 on error
+ */
+int
+index_v2_stream_section(index_v2_stream_t *s, index_v2_section_t *sect,
+        char *errbuf);
+
+/**
+ * Write a v2 index file
+ * c:           pointer to the cppip control context, c->pkt_cnt and
+ *              c->cppip_h.ts_created should be set
+ * sects:       the sections to write, in section table order
+ * n:           number of sections
+ * returns:     1 on success, -1 on error
+ *
+ * Lays out header, section table, then each section's contents, all
+ * through one buffered writer.
+ */
+int
+index_v2_write(cppip_t *c, index_v2_section_t *sects, int n);
+
+/**
+ * Start building a packet offset (Elias-Fano) section
+ * returns:     1 on success, -1 on error
+ */
+int
+index_ef_init(index_ef_build_t *b, char *errbuf);
+
+/**
+ * Add the next packet's BGZF virtual offset, in file order
+ * returns:     1 on success, -1 on error
+ */
+int
+index_ef_add(index_ef_build_t *b, uint64_t offset, char *errbuf);
+
+/**
+ * Encode everything added so far and describe it as a section
+ * b:           the builder
+ * sect:        will hold the section
+ * errbuf:      errors if any go here
+ * returns:     1 on success, -1 on error
+ */
+int
+index_ef_section(index_ef_build_t *b, index_v2_section_t *sect,
+        char *errbuf);
+
+void
+index_ef_free(index_ef_build_t *b);
+
+/**
+ * Point an index_ef_t at a packet offset section
+ * c:           pointer to the cppip control context
+ * p:           the section
+ * len:         its length
+ * returns:     1 on success, -1 on error
+ */
+int
+index_ef_load(cppip_t *c, const uint8_t *p, uint64_t len);
+
+/**
+ * Look up a packet's BGZF virtual offset
+ * c:           pointer to the cppip control context (index verified)
+ * pkt_num:     packet number, from 1
+ * offset:      will hold the offset of the packet's pcap header
+ * returns:     1 on success, -1 on error
+ *
+ * Constant time: one select sample, a short popcount scan, no decoding of
+ * neighbours.
+ */
+int
+index_ef_get(cppip_t *c, uint64_t pkt_num, uint64_t *offset);
+
+/** little endian encode/decode and varints for the v2 format */
+void
+le16enc(uint8_t *p, uint16_t v);
+
+void
+le32enc(uint8_t *p, uint32_t v);
+
+void
+le64enc(uint8_t *p, uint64_t v);
+
+uint16_t
+le16dec(const uint8_t *p);
+
+uint32_t
+le32dec(const uint8_t *p);
+
+uint64_t
+le64dec(const uint8_t *p);
+
+/** timestamps go on disk as microseconds */
+uint64_t
+ts_to_usec(struct timeval *ts);
+
+void
+usec_to_ts(uint64_t usec, struct timeval *ts);
+
+/** returns number of bytes written to p, at most 10 */
+int
+varint_enc(uint8_t *p, uint64_t v);
+
+/** advances *p past the varint, returns 1 on success, -1 if past end */
+int
+varint_dec(const uint8_t **p, const uint8_t *end, uint64_t *v);
+
+/**
+ * Verify packet range from command line
+ * pkt_range:   User supplied packet range
+ * pkt_first:   will hold the first packet
+ * pkt_last:    will hold the ending packet
+ * returns:     1 on success, -1 on error
+ *
+ * Function will ensure user supplied packet range is legal and conforming (ie:
+ * all numerics of the form: "n or n-m", first packet is less than second packet).
+ */
+int
+pkt_range_check(char *pkt_range, uint64_t *pkt_first, uint64_t *pkt_last);
+
+int
+opt_parse_extract(char *opt_s, cppip_t *c);
+
+int
+opt_parse_index(char *opt_s, cppip_t *c);
+
+int
+extract_by_pn(cppip_t *c);
+
+int
+extract_by_ts(cppip_t *c);
+
+int
+extract_by_flow(cppip_t *c);
+
+/**
+ * Start extracting from a pcap.gz
+ * c:           pointer to the cppip control context
+ * pcap_fh:     BUFSIZ bytes, will hold the pcap file header, or the pcapng
+ *              blocks before the first packet
+ * returns:     length of the header on success, -1 on error
+ *
+ * Reads the file header, notes the link type and compiles any -F filter
+ * for it. The magic picks the record header decoder for a byte swapped or
+ * nanosecond pcap, anything that's neither pcap nor pcapng is an error.
+ * The caller decides whether the header gets written, as it was read.
+ */
+int
+extract_open(cppip_t *c, uint8_t *pcap_fh);
+
+/**
+ * Read a 32-bit pcap file header field in the capture's byte order
+ * returns:     the field
+ */
+uint32_t
+extract_fh32(cppip_t *c, const uint8_t *p);
+
+/**
+ * The packet header extract_hdr() just read, the way the capture has it
+ * returns:     pcap_h itself unless the capture needed decoding
+ */
+const void *
+extract_rh(cppip_t *c, pcap_offline_pkthdr_t *pcap_h);
+
+/**
+ * Write to the new pcap, through the compressor with -z or the buffer
+ * returns:     1 on success, -1 on error
+ */
 int
+extract_write(cppip_t *c, const void *data, size_t len);
+
+/**
+ * Get everything written so far out to the new pcap
+ * returns:     1 on success, -1 on error
+ */
+int
+extract_close(cppip_t *c);
+
+/**
+ * Seek the pcap.gz to a virtual offset, through the block cache if any
+ * returns:     1 on success, -1 on error
+ */
+int
+extract_seek(cppip_t *c, uint64_t offset);
+
+/**
+ * Read bytes from the pcap.gz, through the block cache if any
+ * returns:     bytes read as bgzf_read(), 0 at EOF
+ */
+int
+extract_bytes(cppip_t *c, void *buf, int len);
+
+/**
+ * Look at the next bytes of the pcap.gz, through the block cache if any
+ * returns:     the bytes, valid until the next read, NULL on error or EOF
+ */
+const uint8_t *
+extract_view(cppip_t *c, int len);
+
+/**
+ * Read a packet's header, through the block cache if any. pcapng blocks
+ * that aren't packets are stepped over and the EPB is read whole, its
+ * header handed back as a pcap one. A pcap header comes back in our byte
+ * order and microseconds whatever the capture's, the nanoseconds past
+ * those are left in c->pcap_ns.
+ * returns:     PCAP_PKTH_SIZ on success, 0 at EOF, other values on error
+ */
+int
+extract_hdr(cppip_t *c, pcap_offline_pkthdr_t *pcap_h);
+
+/**
+ * Write out a packet extract_read() found at p, as a pcap header and the
+ * packet or as the pcapng block it came in
+ * returns:     1 on success, -1 on error
+ */
+int
+extract_keep(cppip_t *c, pcap_offline_pkthdr_t *pcap_h, const uint8_t *p);
+
+/** step over the packet whose header was just read */
+int
+extract_skip(cppip_t *c, pcap_offline_pkthdr_t *pcap_h);
+
+/**
+ * Get at the packet whose pcap header was just read, where it lies in the
+ * inflated block when it can. Any caplen goes.
+ * returns:     the packet, valid until the next read, NULL on error
+ */
+const uint8_t *
+extract_read(cppip_t *c, pcap_offline_pkthdr_t *pcap_h);
+
+/**
+ * Open an indexed pcap.gz to extract from
+ * flags:       control flags
+ * index:       index file name
+ * pcap:        pcap.gz file name
+ * need:        index modes the index must have, ie: CPPIP_INDEX_TS
+ * errbuf:      errors if any go here
+ * returns:     a verified control context with no output, NULL on error
+ */
+cppip_t *
+extract_source(uint8_t flags, char *index, char *pcap, int need,
+        char *errbuf);
+
+/**
+ * Build or update a catalog
+ * c:           pointer to the cppip control context, the catalog is the
+ *              index file and c->dirs the directories to catalog
+ * returns:     number of captures catalogued, -1 on error
+ *
+ * Each name.pcap.gz with a name.cppip or name.pcap.gz.cppip index that has
+ * a timestamp index is catalogued. Captures whose index hasn't changed
+ * since they were last catalogued aren't read again.
+ */
+int
+catalog_build(cppip_t *c);
+
+/**
+ * Extract a time range from every catalogued capture it overlaps
+ * c:           pointer to the cppip control context, the catalog is the
+ *              index file and e_pkts holds the time range
+ * returns:     1 on success, -1 on error
+ */
+int
+catalog_extract(cppip_t *c);
+
+/**
+ * Extract every range in a ranges file in one pass over the pcap.gz
+ * c:           pointer to the cppip control context (index verified),
+ *              c->ranges_fname names the file
+ * returns:     1 on success, -1 on error
+ *
+ * The ranges are picked up in the order they start in the pcap.gz and the
+ * pass only moves forward, seeking over the gaps between them that cost
+ * more to read than to jump. Into one new
+ * pcap overlapping ranges are coalesced and each packet is written once,
+ * with -s range n gets new.pcap.n to itself.
+ */
+int
+batch_extract(cppip_t *c);
+
+/**
+ * Extract a time range from several pcap.gz files into one, in time order
+ * c:           pointer to the cppip control context, c->inputs holds the
+ *              index and pcap.gz names and e_pkts the time range
+ * returns:     1 on success, -1 on error
+ *
+ * Each input is decompressed and filtered by its own thread, the packets
+ * are merged on timestamp with a heap as they arrive.
+ */
+int
+merge_extract(cppip_t *c);
+
+/**
+ * Read the pcapng blocks before the first packet
+ * c:           pointer to the cppip control context, c->pcap just opened
+ * fh:          BUFSIZ bytes, will hold the blocks
+ * returns:     their length on success, -1 on error
+ *
+ * Notes the byte order and every interface, leaves c->pcap at the first
+ * packet. One section per file, with all its interfaces up front. Sets
+ * c->pcap_nsec if any interface's timestamps are finer than a usec.
+ */
+int
+pcapng_open(cppip_t *c, uint8_t *fh);
+
+/**
+ * Read on to the next Enhanced Packet Block
+ * c:           pointer to the cppip control context
+ * pcap_h:      will hold the packet's header, timestamp in microseconds
+ *              with the nanoseconds past them in c->pcap_ns
+ * returns:     PCAP_PKTH_SIZ on success, 0 at EOF, -1 on error
+ *
+ * The EPB is left in c->ng_bh and c->ng_blk and c->linktype is set to its
+ * interface's.
+ */
+int
+pcapng_hdr(cppip_t *c, pcap_offline_pkthdr_t *pcap_h);
+
+/** pcap_walk() for pcapng, always single threaded */
+int64_t
+pcapng_walk(cppip_t *c, uint32_t snap, pcap_walk_cb_t cb, void *arg);
+
+/**
+ * Extract a packet number range on c->threads threads
+ * c:           pointer to the cppip control context, the pcap header is
+ *              written and e_pkts holds the range
+ * returns:     1 on success, -1 on error
+ *
+ * The range is split at index records into pieces a megabyte or so of
+ * compressed pcap apart. Workers, each with its own pcap.gz handle,
+ * inflate and filter pieces into memory and the pieces are written out in
+ * order, so the output is what extract_by_pn() would have written.
+ */
+int
+pull_extract(cppip_t *c);
+
+/**
+ * Answer extraction requests on a Unix socket until SIGINT or SIGTERM
+ * c:           pointer to the cppip control context, c->inputs holds the
+ *              index and pcap.gz names, c->sock_fname the socket and
+ *              c->threads the number of workers
+ * returns:     1 on success, -1 on error
+ *
+ * The indices are verified and mapped once, each worker keeps its own
+ * pcap.gz handles open between requests. A request is one line,
+ * "extract_string capture [filter]", and is answered with the pcap or
+ * with "error: " and why.
+ */
+int
+serve(cppip_t *c);
+
+int
+extract_by_host(cppip_t *c);
+
+/**
+ * Find the flow a packet belongs to
+ * linktype:    pcap link type
+ * p:           packet data
+ * len:         bytes of it we have
+ * key:         will hold the flow key
+ * returns:     1 if the packet is IPv4 or IPv6, 0 if not
+ */
+int
+flow_key_get(uint32_t linktype, const uint8_t *p, uint32_t len,
+        flow_key_t *key);
+
+/**
+ * Parse a flow from the command line
+ * s:           "proto:addr:port,addr:port", IPv6 addresses in brackets,
+ *              ports may be left off
+ * key:         will hold the flow key
+ * errbuf:      errors if any go here
+ * returns:     1 on success, -1 on error
+ */
+int
+flow_parse(char *s, flow_key_t *key, char *errbuf);
+
+/** printable flow key, returns a per-thread static buffer */
+char *
+flow_key_str(flow_key_t *key);
+
+int
+index_flow_init(index_flow_build_t *b, char *errbuf);
+
+/**
+ * Record a packet of a flow, in file order
+ * returns:     1 on success, -1 on error
+ */
+int
+index_flow_add(index_flow_build_t *b, flow_key_t *key, uint64_t offset,
+        char *errbuf);
+
+/**
+ * Describe everything added so far as a section
+ * returns:     1 on success, -1 on error
+ *
+ * Postings are spooled while walking and put in flow order when the section
+ * is written, a bounded slice of flows per pass over the spool.
+ */
+int
+index_flow_section(index_flow_build_t *b, index_v2_section_t *sect,
+        char *errbuf);
+
+void
+index_flow_free(index_flow_build_t *b);
+
+/**
+ * Point c->flow at a flow section
+ * returns:     1 on success, -1 on error
+ */
+int
+index_flow_load(cppip_t *c, const uint8_t *p, uint64_t len);
+
+/**
+ * Look up a flow
+ * c:           pointer to the cppip control context (index verified)
+ * key:         the flow
+ * it:          will walk the flow's packets
+ * returns:     1 if found, 0 if not, -1 on error
+ */
+int
+index_flow_find(cppip_t *c, flow_key_t *key, index_flow_iter_t *it);
+
+/**
+ * Next packet of a flow
+ * returns:     1 with offset set, 0 when done, -1 on error
+ */
+int
+index_flow_next(cppip_t *c, index_flow_iter_t *it, uint64_t *offset);
+
+/**
+ * Parse a host and/or port from the command line
+ * s:           "addr", "addr:port" or "*:port", IPv6 addresses in brackets
+ * t:           will hold the target
+ * errbuf:      errors if any go here
+ * returns:     1 on success, -1 on error
+ */
+int
+host_parse(char *s, host_target_t *t, char *errbuf);
+
+/**
+ * Does a packet carry the target host and/or port
+ * returns:     1 if one of its endpoints matches, 0 if not
+ */
+int
+host_match(host_target_t *t, flow_key_t *key);
+
+int
+index_host_init(index_host_build_t *b, uint32_t level, char *errbuf);
+
+/**
+ * Record a packet, in file order
+ * key:         the packet's flow key or NULL if it isn't IP
+ * returns:     1 on success, -1 on error
+ */
+int
+index_host_add(index_host_build_t *b, uint64_t pkt_num, uint64_t offset,
+        flow_key_t *key, char *errbuf);
+
+/**
+ * Close the last interval and describe them all as a section
+ * returns:     1 on success, -1 on error
+ */
+int
+index_host_section(index_host_build_t *b, index_v2_section_t *sect,
+        char *errbuf);
+
+void
+index_host_free(index_host_build_t *b);
+
+/**
+ * Point c->host at a host section
+ * returns:     1 on success, -1 on error
+ */
+int
+index_host_load(cppip_t *c, const uint8_t *p, uint64_t len);
+
+/**
+ * Could an interval hold packets of the target
+ * i:           interval number
+ * returns:     1 if it might, 0 if it certainly doesn't
+ */
+int
+index_host_maybe(cppip_t *c, uint64_t i, host_target_t *t);
+
+/**
+ * Compile the -F filter expression for the pcap's link type, or for each
+ * link type among a pcapng's interfaces
+ * c:           pointer to the cppip control context, linktype set
+ * returns:     1 on success, -1 on error (or if built without libpcap)
+ */
+int
+filter_init(cppip_t *c);
+
+/**
+ * Run the compiled filter over a packet where it lies
+ * p:           packet data
+ * caplen:      bytes of it we have
+ * len:         its length on the wire
+ * returns:     1 if the filter accepts it, 0 if not
+ */
+int
+filter_match(cppip_t *c, const uint8_t *p, uint32_t caplen, uint32_t len);
+
+void
+filter_free(cppip_t *c);
+
+/**
+ * Move to a BGZF virtual offset
+ * f:           BGZF file pointer
+ * offset:      where to go
+ * returns:     1 on success, -1 on error
+ *
+ * Offsets inside the block that's already inflated don't inflate it again.
+ */
+int
+bgzf_goto(BGZF *f, int64_t offset);
+
+cppip_t *
+control_context_init(uint8_t flags, char *index_fname, char *pcap, char *pcap_new, 
+char *opt_s, int mode, char *errbuf);
+
+void
+control_context_destroy(cppip_t *c);
+
+int
+cppip_dispatch(int mode, cppip_t *c);
+
+int 
+index_open(char *index_fname, int mode, cppip_t *c, char *errbuf);
+
+int
+index_dump_modes();
+
+int64_t
 index_dispatch(cppip_t *c);
 
 void
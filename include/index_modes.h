@@ -33,6 +33,10 @@ char *index_modes[] =
 {
     "pkt-num",
     "timestamp",
+    "pkt-offset",
+    "flow",
+    "host",
+    "bytes",
     NULL
 };
 
@@ -45,7 +49,26 @@ char *index_help[]  =
 \t\t\tfollowed by a timerange specifier which can be one of\n\
 \t\t\tfollowing:\n\
 \t\t\td - days\n\t\t\th - hours\n\t\t\tm - minutes\n\t\t\ts - seconds\n\
-\t\t\tTo index every 100 seconds:\t-i timestamp:100s\n",
+\t\t\tTo index every 100 seconds:\t-i timestamp:100s\n\n",
+    "pkt-offset:\t\tno index_level, records every packet's offset in a\n\
+\t\t\tfew bits so pkt-num extractions seek straight to\n\
+\t\t\tthe first packet:\t-i pkt-offset\n\n",
+    "flow:\t\t\tno index_level, records which packets belong to each\n\
+\t\t\tIPv4/IPv6 5-tuple (both directions) so they can be\n\
+\t\t\textracted with -e flow:proto:addr:port,addr:port\n\
+\t\t\tTo index flows:\t\t-i flow\n\n",
+    "host:\t\t\tindex_level is a number of packets, each run of that\n\
+\t\t\tmany gets a Bloom filter of its addresses and ports so\n\
+\t\t\t-e host:addr[:port] only reads runs that may match\n\
+\t\t\tTo filter every 1000 packets:\t-i host:1000\n\n",
+    "bytes:\t\t\tindex_level is a number of bytes, k or m for kilo or\n\
+\t\t\tmegabytes, or `block' for every BGZF block. A record\n\
+\t\t\tof packet number and timestamp goes in each time that\n\
+\t\t\tmuch pcap has gone by, so pkt-num and timestamp\n\
+\t\t\textractions never read more than that past their seek\n\
+\t\t\tTo mark every megabyte:\t-i bytes:1m\n\n",
+    "multiple:\t\tseparate modes with commas to build them in one pass\n\
+\t\t\tTo index both ways:\t-i pkt-num:1000,timestamp:1s\n",
     NULL
 };
 
@@ -60,6 +83,10 @@ int index_types[] =
 {
     CPPIP_INDEX_PN,
     CPPIP_INDEX_TS,
+    CPPIP_INDEX_EF,
+    CPPIP_INDEX_FLOW,
+    CPPIP_INDEX_HOST,
+    CPPIP_INDEX_BYTES,
     0
 };
 
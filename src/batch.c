@@ -0,0 +1,756 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * batch.c: many packet number and timestamp ranges in one forward pass
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "../include/cppip.h"
+#include <ctype.h>
+
+/**
+ * What a seek is worth in compressed bytes. Landing in another block
+ * inflates it and breaks up sequential reading, so a gap shorter than
+ * this is read through rather than jumped.
+ */
+#define BATCH_SEEK_COST BGZF_BLOCK_MAX_SIZ
+
+/** one range from the ranges file and how far the pass has got with it */
+struct batch_range
+{
+    int mode;                   /** CPPIP_INDEX_PN or CPPIP_INDEX_TS */
+    int seq;                    /** its place in the ranges file, from 1 */
+    uint64_t pkt_start;         /** pkt-num: first packet */
+    uint64_t pkt_stop;          /** pkt-num: last packet */
+    struct timeval ts_start;    /** timestamp: first wanted */
+    struct timeval ts_stop;     /** timestamp: last wanted */
+    uint64_t off;               /** where the pass picks it up */
+    uint64_t first;             /** roughly where its first packet is */
+    uint64_t last;              /** roughly where its last packet is */
+    int from;                   /** planned to scan on from this range */
+    uint64_t skip;              /** pkt-num: packets from off to pass over */
+    uint64_t take;              /** pkt-num: packets left to write */
+    int want;                   /** the current packet is in the range */
+    int done;                   /** the range is through */
+    uint64_t pkts_w;            /** packets written for it */
+    int fd;                     /** -s: its own new pcap */
+    writer_t w;                 /** -s: buffers it */
+    zout_t *zout;               /** -s -z: compresses it */
+};
+
+/**
+ * Read the ranges file, one pkt-num or timestamp range per line in the
+ * same form as -e takes them, or just a packet number. Blank lines and #
+ * comments are skipped.
+ */
+static int
+batch_load(cppip_t *c, struct batch_range **rs, int *cnt)
+{
+    FILE *fp;
+    char *line, *s, *e, num[32];
+    size_t siz;
+    int n, alloc, lineno, ret;
+    struct batch_range *r;
+    extract_pkts_t e_pkts;
+
+    fp = fopen(c->ranges_fname, "r");
+    if (fp == NULL)
+    {
+        snprintf(c->errbuf, BUFSIZ, "can't open %s: %s\n", c->ranges_fname,
+                strerror(errno));
+        return -1;
+    }
+    line   = NULL;
+    siz    = 0;
+    n      = 0;
+    alloc  = 0;
+    ret    = -1;
+    e_pkts = c->e_pkts;
+    for (lineno = 1; getline(&line, &siz, fp) != -1; lineno++)
+    {
+        s = line + strspn(line, " \t");
+        e = s + strcspn(s, "#\r\n");
+        while (e > s && isspace((unsigned char)e[-1]))
+        {
+            e--;
+        }
+        *e = '\0';
+        if (*s == '\0')
+        {
+            continue;
+        }
+        /** a bare packet number, as alert lists have them */
+        if (s[strspn(s, "0123456789")] == '\0')
+        {
+            snprintf(num, sizeof (num), "pkt-num:%.20s", s);
+            s = num;
+        }
+        /** each line is parsed as -e would, into e_pkts */
+        if (strncmp(s, "ranges:", 7) == 0 || opt_parse_extract(s, c) == -1 ||
+                (c->index_mode != CPPIP_INDEX_PN &&
+                c->index_mode != CPPIP_INDEX_TS))
+        {
+            snprintf(c->errbuf, BUFSIZ,
+                    "%s:%d: not a pkt-num or timestamp range\n",
+                    c->ranges_fname, lineno);
+            goto done;
+        }
+        if (n == alloc)
+        {
+            alloc = alloc ? alloc * 2 : 64;
+            r = realloc(*rs, alloc * sizeof (struct batch_range));
+            if (r == NULL)
+            {
+                snprintf(c->errbuf, BUFSIZ, "realloc(): %s\n", strerror(errno));
+                goto done;
+            }
+            *rs = r;
+        }
+        r = &(*rs)[n];
+        memset(r, 0, sizeof (struct batch_range));
+        r->mode      = c->index_mode;
+        r->seq       = ++n;
+        r->pkt_start = c->e_pkts.pkt_start;
+        r->pkt_stop  = c->e_pkts.pkt_stop;
+        r->ts_start  = c->e_pkts.ts_start;
+        r->ts_stop   = c->e_pkts.ts_stop;
+    }
+    if (n == 0)
+    {
+        snprintf(c->errbuf, BUFSIZ, "%s: no ranges\n", c->ranges_fname);
+        goto done;
+    }
+    *cnt = n;
+    ret  = 1;
+done:
+    c->e_pkts     = e_pkts;
+    c->index_mode = 0;
+    free(line);
+    fclose(fp);
+    return ret;
+}
+
+/** pkt-num ranges, then timestamp ranges, each by where they start */
+static int
+batch_cmp_start(const void *a, const void *b)
+{
+    const struct batch_range *x, *y;
+
+    x = a;
+    y = b;
+    if (x->mode != y->mode)
+    {
+        return x->mode < y->mode ? -1 : 1;
+    }
+    if (x->mode == CPPIP_INDEX_PN)
+    {
+        return x->pkt_start < y->pkt_start ? -1 :
+                x->pkt_start > y->pkt_start;
+    }
+    if (timercmp(&x->ts_start, &y->ts_start, !=))
+    {
+        return timercmp(&x->ts_start, &y->ts_start, <) ? -1 : 1;
+    }
+    return 0;
+}
+
+/** by where the pass picks them up, file order between equals */
+static int
+batch_cmp_off(const void *a, const void *b)
+{
+    const struct batch_range *x, *y;
+
+    x = a;
+    y = b;
+    if (x->off != y->off)
+    {
+        return x->off < y->off ? -1 : 1;
+    }
+    return x->seq - y->seq;
+}
+
+/** fold ranges that overlap or touch into one, rs is sorted by start */
+static int
+batch_coalesce(struct batch_range *rs, int cnt)
+{
+    int i, j;
+
+    for (j = 0, i = 1; i < cnt; i++)
+    {
+        if (rs[i].mode == rs[j].mode && rs[i].mode == CPPIP_INDEX_PN &&
+                rs[i].pkt_start <= (uint64_t)rs[j].pkt_stop + 1)
+        {
+            if (rs[i].pkt_stop > rs[j].pkt_stop)
+            {
+                rs[j].pkt_stop = rs[i].pkt_stop;
+            }
+        }
+        else if (rs[i].mode == rs[j].mode && rs[i].mode == CPPIP_INDEX_TS &&
+                !timercmp(&rs[i].ts_start, &rs[j].ts_stop, >))
+        {
+            if (timercmp(&rs[i].ts_stop, &rs[j].ts_stop, >))
+            {
+                rs[j].ts_stop = rs[i].ts_stop;
+            }
+        }
+        else
+        {
+            rs[++j] = rs[i];
+        }
+    }
+    return j + 1;
+}
+
+/** the compressed size of the pcap.gz, as a virtual offset */
+static uint64_t
+batch_eof(cppip_t *c)
+{
+    struct stat stat_buf;
+
+    if (fstat(c->pcap_fd, &stat_buf) == -1)
+    {
+        return UINT64_MAX;
+    }
+    return (uint64_t)stat_buf.st_size << 16;
+}
+
+/**
+ * Find the record at or before packet n and guess where n is from the
+ * records either side of it, assuming packets are spread evenly between
+ * them. With a pkt-offset index there's nothing to guess.
+ */
+static int
+batch_locate(cppip_t *c, uint64_t n, cppip_record_t *rec, uint64_t *guess)
+{
+    int64_t i;
+    uint64_t lo, hi, span;
+    cppip_record_t target, next;
+
+    if (c->cppip_h.index_mode & CPPIP_INDEX_EF)
+    {
+        rec->pkt_num = n;
+        if (index_ef_get(c, n, &rec->bgzf_offset) == -1)
+        {
+            return -1;
+        }
+        *guess = rec->bgzf_offset;
+        return 1;
+    }
+    target.pkt_num = n;
+    i = index_stream_search(c, &c->pn_stream, CPPIP_REC_F_PKT, &target, rec);
+    if (i == -1)
+    {
+        return -1;
+    }
+    lo = rec->bgzf_offset >> 16;
+    if ((uint64_t)i + 1 < c->pn_stream.rec_cnt)
+    {
+        if (index_stream_get(c, &c->pn_stream, i + 1, &next) == -1)
+        {
+            return -1;
+        }
+        hi   = next.bgzf_offset >> 16;
+        span = next.pkt_num - rec->pkt_num;
+    }
+    else
+    {
+        hi   = batch_eof(c) >> 16;
+        span = c->pkt_cnt + 1 - rec->pkt_num;
+    }
+    *guess = (lo + (hi - lo) * (n - rec->pkt_num) / span) << 16;
+    return 1;
+}
+
+/** find where in the pcap.gz a range starts, and roughly where it ends */
+static int
+batch_resolve(cppip_t *c, struct batch_range *r)
+{
+    int64_t i;
+    cppip_record_t rec, target;
+
+    if (r->mode == CPPIP_INDEX_TS)
+    {
+        if (!(c->cppip_h.index_mode & CPPIP_INDEX_TS))
+        {
+            snprintf(c->errbuf, BUFSIZ, "%s has no timestamp index\n",
+                    c->index_fname);
+            return -1;
+        }
+        if (index_stream_search_ts(c, &c->ts_stream, &r->ts_start,
+                &rec) == -1)
+        {
+            return -1;
+        }
+        r->off   = rec.bgzf_offset;
+        r->first = rec.bgzf_offset;
+
+        /** it's through by the record after the one its end falls under */
+        target.pkt_ts = r->ts_stop;
+        i = index_stream_search(c, &c->ts_stream, CPPIP_REC_F_TS, &target,
+                &rec);
+        if (i == -1)
+        {
+            return -1;
+        }
+        r->last = batch_eof(c);
+        if ((uint64_t)i + 1 < c->ts_stream.rec_cnt)
+        {
+            if (index_stream_get(c, &c->ts_stream, i + 1, &rec) == -1)
+            {
+                return -1;
+            }
+            r->last = rec.bgzf_offset;
+        }
+        return 1;
+    }
+    if (!(c->cppip_h.index_mode & (CPPIP_INDEX_PN | CPPIP_INDEX_EF)))
+    {
+        snprintf(c->errbuf, BUFSIZ, "%s has no pkt-num index\n",
+                c->index_fname);
+        return -1;
+    }
+    if (r->pkt_stop > c->pkt_cnt)
+    {
+        snprintf(c->errbuf, BUFSIZ,
+            "range %d would exceed packet count, %llu > %llu\n", r->seq,
+            (unsigned long long)r->pkt_stop, (unsigned long long)c->pkt_cnt);
+        return -1;
+    }
+    r->take = r->pkt_stop - r->pkt_start + 1;
+    if (batch_locate(c, r->pkt_stop, &rec, &r->last) == -1 ||
+            batch_locate(c, r->pkt_start, &rec, &r->first) == -1)
+    {
+        return -1;
+    }
+    /** the closest record before it, the pass counts its way from there */
+    r->off  = rec.bgzf_offset;
+    r->skip = r->pkt_start - rec.pkt_num;
+    return 1;
+}
+
+/**
+ * Plan how the pass gets from each range to the next, which are in the
+ * order it reaches them. It can seek to the index record the next range
+ * starts from and read from there to the range, or read on from where the
+ * last one ended. Both costs are guessed in compressed bytes to read, the
+ * seek also pays BATCH_SEEK_COST. A range that reads on is picked up along
+ * with the one before it, a pkt-num range then counts its packets from
+ * there. That takes a packet number to count from, so pkt-num ranges only
+ * read on from pkt-num ranges.
+ */
+static void
+batch_plan(cppip_t *c, struct batch_range *rs, int cnt)
+{
+    int i, seeks;
+    uint64_t reach, scan, seek;
+    struct batch_range *r, *p;
+
+    for (seeks = cnt ? 1 : 0, reach = 0, i = 0; i < cnt; i++)
+    {
+        r = &rs[i];
+        if (i)
+        {
+            p = &rs[i - 1];
+            scan = r->first > reach ? (r->first >> 16) - (reach >> 16) : 0;
+            seek = BATCH_SEEK_COST + (r->first >> 16) - (r->off >> 16);
+            if (scan < seek && (r->mode == CPPIP_INDEX_TS ||
+                    (p->mode == CPPIP_INDEX_PN &&
+                    r->pkt_start >= p->pkt_start)))
+            {
+                if (r->mode == CPPIP_INDEX_PN)
+                {
+                    r->skip = p->skip + (r->pkt_start - p->pkt_start);
+                }
+                r->off  = p->off;
+                r->from = p->from ? p->from : p->seq;
+            }
+            else
+            {
+                seeks++;
+            }
+        }
+        if (r->last > reach)
+        {
+            reach = r->last;
+        }
+        if (c->flags & CPPIP_CTRL_DEBUG)
+        {
+            if (r->from)
+            {
+                fprintf(stderr, "DBG: plan: range %d reads on with %d, "
+                        "skip %llu\n", r->seq, r->from,
+                        (unsigned long long)r->skip);
+            }
+            else
+            {
+                fprintf(stderr, "DBG: plan: range %d seeks to %llx, "
+                        "skip %llu\n", r->seq, (unsigned long long)r->off,
+                        (unsigned long long)r->skip);
+            }
+        }
+    }
+    if (c->flags & CPPIP_CTRL_DEBUG)
+    {
+        fprintf(stderr, "DBG: plan: %d seeks for %d ranges\n", seeks, cnt);
+    }
+}
+
+/** -s: range n goes to new.pcap.n */
+static int
+batch_open(cppip_t *c, struct batch_range *r, const uint8_t *pcap_fh,
+        int fh_len)
+{
+    char fname[BUFSIZ];
+
+    if (snprintf(fname, sizeof (fname), "%s.%d", c->pcap_new_fname,
+            r->seq) >= (int)sizeof (fname))
+    {
+        snprintf(c->errbuf, BUFSIZ, "can't open pcap %s.%d: name too long\n",
+                c->pcap_new_fname, r->seq);
+        return -1;
+    }
+    r->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 
+                        S_IRUSR  | S_IWUSR | S_IRGRP | 
+                        S_IWGRP  | S_IROTH | S_IWOTH);
+    if (r->fd == -1)
+    {
+        snprintf(c->errbuf, BUFSIZ, "can't open pcap %s.%d: %s\n",
+                c->pcap_new_fname, r->seq, strerror(errno));
+        return -1;
+    }
+    if (c->flags & CPPIP_CTRL_BGZF)
+    {
+        r->zout = calloc(1, sizeof (zout_t));
+        if (r->zout == NULL)
+        {
+            snprintf(c->errbuf, BUFSIZ, "calloc(): %s\n", strerror(errno));
+            return -1;
+        }
+        if (zout_init(r->zout, r->fd, c->threads, c->errbuf) == -1)
+        {
+            free(r->zout);
+            r->zout = NULL;
+            return -1;
+        }
+        return zout_add(r->zout, pcap_fh, fh_len, c->errbuf);
+    }
+    if (writer_init(&r->w, r->fd, -1, WRITER_BUF_SIZ, c->errbuf) == -1)
+    {
+        return -1;
+    }
+    return writer_add(&r->w, pcap_fh, fh_len, c->errbuf);
+}
+
+/** -s: write to a range's own new pcap */
+static int
+batch_write(cppip_t *c, struct batch_range *r, const void *data, size_t len)
+{
+    if (r->zout)
+    {
+        return zout_add(r->zout, data, len, c->errbuf);
+    }
+    return writer_add(&r->w, data, len, c->errbuf);
+}
+
+/** -s: extract_keep() to a range's own new pcap */
+static int
+batch_keep(cppip_t *c, struct batch_range *r, pcap_offline_pkthdr_t *pcap_h,
+        const uint8_t *p)
+{
+    if (c->pcapng)
+    {
+        if (batch_write(c, r, c->ng_bh, PCAPNG_BH_SIZ) == -1 ||
+                batch_write(c, r, c->ng_blk, c->ng_len - PCAPNG_BH_SIZ) == -1)
+        {
+            return -1;
+        }
+        return 1;
+    }
+    if (batch_write(c, r, extract_rh(c, pcap_h), PCAP_PKTH_SIZ) == -1 ||
+            batch_write(c, r, p, pcap_h->caplen) == -1)
+    {
+        return -1;
+    }
+    return 1;
+}
+
+/** -s: a range is through, get its new pcap out and let go of it */
+static int
+batch_close(cppip_t *c, struct batch_range *r)
+{
+    int n;
+
+    n = r->zout ? zout_close(r->zout, c->errbuf) :
+            writer_flush(&r->w, c->errbuf);
+    if (n == 1)
+    {
+        fprintf(stderr, "wrote %llu packets to %s.%d.\n",
+                (unsigned long long)r->pkts_w, c->pcap_new_fname, r->seq);
+    }
+    if (r->zout)
+    {
+        zout_free(r->zout);
+        free(r->zout);
+        r->zout = NULL;
+    }
+    writer_free(&r->w);
+    close(r->fd);
+    r->fd = 0;
+    return n;
+}
+
+/**
+ * Is the packet at cur in the range? Packet number ranges count their way
+ * in from where they were picked up, timestamp ranges take the packets in
+ * their window and are through at the first one past it.
+ */
+static int
+batch_want(struct batch_range *r, struct timeval *cur)
+{
+    r->want = 0;
+    if (r->mode == CPPIP_INDEX_PN)
+    {
+        if (r->skip)
+        {
+            r->skip--;
+        }
+        else
+        {
+            r->want = 1;
+            r->done = --r->take == 0;
+        }
+    }
+    else if (timercmp(cur, &r->ts_stop, >))
+    {
+        r->done = 1;
+    }
+    else
+    {
+        r->want = !timercmp(cur, &r->ts_start, <);
+    }
+    return r->want;
+}
+
+int
+batch_extract(cppip_t *c)
+{
+    int i, k, n, cnt, ranges, act_n, split, sel, ret, fh_len;
+    uint64_t pos, gaps;
+    const uint8_t *p;
+    struct timeval cur;
+    struct batch_range *rs, *r, **act;
+    pcap_offline_pkthdr_t pcap_h;
+    uint8_t pcap_fh[BUFSIZ];
+
+    rs    = NULL;
+    act   = NULL;
+    cnt   = 0;
+    ret   = -1;
+    split = c->flags & CPPIP_CTRL_SPLIT;
+    if (batch_load(c, &rs, &cnt) == -1)
+    {
+        goto done;
+    }
+    ranges = cnt;
+
+    /** one output: overlapping ranges needn't be tracked separately */
+    if (!split)
+    {
+        qsort(rs, cnt, sizeof (struct batch_range), batch_cmp_start);
+        cnt = batch_coalesce(rs, cnt);
+    }
+    for (i = 0; i < cnt; i++)
+    {
+        if (batch_resolve(c, &rs[i]) == -1)
+        {
+            goto done;
+        }
+    }
+    qsort(rs, cnt, sizeof (struct batch_range), batch_cmp_off);
+    batch_plan(c, rs, cnt);
+    act = malloc(cnt * sizeof (struct batch_range *));
+    if (act == NULL)
+    {
+        snprintf(c->errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+        goto done;
+    }
+    fh_len = extract_open(c, pcap_fh);
+    if (fh_len == -1)
+    {
+        goto done;
+    }
+    if (!split && extract_write(c, pcap_fh, fh_len) == -1)
+    {
+        goto done;
+    }
+
+    /**
+     * One pass front to back. Ranges join as the pass reaches where they
+     * start and leave when they're through. With none under way the pass
+     * jumps ahead to the next one, so the gaps between them aren't read.
+     */
+    c->e_pkts.pkts_w = 0;
+    for (gaps = 0, act_n = 0, k = 0; ; )
+    {
+        if (act_n == 0)
+        {
+            if (k == cnt)
+            {
+                break;
+            }
+            if (extract_seek(c, rs[k].off) == -1)
+            {
+                snprintf(c->errbuf, BUFSIZ, "bgzf_seek() error.\n");
+                goto done;
+            }
+            gaps++;
+        }
+        pos = bgzf_tell(c->pcap);
+        for (; k < cnt && rs[k].off <= pos; k++)
+        {
+            if (split && batch_open(c, &rs[k], pcap_fh, fh_len) == -1)
+            {
+                goto done;
+            }
+            act[act_n++] = &rs[k];
+        }
+
+        n = extract_hdr(c, &pcap_h);
+        if (n == 0)
+        {
+            break;
+        }
+        if (n != PCAP_PKTH_SIZ)
+        {
+            snprintf(c->errbuf, BUFSIZ, 
+                "bgzf_read() error: cant read pcap hdr\n");
+            goto done;
+        }
+        cur.tv_sec  = pcap_h.tv_sec;
+        cur.tv_usec = pcap_h.tv_usec;
+        for (sel = 0, i = 0; i < act_n; i++)
+        {
+            sel |= batch_want(act[i], &cur);
+        }
+
+        /** only packets some range wants are looked at */
+        if (sel)
+        {
+            p = extract_read(c, &pcap_h);
+            if (p == NULL)
+            {
+                goto done;
+            }
+            if (c->filter &&
+                    !filter_match(c, p, pcap_h.caplen, pcap_h.len))
+            {
+                sel = 0;
+            }
+        }
+        else if (extract_skip(c, &pcap_h) == -1)
+        {
+            snprintf(c->errbuf, BUFSIZ, "bgzf_skip() error.\n");
+            goto done;
+        }
+        if (sel && !split)
+        {
+            if (extract_keep(c, &pcap_h, p) == -1)
+            {
+                goto done;
+            }
+        }
+        for (i = 0; i < act_n; )
+        {
+            r = act[i];
+            if (sel && split && r->want)
+            {
+                if (batch_keep(c, r, &pcap_h, p) == -1)
+                {
+                    goto done;
+                }
+                r->pkts_w++;
+                c->e_pkts.pkts_w++;
+            }
+            if (r->done)
+            {
+                if (split && batch_close(c, r) == -1)
+                {
+                    goto done;
+                }
+                act[i] = act[--act_n];
+                continue;
+            }
+            i++;
+        }
+    }
+
+    /** out of file: timestamp ranges end here, packet ranges can't */
+    for (; k < cnt; k++)
+    {
+        act[act_n++] = &rs[k];
+    }
+    for (i = 0; i < act_n; i++)
+    {
+        r = act[i];
+        if (r->mode == CPPIP_INDEX_PN)
+        {
+            snprintf(c->errbuf, BUFSIZ,
+                    "bgzf_read(): hit EOF in range %d\n", r->seq);
+            goto done;
+        }
+        if (split && ((r->fd == 0 && batch_open(c, r, pcap_fh, fh_len) == -1) ||
+                batch_close(c, r) == -1))
+        {
+            goto done;
+        }
+    }
+    if (!split && extract_close(c) == -1)
+    {
+        goto done;
+    }
+    if (c->flags & CPPIP_CTRL_DEBUG)
+    {
+        fprintf(stderr, "DBG: ranges:\t\t\t%d (%d after coalescing)\n",
+                ranges, cnt);
+        fprintf(stderr, "DBG: seeks:\t\t\t%llu\n", (unsigned long long)gaps);
+    }
+    ret = 1;
+done:
+    for (i = 0; i < cnt; i++)
+    {
+        /** anything still open after an error */
+        if (rs[i].zout)
+        {
+            zout_free(rs[i].zout);
+            free(rs[i].zout);
+        }
+        writer_free(&rs[i].w);
+        if (rs[i].fd > 0)
+        {
+            close(rs[i].fd);
+        }
+    }
+    free(act);
+    free(rs);
+    return ret;
+}
+
+/** EOF */
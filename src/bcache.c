@@ -0,0 +1,423 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * bcache.c: a cache of inflated pcap.gz blocks
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "../include/cppip.h"
+#include <pthread.h>
+
+/** one inflated block */
+struct bcache_ent
+{
+    uint64_t id;                /** file it's from */
+    int64_t addr;               /** its compressed offset */
+    int bsize;                  /** its compressed size */
+    int len;                    /** its inflated size, -1 while it's filled */
+    int ref;                    /** used since the clock hand went by */
+    int pin;                    /** threads copying in or out, not evictable */
+    int next;                   /** next in its hash chain, -1 ends it */
+    uint8_t *data;              /** the inflated block */
+};
+
+struct bcache
+{
+    pthread_mutex_t lock;
+    struct bcache_ent *ents;
+    int ent_cnt;                /** entries the budget allows */
+    int used;                   /** entries filled so far */
+    int hand;                   /** clock hand */
+    int *buckets;               /** hash chains, -1 if empty */
+    uint32_t bucket_mask;       /** buckets - 1, a power of two */
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static uint32_t
+bcache_hash(bcache_t *bc, uint64_t id, int64_t addr)
+{
+    uint64_t h;
+
+    h = (id ^ (uint64_t)addr) * 0x9e3779b97f4a7c15ULL;
+    return (h >> 32) & bc->bucket_mask;
+}
+
+bcache_t *
+bcache_new(size_t siz, char *errbuf)
+{
+    int i;
+    bcache_t *bc;
+
+    bc = calloc(1, sizeof (bcache_t));
+    if (bc == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "calloc(): %s\n", strerror(errno));
+        return NULL;
+    }
+    bc->ent_cnt = siz / BGZF_BLOCK_MAX_SIZ;
+    if (bc->ent_cnt < 1)
+    {
+        bc->ent_cnt = 1;
+    }
+    for (bc->bucket_mask = 1; bc->bucket_mask < (uint32_t)bc->ent_cnt * 2; )
+    {
+        bc->bucket_mask <<= 1;
+    }
+    bc->ents    = calloc(bc->ent_cnt, sizeof (struct bcache_ent));
+    bc->buckets = malloc(bc->bucket_mask * sizeof (int));
+    if (bc->ents == NULL || bc->buckets == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+        bcache_free(bc);
+        return NULL;
+    }
+    for (i = 0; i < (int)bc->bucket_mask; i++)
+    {
+        bc->buckets[i] = -1;
+    }
+    bc->bucket_mask--;
+    pthread_mutex_init(&bc->lock, NULL);
+    return bc;
+}
+
+void
+bcache_free(bcache_t *bc)
+{
+    int i;
+
+    if (bc->ents)
+    {
+        for (i = 0; i < bc->used; i++)
+        {
+            free(bc->ents[i].data);
+        }
+    }
+    free(bc->ents);
+    free(bc->buckets);
+    free(bc);
+}
+
+uint64_t
+bcache_id(int fd)
+{
+    uint64_t id;
+    struct stat stat_buf;
+
+    if (fstat(fd, &stat_buf) == -1)
+    {
+        return 0;
+    }
+    /** a file rewritten in place has to miss, so its size and mtime count */
+    id  = (uint64_t)stat_buf.st_dev * 0x100000001b3ULL;
+    id ^= (uint64_t)stat_buf.st_ino * 0x9e3779b97f4a7c15ULL;
+    id ^= (uint64_t)stat_buf.st_size << 20;
+    id ^= (uint64_t)stat_buf.st_mtime;
+    return id ? id : 1;
+}
+
+/**
+ * Copy the block at addr into f's inflated block if it's cached
+ * returns: its compressed size, len set to its inflated size, 0 if missing
+ *
+ * The lock only covers the lookup, the entry is pinned so it can't be
+ * evicted while it's copied.
+ */
+static int
+bcache_get(bcache_t *bc, uint64_t id, BGZF *f, int64_t addr, int *len)
+{
+    int i, bsize;
+    struct bcache_ent *e;
+
+    bsize = 0;
+    pthread_mutex_lock(&bc->lock);
+    for (i = bc->buckets[bcache_hash(bc, id, addr)]; i != -1; i = e->next)
+    {
+        e = &bc->ents[i];
+        if (e->id == id && e->addr == addr && e->len != -1)
+        {
+            *len   = e->len;
+            bsize  = e->bsize;
+            e->ref = 1;
+            e->pin++;
+            bc->hits++;
+            break;
+        }
+    }
+    if (bsize == 0)
+    {
+        bc->misses++;
+    }
+    pthread_mutex_unlock(&bc->lock);
+    if (bsize == 0)
+    {
+        return 0;
+    }
+
+    memcpy(f->uncompressed_block, e->data, *len);
+    pthread_mutex_lock(&bc->lock);
+    e->pin--;
+    pthread_mutex_unlock(&bc->lock);
+    return bsize;
+}
+
+/**
+ * Keep the block f just inflated, in place of one not used lately. As with
+ * bcache_get() the copy is made outside the lock, the entry is hashed
+ * pinned and unreadable until it's filled.
+ */
+static void
+bcache_put(bcache_t *bc, uint64_t id, BGZF *f, int64_t addr, int bsize)
+{
+    int i, n, *pp;
+    uint32_t h;
+    struct bcache_ent *e;
+
+    h = bcache_hash(bc, id, addr);
+    pthread_mutex_lock(&bc->lock);
+
+    /** another thread may have got there first */
+    for (i = bc->buckets[h]; i != -1; i = bc->ents[i].next)
+    {
+        if (bc->ents[i].id == id && bc->ents[i].addr == addr)
+        {
+            goto done;
+        }
+    }
+    if (bc->used < bc->ent_cnt)
+    {
+        e = &bc->ents[bc->used];
+        e->data = malloc(BGZF_BLOCK_MAX_SIZ);
+        if (e->data == NULL)
+        {
+            /** not being able to cache it isn't an error */
+            goto done;
+        }
+        bc->used++;
+    }
+    else
+    {
+        /**
+         *  The clock: spare what was used since, take the first that wasn't.
+         *  Pinned entries are passed over, two turns without finding one
+         *  means they all are and this block goes uncached.
+         */
+        for (n = 0; ; n++)
+        {
+            if (n == 2 * bc->ent_cnt)
+            {
+                goto done;
+            }
+            e = &bc->ents[bc->hand];
+            bc->hand = (bc->hand + 1) % bc->ent_cnt;
+            if (e->pin)
+            {
+                continue;
+            }
+            if (e->ref == 0)
+            {
+                break;
+            }
+            e->ref = 0;
+        }
+        for (pp = &bc->buckets[bcache_hash(bc, e->id, e->addr)];
+                *pp != e - bc->ents; pp = &bc->ents[*pp].next)
+            ;
+        *pp = e->next;
+    }
+    e->id    = id;
+    e->addr  = addr;
+    e->bsize = bsize;
+    e->len   = -1;
+    e->ref   = 0;
+    e->pin   = 1;
+    e->next  = bc->buckets[h];
+    bc->buckets[h] = e - bc->ents;
+    pthread_mutex_unlock(&bc->lock);
+
+    memcpy(e->data, f->uncompressed_block, f->block_length);
+    pthread_mutex_lock(&bc->lock);
+    e->len = f->block_length;
+    e->pin--;
+done:
+    pthread_mutex_unlock(&bc->lock);
+}
+
+int
+bcache_load(bcache_t *bc, uint64_t id, BGZF *f, int fd, int64_t offset)
+{
+    int bsize, isize, len, uoff;
+    int64_t addr;
+    uint8_t *cb;
+
+    addr = offset >> 16;
+    uoff = offset & 0xffff;
+    for (;;)
+    {
+        if (f->block_length && f->block_address == addr)
+        {
+            /** already inflated */
+            bsize = 0;
+        }
+        else if ((bsize = bcache_get(bc, id, f, addr, &len)))
+        {
+            /** the file has to be where bgzf_read() expects, past the block */
+            if (bgzf_seek(f, (addr + bsize) << 16, SEEK_SET) == -1)
+            {
+                return -1;
+            }
+            f->block_address = addr;
+            f->block_length  = len;
+        }
+        else
+        {
+            if (bgzf_seek(f, addr << 16, SEEK_SET) == -1 ||
+                    bgzf_read_block(f) != 0)
+            {
+                return -1;
+            }
+            if (f->block_length == 0)
+            {
+                return 0;
+            }
+            /** BSIZE is in the header of the block just read */
+            cb    = f->compressed_block;
+            bsize = (cb[16] | (cb[17] << 8)) + 1;
+            bcache_put(bc, id, f, addr, bsize);
+        }
+        if (uoff < f->block_length)
+        {
+            f->block_offset = uoff;
+            return 1;
+        }
+        /** the end of one block is the start of the next */
+        if (bsize == 0 && bgzf_block_info(fd, addr, &bsize, &isize) != 1)
+        {
+            return -1;
+        }
+        addr += bsize;
+        uoff  = 0;
+    }
+}
+
+/** done with the block's last byte, move on as bgzf_read() would */
+static int
+bcache_next(BGZF *f, int fd)
+{
+    int bsize, isize;
+
+    if (bgzf_block_info(fd, f->block_address, &bsize, &isize) != 1)
+    {
+        return -1;
+    }
+    f->block_address += bsize;
+    f->block_offset   = 0;
+    f->block_length   = 0;
+    return 1;
+}
+
+int
+bcache_read(bcache_t *bc, uint64_t id, BGZF *f, int fd, void *buf, int len)
+{
+    int n, done;
+
+    for (done = 0; done < len; done += n)
+    {
+        if (f->block_offset >= f->block_length)
+        {
+            n = bcache_load(bc, id, f, fd, bgzf_tell(f));
+            if (n != 1)
+            {
+                return n == 0 ? done : -1;
+            }
+        }
+        n = f->block_length - f->block_offset;
+        if (n > len - done)
+        {
+            n = len - done;
+        }
+        memcpy((uint8_t *)buf + done, (uint8_t *)f->uncompressed_block +
+                f->block_offset, n);
+        f->block_offset += n;
+        if (f->block_offset == f->block_length && bcache_next(f, fd) == -1)
+        {
+            return -1;
+        }
+    }
+    return done;
+}
+
+const uint8_t *
+bcache_view(bcache_t *bc, uint64_t id, BGZF *f, int fd, int len,
+        uint8_t **arena, size_t *arena_siz)
+{
+    uint8_t *p;
+
+    if (len <= 0)
+    {
+        return len == 0 ? f->uncompressed_block : NULL;
+    }
+    if (f->block_offset >= f->block_length &&
+            bcache_load(bc, id, f, fd, bgzf_tell(f)) != 1)
+    {
+        return NULL;
+    }
+
+    /** it's all in the block, hand out a pointer */
+    if (len <= f->block_length - f->block_offset)
+    {
+        p = (uint8_t *)f->uncompressed_block + f->block_offset;
+        f->block_offset += len;
+        if (f->block_offset == f->block_length && bcache_next(f, fd) == -1)
+        {
+            return NULL;
+        }
+        return p;
+    }
+
+    /** it straddles blocks, stitch it together in the arena */
+    if ((size_t)len > *arena_siz)
+    {
+        p = realloc(*arena, len);
+        if (p == NULL)
+        {
+            return NULL;
+        }
+        *arena     = p;
+        *arena_siz = len;
+    }
+    if (bcache_read(bc, id, f, fd, *arena, len) != len)
+    {
+        return NULL;
+    }
+    return *arena;
+}
+
+void
+bcache_stats(bcache_t *bc, uint64_t *hits, uint64_t *misses)
+{
+    pthread_mutex_lock(&bc->lock);
+    *hits   = bc->hits;
+    *misses = bc->misses;
+    pthread_mutex_unlock(&bc->lock);
+}
+
+/** EOF */
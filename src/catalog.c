@@ -0,0 +1,607 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * catalog.c: time range lookups across many pcap.gz files
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "../include/cppip.h"
+#include <dirent.h>
+
+/**
+ * Map the catalog (c->index) and check it over
+ * returns:     number of entries, 0 for a new empty file, -1 on error
+ */
+static int64_t
+catalog_map(cppip_t *c)
+{
+    uint64_t n, str_len, i;
+    const uint8_t *ent;
+    struct stat stat_buf;
+
+    if (fstat(c->index, &stat_buf) == -1)
+    {
+        snprintf(c->errbuf, BUFSIZ, "can't stat %s: %s\n", c->index_fname,
+                strerror(errno));
+        return -1;
+    }
+    if (stat_buf.st_size == 0)
+    {
+        return 0;
+    }
+    if (stat_buf.st_size < CPPIP_CATALOG_H_SIZ)
+    {
+        snprintf(c->errbuf, BUFSIZ, "%s is too small to be a catalog\n",
+                c->index_fname);
+        return -1;
+    }
+    c->index_map_siz = stat_buf.st_size;
+    c->index_map = mmap(NULL, c->index_map_siz, PROT_READ, MAP_SHARED,
+            c->index, 0);
+    if (c->index_map == MAP_FAILED)
+    {
+        c->index_map = NULL;
+        snprintf(c->errbuf, BUFSIZ, "mmap(): %s\n", strerror(errno));
+        return -1;
+    }
+    n       = le64dec(c->index_map + 8);
+    str_len = le64dec(c->index_map + 16);
+    if (le32dec(c->index_map) != CPPIP_CATALOG_MAGIC ||
+            c->index_map[4] != CPPIP_CATALOG_VERSION)
+    {
+        snprintf(c->errbuf, BUFSIZ, "%s is not a cppip catalog\n",
+                c->index_fname);
+        return -1;
+    }
+    if (n > c->index_map_siz / CPPIP_CATALOG_ENT_SIZ || str_len == 0 ||
+            CPPIP_CATALOG_H_SIZ + n * CPPIP_CATALOG_ENT_SIZ + str_len !=
+            c->index_map_siz || c->index_map[c->index_map_siz - 1] != 0)
+    {
+        snprintf(c->errbuf, BUFSIZ, "%s is a corrupt catalog\n",
+                c->index_fname);
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        ent = c->index_map + CPPIP_CATALOG_H_SIZ + CPPIP_CATALOG_ENT_SIZ * i;
+        if (le64dec(ent + 40) >= str_len || le64dec(ent + 48) >= str_len)
+        {
+            snprintf(c->errbuf, BUFSIZ, "%s is a corrupt catalog\n",
+                    c->index_fname);
+            return -1;
+        }
+    }
+    return n;
+}
+
+/** entry i of the mapped catalog, names point into the map */
+static void
+catalog_get(cppip_t *c, uint64_t n, uint64_t i, catalog_ent_t *e)
+{
+    const uint8_t *ent;
+    char *str;
+
+    ent = c->index_map + CPPIP_CATALOG_H_SIZ + CPPIP_CATALOG_ENT_SIZ * i;
+    str = (char *)c->index_map + CPPIP_CATALOG_H_SIZ +
+            CPPIP_CATALOG_ENT_SIZ * n;
+    e->first    = le64dec(ent);
+    e->last     = le64dec(ent + 8);
+    e->max_last = le64dec(ent + 16);
+    e->pkt_cnt  = le64dec(ent + 24);
+    e->mtime    = le64dec(ent + 32);
+    e->pcap     = str + le64dec(ent + 40);
+    e->index    = str + le64dec(ent + 48);
+}
+
+/**
+ * Fill in a capture's time span and packet count. The first timestamp is
+ * the first index record's, the last comes from reading on from the last
+ * index record, at most an index level of packets.
+ */
+static int
+catalog_scan(cppip_t *c, catalog_ent_t *e)
+{
+    int n;
+    cppip_t *f;
+    uint64_t ts;
+    cppip_record_t rec;
+    struct timeval tv;
+    uint8_t pcap_fh[BUFSIZ];
+    pcap_offline_pkthdr_t pcap_h;
+
+    f = extract_source(c->flags, e->index, e->pcap, CPPIP_INDEX_TS,
+            c->errbuf);
+    if (f == NULL)
+    {
+        return -1;
+    }
+    n = -1;
+    if (index_stream_get(f, &f->ts_stream, 0, &rec) == -1)
+    {
+        goto done;
+    }
+    e->first = ts_to_usec(&rec.pkt_ts);
+    if (index_stream_get(f, &f->ts_stream, f->ts_stream.rec_cnt - 1,
+            &rec) == -1)
+    {
+        goto done;
+    }
+    e->last = ts_to_usec(&rec.pkt_ts);
+    if (extract_open(f, pcap_fh) == -1)
+    {
+        goto done;
+    }
+    if (bgzf_seek(f->pcap, rec.bgzf_offset, SEEK_SET) == -1)
+    {
+        snprintf(f->errbuf, BUFSIZ, "bgzf_seek() error.\n");
+        goto done;
+    }
+    while (extract_hdr(f, &pcap_h) == PCAP_PKTH_SIZ)
+    {
+        tv.tv_sec  = pcap_h.tv_sec;
+        tv.tv_usec = pcap_h.tv_usec;
+        ts = ts_to_usec(&tv);
+        if (ts > e->last)
+        {
+            e->last = ts;
+        }
+        if (extract_skip(f, &pcap_h) == -1)
+        {
+            break;
+        }
+    }
+    e->pkt_cnt = f->pkt_cnt;
+    n = 1;
+done:
+    if (n == -1)
+    {
+        memcpy(c->errbuf, f->errbuf, BUFSIZ);
+    }
+    control_context_destroy(f);
+    return n;
+}
+
+static int
+catalog_cmp(const void *a, const void *b)
+{
+    const catalog_ent_t *x, *y;
+
+    x = (const catalog_ent_t *)a;
+    y = (const catalog_ent_t *)b;
+    if (x->first != y->first)
+    {
+        return x->first < y->first ? -1 : 1;
+    }
+    return strcmp(x->pcap, y->pcap);
+}
+
+/** the index for dir/name, name.pcap.gz -> name.cppip or name.pcap.gz.cppip */
+static char *
+catalog_index_name(char *pcap, struct stat *stat_buf)
+{
+    char *index;
+    size_t len;
+
+    len   = strlen(pcap);
+    index = malloc(len + sizeof (".cppip"));
+    if (index == NULL)
+    {
+        return NULL;
+    }
+    memcpy(index, pcap, len - strlen(".pcap.gz"));
+    strcpy(index + len - strlen(".pcap.gz"), ".cppip");
+    if (stat(index, stat_buf) == 0)
+    {
+        return index;
+    }
+    snprintf(index, len + sizeof (".cppip"), "%s.cppip", pcap);
+    if (stat(index, stat_buf) == 0)
+    {
+        return index;
+    }
+    free(index);
+    return NULL;
+}
+
+/** write the catalog next to the old one and move it into place */
+static int
+catalog_write(cppip_t *c, catalog_ent_t *ents, uint64_t n)
+{
+    int fd, ret;
+    char *tmp;
+    uint64_t i, str_len, max_last;
+    uint8_t hdr[CPPIP_CATALOG_H_SIZ], ent[CPPIP_CATALOG_ENT_SIZ];
+    writer_t w;
+
+    ret = -1;
+    tmp = malloc(strlen(c->index_fname) + sizeof (".tmp"));
+    if (tmp == NULL)
+    {
+        snprintf(c->errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+        return -1;
+    }
+    sprintf(tmp, "%s.tmp", c->index_fname);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP |
+            S_IWGRP | S_IROTH | S_IWOTH);
+    if (fd == -1)
+    {
+        snprintf(c->errbuf, BUFSIZ, "can't create %s: %s\n", tmp,
+                strerror(errno));
+        free(tmp);
+        return -1;
+    }
+    if (writer_init(&w, fd, 0, WRITER_BUF_SIZ, c->errbuf) == -1)
+    {
+        goto done;
+    }
+
+    /** a leading NUL so the string table is never empty */
+    for (str_len = 1, i = 0; i < n; i++)
+    {
+        str_len += strlen(ents[i].pcap) + strlen(ents[i].index) + 2;
+    }
+    memset(hdr, 0, sizeof (hdr));
+    le32enc(hdr, CPPIP_CATALOG_MAGIC);
+    hdr[4] = CPPIP_CATALOG_VERSION;
+    le64enc(hdr + 8,  n);
+    le64enc(hdr + 16, str_len);
+    if (writer_add(&w, hdr, sizeof (hdr), c->errbuf) == -1)
+    {
+        goto done;
+    }
+    for (str_len = 1, max_last = 0, i = 0; i < n; i++)
+    {
+        if (ents[i].last > max_last)
+        {
+            max_last = ents[i].last;
+        }
+        memset(ent, 0, sizeof (ent));
+        le64enc(ent,      ents[i].first);
+        le64enc(ent + 8,  ents[i].last);
+        le64enc(ent + 16, max_last);
+        le64enc(ent + 24, ents[i].pkt_cnt);
+        le64enc(ent + 32, ents[i].mtime);
+        le64enc(ent + 40, str_len);
+        str_len += strlen(ents[i].pcap) + 1;
+        le64enc(ent + 48, str_len);
+        str_len += strlen(ents[i].index) + 1;
+        if (writer_add(&w, ent, sizeof (ent), c->errbuf) == -1)
+        {
+            goto done;
+        }
+    }
+    if (writer_add(&w, "", 1, c->errbuf) == -1)
+    {
+        goto done;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (writer_add(&w, ents[i].pcap, strlen(ents[i].pcap) + 1,
+                c->errbuf) == -1 ||
+                writer_add(&w, ents[i].index, strlen(ents[i].index) + 1,
+                c->errbuf) == -1)
+        {
+            goto done;
+        }
+    }
+    if (writer_flush(&w, c->errbuf) == -1)
+    {
+        goto done;
+    }
+    if (rename(tmp, c->index_fname) == -1)
+    {
+        snprintf(c->errbuf, BUFSIZ, "can't rename %s: %s\n", tmp,
+                strerror(errno));
+        goto done;
+    }
+
+    /** our descriptor is the old file, which might be empty and unlinked */
+    close(c->index);
+    c->index = open(c->index_fname, O_RDONLY);
+    ret = 1;
+done:
+    writer_free(&w);
+    close(fd);
+    if (ret == -1)
+    {
+        unlink(tmp);
+    }
+    free(tmp);
+    return ret;
+}
+
+int
+catalog_build(cppip_t *c)
+{
+    int d;
+    DIR *dir;
+    size_t len;
+    int64_t old_n;
+    char *pcap, *index;
+    uint64_t i, n, siz, scanned;
+    struct dirent *de;
+    struct stat stat_buf;
+    catalog_ent_t *ents, *e, old;
+
+    old_n = catalog_map(c);
+    if (old_n == -1)
+    {
+        return -1;
+    }
+    ents    = NULL;
+    n       = 0;
+    siz     = 0;
+    scanned = 0;
+    for (d = 0; d < c->dir_cnt; d++)
+    {
+        dir = opendir(c->dirs[d]);
+        if (dir == NULL)
+        {
+            snprintf(c->errbuf, BUFSIZ, "can't open %s: %s\n", c->dirs[d],
+                    strerror(errno));
+            goto err;
+        }
+        while ((de = readdir(dir)))
+        {
+            len = strlen(de->d_name);
+            if (len <= strlen(".pcap.gz") || strcmp(de->d_name + len -
+                    strlen(".pcap.gz"), ".pcap.gz"))
+            {
+                continue;
+            }
+            pcap = malloc(strlen(c->dirs[d]) + len + 2);
+            if (pcap == NULL)
+            {
+                snprintf(c->errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+                closedir(dir);
+                goto err;
+            }
+            sprintf(pcap, "%s/%s", c->dirs[d], de->d_name);
+            index = catalog_index_name(pcap, &stat_buf);
+            if (index == NULL)
+            {
+                fprintf(stderr, "skipping %s: no index\n", pcap);
+                free(pcap);
+                continue;
+            }
+            if (n == siz)
+            {
+                siz = siz ? siz * 2 : 256;
+                e = realloc(ents, siz * sizeof (catalog_ent_t));
+                if (e == NULL)
+                {
+                    snprintf(c->errbuf, BUFSIZ, "realloc(): %s\n",
+                            strerror(errno));
+                    free(pcap);
+                    free(index);
+                    closedir(dir);
+                    goto err;
+                }
+                ents = e;
+            }
+            e = &ents[n];
+            memset(e, 0, sizeof (catalog_ent_t));
+            e->pcap  = pcap;
+            e->index = index;
+            e->mtime = stat_buf.st_mtime;
+
+            /** an unchanged index means an unchanged capture */
+            for (i = 0; i < (uint64_t)old_n; i++)
+            {
+                catalog_get(c, old_n, i, &old);
+                if (old.mtime == e->mtime && strcmp(old.pcap, pcap) == 0 &&
+                        strcmp(old.index, index) == 0)
+                {
+                    e->first   = old.first;
+                    e->last    = old.last;
+                    e->pkt_cnt = old.pkt_cnt;
+                    break;
+                }
+            }
+            if (i == (uint64_t)old_n)
+            {
+                if (catalog_scan(c, e) == -1)
+                {
+                    fprintf(stderr, "skipping %s: %s", pcap, c->errbuf);
+                    free(pcap);
+                    free(index);
+                    continue;
+                }
+                scanned++;
+            }
+            n++;
+        }
+        closedir(dir);
+    }
+
+    qsort(ents, n, sizeof (catalog_ent_t), catalog_cmp);
+    if (c->index_map)
+    {
+        munmap(c->index_map, c->index_map_siz);
+        c->index_map = NULL;
+    }
+    if (catalog_write(c, ents, n) == -1)
+    {
+        goto err;
+    }
+    fprintf(stderr, "catalogued %llu captures (%llu read) in %s\n",
+            (unsigned long long)n, (unsigned long long)scanned,
+            c->index_fname);
+    for (i = 0; i < n; i++)
+    {
+        free(ents[i].pcap);
+        free(ents[i].index);
+    }
+    free(ents);
+    return (int)n;
+err:
+    for (i = 0; i < n; i++)
+    {
+        free(ents[i].pcap);
+        free(ents[i].index);
+    }
+    free(ents);
+    return -1;
+}
+
+int
+catalog_extract(cppip_t *c)
+{
+    int n;
+    cppip_t *f;
+    int64_t cnt;
+    uint32_t linktype, magic;
+    uint64_t lo, hi, mid, start, stop, files;
+    uint8_t pcap_fh[BUFSIZ];
+    catalog_ent_t e;
+
+    cnt = catalog_map(c);
+    if (cnt == -1)
+    {
+        return -1;
+    }
+    if (cnt == 0)
+    {
+        snprintf(c->errbuf, BUFSIZ, "%s is an empty catalog\n",
+                c->index_fname);
+        return -1;
+    }
+    start = ts_to_usec(&c->e_pkts.ts_start);
+    stop  = ts_to_usec(&c->e_pkts.ts_stop);
+
+    /** running max of last timestamps never drops: first that can overlap */
+    for (lo = 0, hi = cnt; lo < hi; )
+    {
+        mid = lo + (hi - lo) / 2;
+        catalog_get(c, cnt, mid, &e);
+        if (e.max_last < start)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    c->e_pkts.pkts_w = 0;
+    for (linktype = 0, magic = 0, files = 0; lo < (uint64_t)cnt; lo++)
+    {
+        catalog_get(c, cnt, lo, &e);
+        if (e.first > stop)
+        {
+            break;
+        }
+        if (e.last < start)
+        {
+            continue;
+        }
+
+        /**
+         * Each capture holds part of the range, clamp it to the capture's
+         * span. Fuzzy matching covers the range ends that fall between
+         * packets.
+         */
+        f = extract_source(c->flags | CPPIP_CTRL_TS_FM, e.index, e.pcap,
+                CPPIP_INDEX_TS, c->errbuf);
+        if (f == NULL)
+        {
+            return -1;
+        }
+        f->pcap_new       = c->pcap_new;
+        f->pcap_new_fname = c->pcap_new_fname;
+        f->zout           = c->zout;
+        f->pcap_w         = c->pcap_w;
+        f->filter_s       = c->filter_s;
+        f->e_pkts.ts_start = c->e_pkts.ts_start;
+        f->e_pkts.ts_stop  = c->e_pkts.ts_stop;
+        if (e.first > start)
+        {
+            usec_to_ts(e.first, &f->e_pkts.ts_start);
+        }
+        if (e.last < stop)
+        {
+            usec_to_ts(e.last, &f->e_pkts.ts_stop);
+        }
+        fprintf(stderr, "extracting from %s using %s...\n", e.pcap,
+                e.index);
+        n = extract_open(f, pcap_fh) == -1 ? -1 : 1;
+        if (n == 1 && f->pcapng)
+        {
+            snprintf(f->errbuf, BUFSIZ, "%s: can't join pcapng captures\n",
+                    e.pcap);
+            n = -1;
+        }
+        if (n == 1 && files == 0)
+        {
+            linktype = f->linktype;
+            magic    = f->pcap_magic;
+            if (extract_write(c, pcap_fh, 24) == -1)
+            {
+                memcpy(f->errbuf, c->errbuf, BUFSIZ);
+                n = -1;
+            }
+        }
+        else if (n == 1 && f->linktype != linktype)
+        {
+            snprintf(f->errbuf, BUFSIZ, "%s: link type %u, not %u\n", e.pcap,
+                    f->linktype, linktype);
+            n = -1;
+        }
+        else if (n == 1 && f->pcap_magic != magic)
+        {
+            /** one file header goes out, the rest must agree with it */
+            snprintf(f->errbuf, BUFSIZ, "%s: pcap magic %08x, not %08x\n",
+                    e.pcap, f->pcap_magic, magic);
+            n = -1;
+        }
+        if (n == 1)
+        {
+            n = extract_by_ts(f);
+        }
+        c->e_pkts.pkts_w += f->e_pkts.pkts_w;
+        c->e_pkts.copied |= f->e_pkts.copied;
+        if (n == -1)
+        {
+            memcpy(c->errbuf, f->errbuf, BUFSIZ);
+        }
+        /** the output is ours, not the capture's */
+        f->pcap_new = 0;
+        f->zout     = NULL;
+        f->pcap_w   = NULL;
+        control_context_destroy(f);
+        if (n == -1)
+        {
+            return -1;
+        }
+        files++;
+    }
+    if (files == 0)
+    {
+        snprintf(c->errbuf, BUFSIZ, "no catalogued capture covers %s - %s\n",
+                ctime_usec(&c->e_pkts.ts_start),
+                ctime_usec(&c->e_pkts.ts_stop));
+        return -1;
+    }
+    return extract_close(c);
+}
+
+/** EOF */
@@ -0,0 +1,332 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * ef.c: Elias-Fano coded packet offset index
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "../include/cppip.h"
+
+/**
+ * Every packet's virtual offset is stored, but with the block address
+ * swapped for the block's number among the blocks packets start in. That
+ * keeps the sequence monotone and dense: it climbs by 65536 per block, ie:
+ * by about the size of a packet per packet. Elias-Fano splits each value
+ * into l low bits stored verbatim and the rest stored in unary as gaps in
+ * a bit vector, l being chosen from the average gap.
+ */
+
+int
+index_ef_init(index_ef_build_t *b, char *errbuf)
+{
+    memset(b, 0, sizeof (index_ef_build_t));
+    b->spool = tmpfile();
+    if (b->spool == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "tmpfile(): %s\n", strerror(errno));
+        return -1;
+    }
+    return writer_init(&b->w, fileno(b->spool), 0, WRITER_BUF_SIZ, errbuf);
+}
+
+int
+index_ef_add(index_ef_build_t *b, uint64_t offset, char *errbuf)
+{
+    uint64_t *p, v;
+
+    /** a new block, remember where it lives */
+    if (b->blk_cnt == 0 || b->blks[b->blk_cnt - 1] != offset >> 16)
+    {
+        if (b->blk_cnt == b->blk_siz)
+        {
+            b->blk_siz = b->blk_siz ? b->blk_siz * 2 : 1024;
+            p = realloc(b->blks, b->blk_siz * sizeof (uint64_t));
+            if (p == NULL)
+            {
+                snprintf(errbuf, BUFSIZ, "realloc(): %s\n", strerror(errno));
+                return -1;
+            }
+            b->blks = p;
+        }
+        b->blks[b->blk_cnt++] = offset >> 16;
+    }
+    v = ((uint64_t)(b->blk_cnt - 1) << 16) | (offset & 0xffff);
+    if (writer_add(&b->w, &v, sizeof (v), errbuf) == -1)
+    {
+        return -1;
+    }
+    b->n++;
+    return 1;
+}
+
+/** set bits [pos, pos + len) of w to v */
+static void
+bits_put(uint64_t *w, uint64_t pos, uint32_t len, uint64_t v)
+{
+    uint32_t sh;
+
+    if (len == 0)
+    {
+        return;
+    }
+    sh = pos & 63;
+    w[pos >> 6] |= v << sh;
+    if (sh + len > 64)
+    {
+        w[(pos >> 6) + 1] |= v >> (64 - sh);
+    }
+}
+
+/** section contents, already encoded, just needs putting in byte order */
+static int
+index_ef_out(void *arg, writer_t *w, char *errbuf)
+{
+    uint64_t i, k;
+    uint8_t hdr[CPPIP_EF_H_SIZ], word[8];
+    index_ef_build_t *b;
+    struct
+    {
+        uint64_t *p;
+        uint64_t n;
+    } arrays[4];
+
+    b = (index_ef_build_t *)arg;
+    memset(hdr, 0, sizeof (hdr));
+    le64enc(hdr,      b->n);
+    le64enc(hdr + 8,  b->hi_bits);
+    le32enc(hdr + 16, b->l);
+    le32enc(hdr + 20, b->blk_cnt);
+    le32enc(hdr + 24, b->sample_cnt);
+    if (writer_add(w, hdr, sizeof (hdr), errbuf) == -1)
+    {
+        return -1;
+    }
+
+    arrays[0].p = b->blks;
+    arrays[0].n = b->blk_cnt;
+    arrays[1].p = b->samples;
+    arrays[1].n = b->sample_cnt;
+    arrays[2].p = b->low;
+    arrays[2].n = (b->n * b->l + 63) / 64;
+    arrays[3].p = b->high;
+    arrays[3].n = (b->hi_bits + 63) / 64;
+    for (k = 0; k < 4; k++)
+    {
+        for (i = 0; i < arrays[k].n; i++)
+        {
+            le64enc(word, arrays[k].p[i]);
+            if (writer_add(w, word, sizeof (word), errbuf) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    return 1;
+}
+
+int
+index_ef_section(index_ef_build_t *b, index_v2_section_t *sect,
+        char *errbuf)
+{
+    ssize_t n;
+    off_t off;
+    uint64_t i, j, v, universe, hi_words;
+
+    if (writer_flush(&b->w, errbuf) == -1)
+    {
+        return -1;
+    }
+
+    /** low bit width from the average gap, floor(log2(universe / n)) */
+    universe = (uint64_t)b->blk_cnt << 16;
+    for (b->l = 0; b->n && (universe / b->n) >> (b->l + 1); b->l++)
+        ;
+    b->hi_bits    = b->n + (universe >> b->l) + 1;
+    b->sample_cnt = (b->n + CPPIP_EF_SAMPLE - 1) / CPPIP_EF_SAMPLE;
+    hi_words      = (b->hi_bits + 63) / 64;
+
+    /** one spare word so bits_put() can always touch the next one */
+    b->low     = calloc((b->n * b->l + 63) / 64 + 1, sizeof (uint64_t));
+    b->high    = calloc(hi_words + 1, sizeof (uint64_t));
+    b->samples = calloc(b->sample_cnt + 1, sizeof (uint64_t));
+    if (b->low == NULL || b->high == NULL || b->samples == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "calloc(): %s\n", strerror(errno));
+        return -1;
+    }
+
+    /** reuse the writer's buffer to read the spool back */
+    for (i = 0, off = 0; off < b->w.off; off += n)
+    {
+        n = pread(fileno(b->spool), b->w.buf, b->w.siz, off);
+        if (n <= 0 || n % sizeof (uint64_t))
+        {
+            snprintf(errbuf, BUFSIZ, "spool read error: %s\n",
+                    n == -1 ? strerror(errno) : "short read");
+            return -1;
+        }
+        for (j = 0; j < n / sizeof (uint64_t); j++, i++)
+        {
+            memcpy(&v, b->w.buf + j * sizeof (uint64_t), sizeof (v));
+            bits_put(b->low, i * b->l, b->l,
+                    v & (((uint64_t)1 << b->l) - 1));
+            bits_put(b->high, (v >> b->l) + i, 1, 1);
+            if (i % CPPIP_EF_SAMPLE == 0)
+            {
+                b->samples[i / CPPIP_EF_SAMPLE] = (v >> b->l) + i;
+            }
+        }
+    }
+
+    sect->type = CPPIP_INDEX_EF;
+    sect->len  = CPPIP_EF_H_SIZ + 8 * (b->blk_cnt + b->sample_cnt +
+            (b->n * b->l + 63) / 64 + hi_words);
+    sect->out  = index_ef_out;
+    sect->arg  = b;
+    return 1;
+}
+
+void
+index_ef_free(index_ef_build_t *b)
+{
+    writer_free(&b->w);
+    if (b->spool)
+    {
+        fclose(b->spool);
+        b->spool = NULL;
+    }
+    free(b->blks);
+    free(b->low);
+    free(b->high);
+    free(b->samples);
+    b->blks = b->low = b->high = b->samples = NULL;
+}
+
+int
+index_ef_load(cppip_t *c, const uint8_t *p, uint64_t len)
+{
+    uint64_t hi_bits, low_words, words;
+    index_ef_t *ef;
+
+    ef = &c->ef;
+    if (len < CPPIP_EF_H_SIZ)
+    {
+        snprintf(c->errbuf, BUFSIZ, "packet offset section too small\n");
+        return -1;
+    }
+    ef->n          = le64dec(p);
+    hi_bits        = le64dec(p + 8);
+    ef->l          = le32dec(p + 16);
+    ef->blk_cnt    = le32dec(p + 20);
+    ef->sample_cnt = le32dec(p + 24);
+    ef->hi_words   = (hi_bits + 63) / 64;
+    low_words      = (ef->n * ef->l + 63) / 64;
+    words          = ef->blk_cnt + ef->sample_cnt + low_words + ef->hi_words;
+    if (ef->n == 0 || ef->l > 32 ||
+            ef->sample_cnt != (ef->n + CPPIP_EF_SAMPLE - 1) / CPPIP_EF_SAMPLE ||
+            hi_bits < ef->n || words != (len - CPPIP_EF_H_SIZ) / 8)
+    {
+        snprintf(c->errbuf, BUFSIZ, "packet offset section has a bad header\n");
+        ef->n = 0;
+        return -1;
+    }
+    ef->blks    = p + CPPIP_EF_H_SIZ;
+    ef->samples = ef->blks + 8 * ef->blk_cnt;
+    ef->low     = ef->samples + 8 * ef->sample_cnt;
+    ef->high    = ef->low + 8 * low_words;
+    return 1;
+}
+
+/** word i of a little endian 64 bit word array, 0 past the end */
+static uint64_t
+ef_word(const uint8_t *a, uint64_t i, uint64_t n)
+{
+    return i < n ? le64dec(a + 8 * i) : 0;
+}
+
+int
+index_ef_get(cppip_t *c, uint64_t pkt_num, uint64_t *offset)
+{
+    int k;
+    uint64_t i, pos, wi, bits, low, hi, v, blk, low_words;
+    index_ef_t *ef;
+
+    ef = &c->ef;
+    if (pkt_num == 0 || pkt_num > ef->n)
+    {
+        snprintf(c->errbuf, BUFSIZ, "packet %llu not in packet offset index\n",
+                (unsigned long long)pkt_num);
+        return -1;
+    }
+    i = pkt_num - 1;
+
+    /** select: find the 1 bit for element i, from the nearest sample */
+    pos  = le64dec(ef->samples + 8 * (i / CPPIP_EF_SAMPLE));
+    wi   = pos >> 6;
+    bits = ef_word(ef->high, wi, ef->hi_words) & (~(uint64_t)0 << (pos & 63));
+    for (k = i % CPPIP_EF_SAMPLE; ; )
+    {
+        if (k < __builtin_popcountll(bits))
+        {
+            for (; k; k--)
+            {
+                bits &= bits - 1;
+            }
+            break;
+        }
+        k -= __builtin_popcountll(bits);
+        if (++wi >= ef->hi_words)
+        {
+            snprintf(c->errbuf, BUFSIZ, "corrupt packet offset index\n");
+            return -1;
+        }
+        bits = ef_word(ef->high, wi, ef->hi_words);
+    }
+    hi = (wi << 6) + __builtin_ctzll(bits) - i;
+
+    /** low bits, possibly straddling two words */
+    low = 0;
+    if (ef->l)
+    {
+        low_words = (ef->n * ef->l + 63) / 64;
+        pos = i * ef->l;
+        low = ef_word(ef->low, pos >> 6, low_words) >> (pos & 63);
+        if ((pos & 63) + ef->l > 64)
+        {
+            low |= ef_word(ef->low, (pos >> 6) + 1, low_words) <<
+                    (64 - (pos & 63));
+        }
+        low &= ((uint64_t)1 << ef->l) - 1;
+    }
+    v = (hi << ef->l) | low;
+
+    /** and back to a real virtual offset */
+    blk = v >> 16;
+    if (blk >= ef->blk_cnt)
+    {
+        snprintf(c->errbuf, BUFSIZ, "corrupt packet offset index\n");
+        return -1;
+    }
+    *offset = (le64dec(ef->blks + 8 * blk) << 16) | (v & 0xffff);
+    return 1;
+}
+
+/** EOF */
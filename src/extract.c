@@ -27,95 +27,828 @@
 
 /** XXX this whole thing is a mess and needs a re-write */
 
+/** extract_copy(): the range runs to the end of the file */
+#define EXTRACT_EOF     UINT64_MAX
+
+int
+extract_write(cppip_t *c, const void *data, size_t len)
+{
+    if (c->zout)
+    {
+        return zout_add(c->zout, data, len, c->errbuf);
+    }
+    if (c->pcap_w)
+    {
+        return writer_add(c->pcap_w, data, len, c->errbuf);
+    }
+    if (write(c->pcap_new, data, len) != len)
+    {
+        snprintf(c->errbuf, BUFSIZ, "write() error: %s\n", strerror(errno));
+        return -1;
+    }
+    return 1;
+}
+
+int
+extract_close(cppip_t *c)
+{
+    if (c->zout)
+    {
+        return zout_close(c->zout, c->errbuf);
+    }
+    if (c->pcap_w)
+    {
+        return writer_flush(c->pcap_w, c->errbuf);
+    }
+    return 1;
+}
+
+/** the pcap.gz's key in the block cache, looked up once */
+static uint64_t
+extract_id(cppip_t *c)
+{
+    if (c->pcap_id == 0)
+    {
+        c->pcap_id = bcache_id(c->pcap_fd);
+    }
+    return c->pcap_id;
+}
+
+int
+extract_seek(cppip_t *c, uint64_t offset)
+{
+    if (c->bcache)
+    {
+        return bcache_load(c->bcache, extract_id(c), c->pcap, c->pcap_fd,
+                offset) == -1 ? -1 : 1;
+    }
+    return bgzf_goto(c->pcap, offset);
+}
+
+int
+extract_bytes(cppip_t *c, void *buf, int len)
+{
+    if (c->bcache)
+    {
+        return bcache_read(c->bcache, extract_id(c), c->pcap, c->pcap_fd,
+                buf, len);
+    }
+    return bgzf_read(c->pcap, buf, len);
+}
+
+const uint8_t *
+extract_view(cppip_t *c, int len)
+{
+    if (c->bcache)
+    {
+        return bcache_view(c->bcache, extract_id(c), c->pcap, c->pcap_fd,
+                len, &c->arena, &c->arena_siz);
+    }
+    return bgzf_view(c->pcap, c->pcap_fd, len, &c->arena, &c->arena_siz);
+}
+
+static uint32_t
+pcap_swap32(uint32_t v)
+{
+    return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+/**
+ *  One record header decoder per kind of pcap, extract_open() picks the
+ *  capture's once so the packet loops call it without asking what kind of
+ *  pcap it is. Native microsecond pcaps, nearly all of them, get one that
+ *  leaves the header as it lies.
+ */
+static uint32_t
+pcap_dec_native(pcap_offline_pkthdr_t *pcap_h)
+{
+    return 0;
+}
+
+static uint32_t
+pcap_dec_nsec(pcap_offline_pkthdr_t *pcap_h)
+{
+    uint32_t ns;
+
+    ns = pcap_h->tv_usec % 1000;
+    pcap_h->tv_usec /= 1000;
+    return ns;
+}
+
+static uint32_t
+pcap_dec_swap(pcap_offline_pkthdr_t *pcap_h)
+{
+    pcap_h->tv_sec  = pcap_swap32(pcap_h->tv_sec);
+    pcap_h->tv_usec = pcap_swap32(pcap_h->tv_usec);
+    pcap_h->caplen  = pcap_swap32(pcap_h->caplen);
+    pcap_h->len     = pcap_swap32(pcap_h->len);
+    return 0;
+}
+
+static uint32_t
+pcap_dec_swap_nsec(pcap_offline_pkthdr_t *pcap_h)
+{
+    uint32_t ns;
+
+    pcap_h->tv_sec  = pcap_swap32(pcap_h->tv_sec);
+    ns              = pcap_swap32(pcap_h->tv_usec);
+    pcap_h->tv_usec = ns / 1000;
+    pcap_h->caplen  = pcap_swap32(pcap_h->caplen);
+    pcap_h->len     = pcap_swap32(pcap_h->len);
+    return ns % 1000;
+}
+
+/**
+ *  And one header reader per kind of capture, also picked by
+ *  extract_open(): native pcaps are read straight into the header, the
+ *  others through c->pcap_rh and their decoder, pcapng by pcapng_hdr().
+ */
+static int
+extract_hdr_native(cppip_t *c, pcap_offline_pkthdr_t *pcap_h)
+{
+    return extract_bytes(c, pcap_h, PCAP_PKTH_SIZ);
+}
+
+static int
+extract_hdr_dec(cppip_t *c, pcap_offline_pkthdr_t *pcap_h)
+{
+    int n;
+
+    /** the header as read is kept to be written out as it was */
+    n = extract_bytes(c, c->pcap_rh, PCAP_PKTH_SIZ);
+    if (n == PCAP_PKTH_SIZ)
+    {
+        memcpy(pcap_h, c->pcap_rh, PCAP_PKTH_SIZ);
+        c->pcap_ns = c->pcap_dec(pcap_h);
+    }
+    return n;
+}
+
+int
+extract_hdr(cppip_t *c, pcap_offline_pkthdr_t *pcap_h)
+{
+    bgzf_readahead(c->pcap, c->pcap_fd, &c->ra_off, c->ra_depth);
+    return c->pcap_hdr(c, pcap_h);
+}
+
+const void *
+extract_rh(cppip_t *c, pcap_offline_pkthdr_t *pcap_h)
+{
+    return c->pcap_hdr == extract_hdr_dec ? (const void *)c->pcap_rh :
+            (const void *)pcap_h;
+}
+
+uint32_t
+extract_fh32(cppip_t *c, const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return c->pcap_swap ? pcap_swap32(v) : v;
+}
+
+int
+extract_skip(cppip_t *c, pcap_offline_pkthdr_t *pcap_h)
+{
+    /** pcapng_hdr() has been through the whole block */
+    if (c->pcapng)
+    {
+        return 1;
+    }
+    return bgzf_skip(c->pcap, c->pcap_fd, pcap_h->caplen);
+}
+
+const uint8_t *
+extract_read(cppip_t *c, pcap_offline_pkthdr_t *pcap_h)
+{
+    const uint8_t *p;
+
+    if (c->pcapng)
+    {
+        return c->ng_blk + PCAPNG_EPB_SIZ;
+    }
+    p = extract_view(c, pcap_h->caplen);
+    if (p == NULL)
+    {
+        snprintf(c->errbuf, BUFSIZ, 
+            "bgzf_read() error: can't read packet\n");
+    }
+    return p;
+}
+
+int
+extract_keep(cppip_t *c, pcap_offline_pkthdr_t *pcap_h, const uint8_t *p)
+{
+    /** a pcapng packet goes out as the block it came in, options and all */
+    if (c->pcapng)
+    {
+        if (extract_write(c, c->ng_bh, PCAPNG_BH_SIZ) == -1 ||
+                extract_write(c, c->ng_blk, c->ng_len - PCAPNG_BH_SIZ) == -1)
+        {
+            return -1;
+        }
+    }
+    else if (extract_write(c, extract_rh(c, pcap_h), PCAP_PKTH_SIZ) == -1 ||
+            extract_write(c, p, pcap_h->caplen) == -1)
+    {
+        return -1;
+    }
+    c->e_pkts.pkts_w++;
+    return 1;
+}
+
+/**
+ * Read the packet whose pcap header was just read and write it out, unless
+ * the -F filter says otherwise. The filter looks at the packet where it
+ * lies and it's copied only once, to the output.
+ * returns: 1 if written, 0 if filtered out, -1 on error
+ */
+static int
+extract_pkt(cppip_t *c, pcap_offline_pkthdr_t *pcap_h)
+{
+    const uint8_t *p;
+
+    p = extract_read(c, pcap_h);
+    if (p == NULL)
+    {
+        return -1;
+    }
+    if (c->filter && !filter_match(c, p, pcap_h->caplen, pcap_h->len))
+    {
+        return 0;
+    }
+    return extract_keep(c, pcap_h, p);
+}
+
+int
+extract_open(cppip_t *c, uint8_t *pcap_fh)
+{
+    int n;
+    uint32_t magic;
+
+    if (bgzf_read(c->pcap, pcap_fh, 24) != 24)
+    {
+        snprintf(c->errbuf, BUFSIZ, "bgzf_read() error: can't read pcap\n");
+        return -1;
+    }
+    memcpy(&magic, pcap_fh, 4);
+    c->pcapng     = magic == PCAPNG_SHB;
+    c->pcap_magic = magic;
+    c->pcap_swap  = magic == PCAP_MAGIC_SWAP || magic == PCAP_MAGIC_NSEC_SWAP;
+    c->pcap_nsec  = magic == PCAP_MAGIC_NSEC || magic == PCAP_MAGIC_NSEC_SWAP;
+    c->pcap_dec   = pcap_dec_native;
+    c->pcap_hdr   = extract_hdr_native;
+    c->pcap_ns    = 0;
+    if (c->pcapng)
+    {
+        if (bgzf_seek(c->pcap, 0, SEEK_SET) == -1)
+        {
+            snprintf(c->errbuf, BUFSIZ, "bgzf_seek() error.\n");
+            return -1;
+        }
+        n = pcapng_open(c, pcap_fh);
+        if (n == -1)
+        {
+            return -1;
+        }
+        c->pcap_hdr = pcapng_hdr;
+    }
+    else
+    {
+        switch (magic)
+        {
+            case PCAP_MAGIC:
+                break;
+            case PCAP_MAGIC_NSEC:
+                c->pcap_dec = pcap_dec_nsec;
+                c->pcap_hdr = extract_hdr_dec;
+                break;
+            case PCAP_MAGIC_SWAP:
+                c->pcap_dec = pcap_dec_swap;
+                c->pcap_hdr = extract_hdr_dec;
+                break;
+            case PCAP_MAGIC_NSEC_SWAP:
+                c->pcap_dec = pcap_dec_swap_nsec;
+                c->pcap_hdr = extract_hdr_dec;
+                break;
+            default:
+                snprintf(c->errbuf, BUFSIZ,
+                        "%s: not a pcap or pcapng capture (magic %08x)\n",
+                        c->pcap_fname, magic);
+                return -1;
+        }
+        c->linktype = extract_fh32(c, pcap_fh + 20);
+        n = 24;
+    }
+
+    /** the filter is compiled for the pcap's link type(s) */
+    if (c->filter_s && filter_init(c) == -1)
+    {
+        return -1;
+    }
+    return n;
+}
+
+cppip_t *
+extract_source(uint8_t flags, char *index, char *pcap, int need,
+        char *errbuf)
+{
+    cppip_t *f;
+
+    f = control_context_init(flags, index, NULL, NULL, NULL, VERIFY, errbuf);
+    if (f == NULL)
+    {
+        return NULL;
+    }
+    if (index_verify(f, 0) == -1)
+    {
+        memcpy(errbuf, f->errbuf, BUFSIZ);
+        goto err;
+    }
+    if ((f->cppip_h.index_mode & need) != need)
+    {
+        snprintf(errbuf, BUFSIZ, "%s has no %s index\n", index,
+                need == CPPIP_INDEX_TS ? "timestamp" : "suitable");
+        goto err;
+    }
+    if (bgzf_is_bgzf(pcap) == 0)
+    {
+        snprintf(errbuf, BUFSIZ, "%s is not a bgzf compressed file\n", pcap);
+        goto err;
+    }
+    f->pcap = bgzf_open_fd(pcap, &f->pcap_fd);
+    if (f->pcap == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "can't open bgzip pcap file %s: %s\n", pcap,
+                strerror(errno));
+        goto err;
+    }
+    f->pcap_fname = pcap;
+    return f;
+err:
+    control_context_destroy(f);
+    return NULL;
+}
+
+/** block cache hits and misses, shared by every extraction using it */
+static void
+extract_cache_report(cppip_t *c)
+{
+    uint64_t hits, misses;
+
+    if (c->bcache && (c->flags & CPPIP_CTRL_DEBUG))
+    {
+        bcache_stats(c->bcache, &hits, &misses);
+        fprintf(stderr, "DBG: block cache hits:\t%llu\n",
+                (unsigned long long)hits);
+        fprintf(stderr, "DBG: block cache misses:\t%llu\n",
+                (unsigned long long)misses);
+    }
+}
+
 int
 extract(cppip_t *c)
 {
+    int n;
     uint8_t buf[BUFSIZ];
 
+    if (c->ranges_fname)
+    {
+        n = batch_extract(c);
+        extract_cache_report(c);
+        return n;
+    }
+
     /** extract and write original pcap file header to new pcap */
-    if (bgzf_read(c->pcap, buf, 24) != 24)
+    n = extract_open(c, buf);
+    if (n == -1)
     {
-        snprintf(c->errbuf, BUFSIZ, "bgzf_read() error: can't read pcap\n");
         return -1;
     }
-    if (write(c->pcap_new, buf, 24) != 24)
+    if (extract_write(c, buf, n) == -1)
     {
-        snprintf(c->errbuf, BUFSIZ, "write() error: %s\n", strerror(errno));
         return -1;
     }
 
     switch (c->index_mode)
     {
         case CPPIP_INDEX_PN:
-            return extract_by_pn(c);
+            n = extract_by_pn(c);
+            break;
         case CPPIP_INDEX_TS:
-            return extract_by_ts(c);
+            n = extract_by_ts(c);
+            break;
+        case CPPIP_INDEX_FLOW:
+            n = extract_by_flow(c);
+            break;
+        case CPPIP_INDEX_HOST:
+            n = extract_by_host(c);
+            break;
         default:
             snprintf(c->errbuf, BUFSIZ, "unknown extract mode\n");
             return -1;
     }
+    if (n == 1)
+    {
+        n = extract_close(c);
+    }
+    extract_cache_report(c);
+    return n;
+}
+
+/**
+ * Copy the packets from virtual offset start up to stop, EXTRACT_EOF for
+ * the rest of the file, to the compressed output. Blocks wholly inside the
+ * range are copied as they are, only the partial blocks at either end are
+ * inflated and compressed again.
+ */
+static int
+extract_copy(cppip_t *c, uint64_t start, uint64_t stop)
+{
+    int fd, ret, bsize, isize;
+    int64_t addr, end;
+    uint32_t len;
+    uint8_t *buf, eof[28];
+    struct stat stat_buf;
+
+    fd  = c->pcap_fd;
+    ret = -1;
+    buf = malloc(BGZF_BLOCK_MAX_SIZ);
+    if (buf == NULL)
+    {
+        snprintf(c->errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+        return -1;
+    }
+
+    /** the end of one block is the start of the next, use the latter */
+    if (start & 0xffff)
+    {
+        if (bgzf_block_info(c->pcap_fd, start >> 16, &bsize, &isize) != 1)
+        {
+            goto bad_block;
+        }
+        if ((start & 0xffff) == isize)
+        {
+            start = (uint64_t)((start >> 16) + bsize) << 16;
+        }
+    }
+    if (stop != EXTRACT_EOF && (stop & 0xffff))
+    {
+        if (bgzf_block_info(c->pcap_fd, stop >> 16, &bsize, &isize) != 1)
+        {
+            goto bad_block;
+        }
+        if ((stop & 0xffff) == isize)
+        {
+            stop = (uint64_t)((stop >> 16) + bsize) << 16;
+        }
+    }
+    addr = start >> 16;
+    if (stop == EXTRACT_EOF)
+    {
+        /** everything up to the EOF block, the output gets its own */
+        if (fstat(fd, &stat_buf) == -1)
+        {
+            snprintf(c->errbuf, BUFSIZ, "fstat(): %s\n", strerror(errno));
+            goto done;
+        }
+        end = stat_buf.st_size;
+        if (end >= (int64_t)sizeof (eof) && pread(fd, eof, sizeof (eof),
+                end - sizeof (eof)) == sizeof (eof) && eof[0] == 0x1f &&
+                eof[1] == 0x8b && eof[16] == 0x1b && eof[17] == 0 &&
+                le32dec(eof + 24) == 0)
+        {
+            end -= sizeof (eof);
+        }
+    }
+    else
+    {
+        end = stop >> 16;
+    }
+
+    /** the head: the rest of the first block, or all of it is the range */
+    if (start & 0xffff)
+    {
+        if (bgzf_block_info(c->pcap_fd, addr, &bsize, &isize) != 1)
+        {
+            goto bad_block;
+        }
+        len = isize - (start & 0xffff);
+        if (addr == end)
+        {
+            len = (stop & 0xffff) - (start & 0xffff);
+        }
+        if (bgzf_seek(c->pcap, start, SEEK_SET) == -1 ||
+                bgzf_read(c->pcap, buf, len) != len)
+        {
+            snprintf(c->errbuf, BUFSIZ, "bgzf_read() error: can't read pcap\n");
+            goto done;
+        }
+        if (extract_write(c, buf, len) == -1)
+        {
+            goto done;
+        }
+        if (addr == end)
+        {
+            ret = 1;
+            goto done;
+        }
+        addr += bsize;
+    }
+
+    /** the bulk of it, not inflated at all */
+    if (end > addr && zout_copy(c->zout, fd, addr, end - addr,
+            c->errbuf) == -1)
+    {
+        goto done;
+    }
+
+    /** the tail: the start of the last block */
+    if (stop != EXTRACT_EOF && (stop & 0xffff))
+    {
+        len = stop & 0xffff;
+        if (bgzf_seek(c->pcap, stop & ~0xffffULL, SEEK_SET) == -1 ||
+                bgzf_read(c->pcap, buf, len) != len)
+        {
+            snprintf(c->errbuf, BUFSIZ, "bgzf_read() error: can't read pcap\n");
+            goto done;
+        }
+        if (extract_write(c, buf, len) == -1)
+        {
+            goto done;
+        }
+    }
+    if (c->flags & CPPIP_CTRL_DEBUG)
+    {
+        fprintf(stderr, "DBG: bytes copied as is:\t%llu\n",
+                (unsigned long long)c->zout->copied);
+        fprintf(stderr, "DBG: blocks compressed:\t%llu\n",
+                (unsigned long long)c->zout->blocks);
+    }
+    ret = 1;
+    goto done;
+bad_block:
+    snprintf(c->errbuf, BUFSIZ, "%s: bad bgzf block\n", c->pcap_fname);
+done:
+    free(buf);
+    return ret;
+}
+
+/** copy packets pkt_start - pkt_stop, c->pcap is at pkt_start */
+static int
+extract_pn_copy(cppip_t *c)
+{
+    uint64_t start, stop;
+    cppip_record_t rec, target;
+
+    start = bgzf_tell(c->pcap);
+
+    /** the range ends where the packet after it starts */
+    if (c->e_pkts.pkt_stop == c->pkt_cnt)
+    {
+        stop = EXTRACT_EOF;
+    }
+    else if (c->cppip_h.index_mode & CPPIP_INDEX_EF)
+    {
+        if (index_ef_get(c, c->e_pkts.pkt_stop + 1, &stop) == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        target.pkt_num = c->e_pkts.pkt_stop + 1;
+        if (index_stream_search(c, &c->pn_stream, CPPIP_REC_F_PKT, &target,
+                &rec) == -1)
+        {
+            return -1;
+        }
+        if (extract_seek(c, rec.bgzf_offset) == -1)
+        {
+            snprintf(c->errbuf, BUFSIZ, "bgzf_seek() error.\n");
+            return -1;
+        }
+        if (linear_search(c, rec.pkt_num, c->e_pkts.pkt_stop + 1) == -1)
+        {
+            return -1;
+        }
+        stop = bgzf_tell(c->pcap);
+    }
+    if (extract_copy(c, start, stop) == -1)
+    {
+        return -1;
+    }
+    c->e_pkts.pkts_w = c->e_pkts.pkt_stop - c->e_pkts.pkt_start + 1;
     return 1;
 }
 
+/**
+ * Find the first packet stamped ts or later, leaving c->pcap just past its
+ * header and its offset in *off. *prev gets the timestamp of the packet
+ * before it, if we saw one.
+ * returns: 1 if found, 0 if we ran out of file, -1 on error
+ */
+static int
+extract_ts_find(cppip_t *c, struct timeval *ts, uint64_t *off,
+        pcap_offline_pkthdr_t *pcap_h, struct timeval *prev)
+{
+    int n;
+    struct timeval cur;
+    cppip_record_t rec;
+
+    if (index_stream_search_ts(c, &c->ts_stream, ts, &rec) == -1)
+    {
+        return -1;
+    }
+    if (extract_seek(c, rec.bgzf_offset) == -1)
+    {
+        snprintf(c->errbuf, BUFSIZ, "bgzf_seek() error.\n");
+        return -1;
+    }
+    for (;;)
+    {
+        *off = bgzf_tell(c->pcap);
+        n = extract_hdr(c, pcap_h);
+        if (n == 0)
+        {
+            return 0;
+        }
+        if (n != PCAP_PKTH_SIZ)
+        {
+            snprintf(c->errbuf, BUFSIZ,
+                "bgzf_read() error: cant read pcap hdr\n");
+            return -1;
+        }
+        cur.tv_sec  = pcap_h->tv_sec;
+        cur.tv_usec = pcap_h->tv_usec;
+        if (!timercmp(&cur, ts, <))
+        {
+            return 1;
+        }
+        *prev = cur;
+        if (extract_skip(c, pcap_h) == -1)
+        {
+            snprintf(c->errbuf, BUFSIZ, "bgzf_skip() error.\n");
+            return -1;
+        }
+    }
+}
+
+/**
+ * Copy the packets from ts_start to ts_stop. Same matching rules as
+ * extract_by_ts(), but the packets in between are never looked at.
+ */
+static int
+extract_ts_copy(cppip_t *c)
+{
+    int n, exact;
+    uint64_t start, stop;
+    struct timeval cur, prev, one, after;
+    pcap_offline_pkthdr_t pcap_h;
+
+    n = extract_ts_find(c, &c->e_pkts.ts_start, &start, &pcap_h, &prev);
+    if (n == -1)
+    {
+        return -1;
+    }
+    if (n == 0)
+    {
+        snprintf(c->errbuf, BUFSIZ, "bgzf_read(): hit EOF, start ts not found\n");
+        return -1;
+    }
+    cur.tv_sec  = pcap_h.tv_sec;
+    cur.tv_usec = pcap_h.tv_usec;
+    if (timercmp(&cur, &c->e_pkts.ts_start, !=))
+    {
+        if (!(c->flags & CPPIP_CTRL_TS_FM))
+        {
+            snprintf(c->errbuf, BUFSIZ, 
+                "%s not found, closest is %s (try -f)\n",
+                ctime_usec(&c->e_pkts.ts_start), ctime_usec(&cur));
+            return -1;
+        }
+        fprintf(stderr, 
+                "start ts: %s not found, instead fuzzy matched on %s\n",
+                ctime_usec(&c->e_pkts.ts_start), ctime_usec(&cur));
+    }
+
+    /**
+     * The range ends where the first packet stamped after stop ts starts,
+     * so every packet stamped stop ts is in it.
+     */
+    timerclear(&prev);
+    n = extract_ts_find(c, &c->e_pkts.ts_stop, &stop, &pcap_h, &prev);
+    if (n == -1)
+    {
+        return -1;
+    }
+    cur.tv_sec  = pcap_h.tv_sec;
+    cur.tv_usec = pcap_h.tv_usec;
+    exact = n == 1 && timercmp(&cur, &c->e_pkts.ts_stop, ==);
+    if (exact)
+    {
+        one.tv_sec  = 0;
+        one.tv_usec = 1;
+        timeradd(&c->e_pkts.ts_stop, &one, &after);
+        n = extract_ts_find(c, &after, &stop, &pcap_h, &prev);
+        if (n == -1)
+        {
+            return -1;
+        }
+    }
+    else if (!(c->flags & CPPIP_CTRL_TS_FM))
+    {
+        snprintf(c->errbuf, BUFSIZ, n ? "stop ts: %s not found (try -f)\n" :
+                "bgzf_read(): hit EOF, stop ts: %s not found\n",
+                ctime_usec(&c->e_pkts.ts_stop));
+        return -1;
+    }
+    if (n == 0)
+    {
+        stop = EXTRACT_EOF;
+    }
+    /** a fuzzy start past stop ts leaves nothing to write */
+    if (stop != EXTRACT_EOF && stop <= start)
+    {
+        fprintf(stderr, "no packets stamped from %s to %s\n",
+                ctime_usec(&c->e_pkts.ts_start),
+                ctime_usec(&c->e_pkts.ts_stop));
+        c->e_pkts.pkts_w = 0;
+        return 1;
+    }
+    if (!exact)
+    {
+        fprintf(stderr, 
+                "stop ts: %s not found, instead fuzzy matched on %s\n",
+                ctime_usec(&c->e_pkts.ts_stop), ctime_usec(&prev));
+    }
+    c->e_pkts.copied = 1;
+    return extract_copy(c, start, stop);
+}
+
 int
 extract_by_pn(cppip_t *c)
 {
-    cppip_record_pn_t rec;
-    cppip_index_pn_hdr_t *pn_h;
-    uint32_t i, j, pkt_caplen;
+    cppip_record_t rec, target;
+    uint64_t i;
     pcap_offline_pkthdr_t pcap_h;
-    uint8_t buf[131072], buf2[131072];
-
 
+    if (!(c->cppip_h.index_mode & (CPPIP_INDEX_PN | CPPIP_INDEX_EF)))
+    {
+        snprintf(c->errbuf, BUFSIZ, "%s has no pkt-num index\n",
+                c->index_fname);
+        return -1;
+    }
     /** sanity check only checks stop, we verified earlier stop > start */
-    if (c->e_pkts.pkt_stop  > c->cppip_h.pkt_cnt)
+    if (c->e_pkts.pkt_stop  > c->pkt_cnt)
     {
         snprintf(c->errbuf, BUFSIZ, 
-            "extraction would exceed packet count, %d and/or %d > %d\n", 
-            c->e_pkts.pkt_start, c->e_pkts.pkt_stop, c->cppip_h.pkt_cnt);
+            "extraction would exceed packet count, %llu and/or %llu > %llu\n",
+            (unsigned long long)c->e_pkts.pkt_start,
+            (unsigned long long)c->e_pkts.pkt_stop,
+            (unsigned long long)c->pkt_cnt);
         return -1;
     }
 
-    /** 
-     * We need to locate the offset of pkt_start and then we can 
-     * extract in a linear fashion until we hit pkt_last.
-     */
+    /** packets that have to be read one by one are read on every thread */
+    if (c->threads > 1 && !(c->zout && c->filter == NULL))
+    {
+        return pull_extract(c);
+    }
 
-    /** 
-     * If the indexing is too coarse the pkt_start will lie before the 
-     * first index. If this is the case we have to do a linear search from
-     * the very first packet until we find pkt_first...
-     */
-    if (c->e_pkts.pkt_start < c->cppip_index_pn_hdr.index_level)
+    /** with every packet's offset at hand there's nothing to search */
+    if (c->cppip_h.index_mode & CPPIP_INDEX_EF)
     {
-        if (linear_search(c, 1, c->e_pkts.pkt_start) == -1)
+        if (index_ef_get(c, c->e_pkts.pkt_start, &rec.bgzf_offset) == -1)
+        {
+            return -1;
+        }
+        if (c->flags & CPPIP_CTRL_DEBUG)
+        {
+            fprintf(stderr, "DBG: pkt off:\t\t\t%llx\n",
+                    (unsigned long long)rec.bgzf_offset);
+        }
+        if (extract_seek(c, rec.bgzf_offset) == -1)
         {
+            snprintf(c->errbuf, BUFSIZ, "bgzf_seek() error.\n");
             return -1;
         }
     }
-    /** seek to index, obtain closest offset, linear search from there */
     else
     {
         /** 
-         * pkt_start / index_level will give us the closest index record to our
-         * starting packet. We lseek to 1 before this location so we don't
-         * step past the record we need.
+         * Otherwise we need to locate the offset of pkt_start and then we
+         * can extract in a linear fashion until we hit pkt_last. The first
+         * record is always packet 1 so the closest record at or before
+         * pkt_start always exists, we seek there and linear search the rest.
          */
-        if (lseek(c->index, 
-            (((c->e_pkts.pkt_start / c->cppip_index_pn_hdr.index_level) - 1)
-            * CPPIP_REC_PN_SIZ) + CPPIP_FH_SIZ + CPPIP_INDEX_PN_H_SIZ, 
-            SEEK_SET) == -1)
+        target.pkt_num = c->e_pkts.pkt_start;
+        if (index_stream_search(c, &c->pn_stream, CPPIP_REC_F_PKT, &target,
+                &rec) == -1)
         {
-            snprintf(c->errbuf, BUFSIZ, "lseek() error: %s\n", strerror(errno));
             return -1;
         }
-        if (read(c->index, (cppip_record_pn_t *)&rec, CPPIP_REC_PN_SIZ) 
-            != CPPIP_REC_PN_SIZ)
-        {
-            snprintf(c->errbuf, BUFSIZ, "read() error: %s\n", strerror(errno));
-            return -1;
-        }
-        if (bgzf_seek(c->pcap, rec.bgzf_offset, SEEK_SET) == -1)
+        if (extract_seek(c, rec.bgzf_offset) == -1)
         {
             snprintf(c->errbuf, BUFSIZ, "bgzf_seek() error.\n");
             return -1;
@@ -125,50 +858,165 @@ extract_by_pn(cppip_t *c)
             return -1;
         }
     }
+    /** unfiltered and compressed, most of it needn't be inflated at all */
+    if (c->zout && c->filter == NULL)
+    {
+        return extract_pn_copy(c);
+    }
     /** we've got pkt_first, do extraction until we hit pkt_last */
     for (c->e_pkts.pkts_w = 0, i = c->e_pkts.pkt_start; 
-            i < (c->e_pkts.pkt_stop + 1); i++, c->e_pkts.pkts_w++)
+            i <= c->e_pkts.pkt_stop; i++)
     {
-        if (bgzf_read(c->pcap, (pcap_offline_pkthdr_t *)&pcap_h, PCAP_PKTH_SIZ)
-            != PCAP_PKTH_SIZ)
+        if (extract_hdr(c, &pcap_h) != PCAP_PKTH_SIZ)
         {
             snprintf(c->errbuf, BUFSIZ, 
                 "bgzf_read() error: cant read pcap hdr\n");
             return -1;
         }
-        pkt_caplen = pcap_h.caplen;
-        if (bgzf_read(c->pcap, buf, pkt_caplen) != pkt_caplen)
+        if (extract_pkt(c, &pcap_h) == -1)
+        {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+int
+extract_by_flow(cppip_t *c)
+{
+    int n;
+    uint64_t offset;
+    index_flow_iter_t it;
+    pcap_offline_pkthdr_t pcap_h;
+
+    if (!(c->cppip_h.index_mode & CPPIP_INDEX_FLOW))
+    {
+        snprintf(c->errbuf, BUFSIZ, "%s has no flow index\n",
+                c->index_fname);
+        return -1;
+    }
+    n = index_flow_find(c, &c->e_pkts.flow, &it);
+    if (n != 1)
+    {
+        if (n == 0)
+        {
+            snprintf(c->errbuf, BUFSIZ, "flow not found: %s\n",
+                    flow_key_str(&c->e_pkts.flow));
+        }
+        return -1;
+    }
+    if (c->flags & CPPIP_CTRL_DEBUG)
+    {
+        fprintf(stderr, "DBG: flow pkts:\t\t%llu\n",
+                (unsigned long long)it.pkt_cnt);
+    }
+
+    /**
+     * The postings hold each packet's offset so we go straight to it. A
+     * flow's packets tend to share blocks so most of these don't inflate.
+     */
+    for (c->e_pkts.pkts_w = 0; (n = index_flow_next(c, &it, &offset)) == 1; )
+    {
+        if (extract_seek(c, offset) == -1)
+        {
+            snprintf(c->errbuf, BUFSIZ, "bgzf_seek() error.\n");
+            return -1;
+        }
+        if (extract_hdr(c, &pcap_h) != PCAP_PKTH_SIZ)
         {
             snprintf(c->errbuf, BUFSIZ, 
-                "bgzf_read() error: can't read packet\n");
+                "bgzf_read() error: cant read pcap hdr\n");
             return -1;
         }
-        memcpy(&buf2, &pcap_h, PCAP_PKTH_SIZ);
-        memcpy(&buf2[PCAP_PKTH_SIZ], &buf, pkt_caplen);
-        if (write(c->pcap_new, buf2, PCAP_PKTH_SIZ + pkt_caplen) != 
-                PCAP_PKTH_SIZ + pkt_caplen)
+        if (extract_pkt(c, &pcap_h) == -1)
+        {
+            return -1;
+        }
+    }
+    return n == -1 ? -1 : 1;
+}
+
+int
+extract_by_host(cppip_t *c)
+{
+    uint32_t j;
+    uint64_t i, skipped;
+    flow_key_t key;
+    const uint8_t *ent, *p;
+    pcap_offline_pkthdr_t pcap_h;
+
+    if (!(c->cppip_h.index_mode & CPPIP_INDEX_HOST))
+    {
+        snprintf(c->errbuf, BUFSIZ, "%s has no host index\n",
+                c->index_fname);
+        return -1;
+    }
+
+    /**
+     * Intervals whose filter rules the target out are never read. The rest
+     * are read packet by packet and the filter's false positives dropped.
+     */
+    for (c->e_pkts.pkts_w = 0, skipped = 0, i = 0; i < c->host.ent_cnt; i++)
+    {
+        if (!index_host_maybe(c, i, &c->e_pkts.host))
+        {
+            skipped++;
+            continue;
+        }
+        ent = c->host.ents + CPPIP_HOST_ENT_SIZ * i;
+        if (extract_seek(c, le64dec(ent + 8)) == -1)
         {
-            snprintf(c->errbuf, BUFSIZ, "write() error: %s\n", strerror(errno));
+            snprintf(c->errbuf, BUFSIZ, "bgzf_seek() error.\n");
             return -1;
         }
+        for (j = le32dec(ent + 24); j; j--)
+        {
+            if (extract_hdr(c, &pcap_h) != PCAP_PKTH_SIZ)
+            {
+                snprintf(c->errbuf, BUFSIZ, 
+                    "bgzf_read() error: cant read pcap hdr\n");
+                return -1;
+            }
+            p = extract_read(c, &pcap_h);
+            if (p == NULL)
+            {
+                return -1;
+            }
+            if (!flow_key_get(c->linktype, p, pcap_h.caplen, &key) ||
+                    !host_match(&c->e_pkts.host, &key) || (c->filter &&
+                    !filter_match(c, p, pcap_h.caplen, pcap_h.len)))
+            {
+                continue;
+            }
+            if (extract_keep(c, &pcap_h, p) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    if (c->flags & CPPIP_CTRL_DEBUG)
+    {
+        fprintf(stderr, "DBG: intervals skipped:\t%llu of %llu\n",
+                (unsigned long long)skipped,
+                (unsigned long long)c->host.ent_cnt);
     }
     return 1;
 }
 
 int
-linear_search(cppip_t *c, int start, int pkt_start)
+linear_search(cppip_t *c, uint64_t start, uint64_t pkt_start)
 {
-    int i;
+    uint64_t i;
     pcap_offline_pkthdr_t pcap_h;
 
     if (c->flags & CPPIP_CTRL_DEBUG)
     {
-        fprintf(stderr, "DBG: entered at pkt num:\t%d\n", start);
+        fprintf(stderr, "DBG: entered at pkt num:\t%llu\n",
+                (unsigned long long)start);
     }
     for (i = start; i < pkt_start; i++)
     {
-        if (bgzf_read(c->pcap, (pcap_offline_pkthdr_t *)&pcap_h, 
-                PCAP_PKTH_SIZ) != PCAP_PKTH_SIZ)
+        if (extract_hdr(c, &pcap_h) != PCAP_PKTH_SIZ)
         {
             snprintf(c->errbuf, BUFSIZ, 
                 "bgzf_read() error: cant read pcap hdr\n");
@@ -176,7 +1024,7 @@ linear_search(cppip_t *c, int start, int pkt_start)
         }
 
         /** skip past the packet */
-        if (bgzf_skip(c->pcap, pcap_h.caplen) == -1)
+        if (extract_skip(c, &pcap_h) == -1)
         {
             snprintf(c->errbuf, BUFSIZ, "bgzf_skip() error.\n");
             return -1;
@@ -184,7 +1032,8 @@ linear_search(cppip_t *c, int start, int pkt_start)
     }
     if (c->flags & CPPIP_CTRL_DEBUG)
     {
-        fprintf(stderr, "DBG: match at iteration:\t%d\n", i);
+        fprintf(stderr, "DBG: match at iteration:\t%llu\n",
+                (unsigned long long)i);
     }
     return 1;
 }
@@ -193,28 +1042,28 @@ int
 extract_by_ts(cppip_t *c)
 {
     int n;
-    cppip_record_ts_t rec;
-    cppip_index_ts_hdr_t *ts_h;
-    uint32_t i, pkt_caplen;
+    cppip_record_t rec;
     pcap_offline_pkthdr_t pcap_h;
-    uint8_t buf[131072], buf2[131072];
-    struct timeval cur;
-    uint32_t mul, dif;
+    struct timeval cur, nxt;
 
     /**
      * start ts: timestamp of the packet to start the extraction
      * stop ts:  timestamp of the packet to stop the extraction
      * first ts: timestamp of the first packet in the pcap.gz
      */
+    if (!(c->cppip_h.index_mode & CPPIP_INDEX_TS))
+    {
+        snprintf(c->errbuf, BUFSIZ, "%s has no timestamp index\n",
+                c->index_fname);
+        return -1;
+    }
 
     /** 
      * Read the first entry in the index file and obtain first timestamp so
      * we have a frame of reference to work with... 
      */
-    if (read(c->index, (cppip_record_ts_t *)&rec, CPPIP_REC_TS_SIZ) 
-        != CPPIP_REC_TS_SIZ)
+    if (index_stream_get(c, &c->ts_stream, 0, &rec) == -1)
     {
-        snprintf(c->errbuf, BUFSIZ, "read() error: %s\n", strerror(errno));
         return -1;
     }
     if (c->flags & CPPIP_CTRL_DEBUG)
@@ -248,54 +1097,35 @@ extract_by_ts(cppip_t *c)
             return -1;
         }
     }
-#if 0
-    /**
-     * subtract first packet's ts from the starting packet's ts to obtain a
-     * differential which we then divide by the index_level to obtain
-     * a multiplier to use to advance to the correct packet offset.
-     *
-     * Currently all of this only works for second level resolution.
-     */
-    dif = c->e_pkts.ts_start.tv_sec - rec.pkt_ts.tv_sec;
-    mul = dif / c->cppip_index_ts_hdr.index_level.tv_sec;
-    mul = (mul == 0 ? 1 : mul);
 
-    if (mul > c->cppip_index_ts_hdr.rec_cnt)
-    {
-        snprintf(c->errbuf, BUFSIZ, 
-        "tried to seek too many records (%d > %d) start ts too far in future for %s?\n", mul, c->cppip_index_ts_hdr.rec_cnt, c->pcap_fname);
-        return -1;
-    }
-    if (c->flags & CPPIP_CTRL_DEBUG)
-    {
-        fprintf(stderr, "DBG: difference:\t\t(%ld - %ld) is %u\n", 
-                c->e_pkts.ts_start.tv_sec, rec.pkt_ts.tv_sec, dif);
-        fprintf(stderr, "DBG: multiplier:\t\t%d\n", mul);
-    }
-    /** seek to index, obtain closest offset, linear search from there */
-    if (lseek(c->index, (mul * CPPIP_REC_TS_SIZ) + CPPIP_FH_SIZ,
-                SEEK_SET) == -1)
+    /** unfiltered and compressed, most of it needn't be inflated at all */
+    if (c->zout && c->filter == NULL)
     {
-        snprintf(c->errbuf, BUFSIZ, "lseek() error: %s\n", strerror(errno));
-        return -1;
+        return extract_ts_copy(c);
     }
-    if (read(c->index, (cppip_record_ts_t *)&rec, CPPIP_REC_TS_SIZ) 
-                != CPPIP_REC_TS_SIZ)
+
+    /**
+     * Find the closest record before the start ts and seek there. Records
+     * are written in timestamp order so a binary search works for any index
+     * level, sub-second ones included. If start ts predates the first record
+     * (fuzzy matching) we start at the first.
+     */
+    if (index_stream_search_ts(c, &c->ts_stream, &c->e_pkts.ts_start,
+            &rec) == -1)
     {
-        snprintf(c->errbuf, BUFSIZ, "read() error: %s\n", strerror(errno));
         return -1;
     }
     if (c->flags & CPPIP_CTRL_DEBUG)
     {
         fprintf(stderr, "DBG: pkt ts:\t\t\t%s\n", ctime_usec(&rec.pkt_ts));
-        fprintf(stderr, "DBG: pkt off:\t\t\t%llx\n", rec.bgzf_offset);
+        fprintf(stderr, "DBG: pkt off:\t\t\t%llx\n",
+                (unsigned long long)rec.bgzf_offset);
     }
-    if (bgzf_seek(c->pcap, rec.bgzf_offset, SEEK_SET) == -1)
+    if (extract_seek(c, rec.bgzf_offset) == -1)
     {
         snprintf(c->errbuf, BUFSIZ, "bgzf_seek() error.\n");
         return -1;
     }
-#endif 
     /** linear search will return with the first packet we need to write */
     n = linear_search_ts(c, &c->e_pkts.ts_start, &pcap_h);
     switch (n)
@@ -311,70 +1141,80 @@ extract_by_ts(cppip_t *c)
         default:
             break;
     }
-    if (bgzf_read(c->pcap, buf, pcap_h.caplen) != pcap_h.caplen)
+    c->e_pkts.pkts_w = 0;
+
+    /** a fuzzy start past stop ts leaves nothing to write */
+    cur.tv_sec  = pcap_h.tv_sec;
+    cur.tv_usec = pcap_h.tv_usec;
+    if (timercmp(&c->e_pkts.ts_stop, &cur, <))
     {
-        snprintf(c->errbuf, BUFSIZ, "bgzf_read() error: can't read packet\n");
-        return -1;
+        fprintf(stderr, "no packets stamped from %s to %s\n",
+                ctime_usec(&c->e_pkts.ts_start),
+                ctime_usec(&c->e_pkts.ts_stop));
+        return 1;
     }
-
-    memcpy(&buf2, &pcap_h, PCAP_PKTH_SIZ);
-    memcpy(&buf2[PCAP_PKTH_SIZ], &buf,  pcap_h.caplen);
-    if (write(c->pcap_new, buf2, PCAP_PKTH_SIZ + pcap_h.caplen) 
-            != PCAP_PKTH_SIZ + pcap_h.caplen)
+    if (extract_pkt(c, &pcap_h) == -1)
     {
-        snprintf(c->errbuf, BUFSIZ, "write() error: %s\n", strerror(errno));
         return -1;
     }
 
-    cur.tv_sec  = 0;
-    cur.tv_usec = 0;
-    for (c->e_pkts.pkts_w = 1; timercmp(&c->e_pkts.ts_stop, &cur, !=); 
-                c->e_pkts.pkts_w++)
+    /** 
+     *  Write up to the first packet stamped after stop ts, so every packet
+     *  stamped stop ts is in. Without fuzzy matching one of them has to be
+     *  there, with it the last packet at or before stop ts will do.
+     */
+    for (;;)
     {
-        if (bgzf_read(c->pcap, (pcap_offline_pkthdr_t *)&pcap_h, PCAP_PKTH_SIZ)
-                != PCAP_PKTH_SIZ)
+        if (extract_hdr(c, &pcap_h) != PCAP_PKTH_SIZ)
         {
-            if (bgzf_check_EOF(c->pcap))
+            if (!bgzf_check_EOF(c->pcap))
             {
                 snprintf(c->errbuf, BUFSIZ, 
-                        "bgzf_read(): hit EOF, stop ts: %s not found\n",
-                        ctime_usec(&c->e_pkts.ts_stop));
+                    "bgzf_read() error: cant read pcap hdr\n");
                 return -1;
             }
+            if (timercmp(&c->e_pkts.ts_stop, &cur, ==))
+            {
+                break;
+            }
+            /** fuzzy matching settles for the last packet there is */
+            if (c->flags & CPPIP_CTRL_TS_FM)
+            {
+                fprintf(stderr, 
+                    "stop ts: %s not found, instead fuzzy matched on %s\n",
+                    ctime_usec(&c->e_pkts.ts_stop), ctime_usec(&cur));
+                break;
+            }
             snprintf(c->errbuf, BUFSIZ, 
-                "bgzf_read() error: cant read pcap hdr\n");
+                    "bgzf_read(): hit EOF, stop ts: %s not found\n",
+                    ctime_usec(&c->e_pkts.ts_stop));
             return -1;
         }
-        /** if fuzzy matching is enabled, find the closest possible stop ts */
-        if (c->flags & CPPIP_CTRL_TS_FM)
+        nxt.tv_sec  = pcap_h.tv_sec;
+        nxt.tv_usec = pcap_h.tv_usec;
+        if (timercmp(&c->e_pkts.ts_stop, &nxt, <))
         {
-            if timercmp(&c->e_pkts.ts_stop, &cur, <)
+            if (timercmp(&c->e_pkts.ts_stop, &cur, ==))
+            {
+                break;
+            }
+            if (c->flags & CPPIP_CTRL_TS_FM)
             {
                 fprintf(stderr, 
                     "stop ts: %s not found, instead fuzzy matched on %s\n",
                     ctime_usec(&c->e_pkts.ts_stop), ctime_usec(&cur));
                 break;
             }
-        }
-        pkt_caplen = pcap_h.caplen;
-        if (bgzf_read(c->pcap, buf, pkt_caplen) != pkt_caplen)
-        {
-            snprintf(c->errbuf, BUFSIZ, 
-                "bgzf_read() error: can't read packet\n");
+            snprintf(c->errbuf, BUFSIZ, "stop ts: %s not found (try -f)\n",
+                    ctime_usec(&c->e_pkts.ts_stop));
             return -1;
         }
-        memcpy(&buf2, &pcap_h, PCAP_PKTH_SIZ);
-        memcpy(&buf2[PCAP_PKTH_SIZ], &buf, pkt_caplen);
-        if (write(c->pcap_new, buf2, PCAP_PKTH_SIZ + pkt_caplen) != 
-                PCAP_PKTH_SIZ + pkt_caplen)
+        if (extract_pkt(c, &pcap_h) == -1)
         {
-            snprintf(c->errbuf, BUFSIZ, "write() error: %s\n", strerror(errno));
             return -1;
         }
-        cur.tv_sec  = pcap_h.tv_sec;
-        cur.tv_usec = pcap_h.tv_usec;
+        cur = nxt;
     }
-    
     return 1;
 }
 
@@ -382,7 +1222,7 @@ int
 linear_search_ts(cppip_t *c, struct timeval *ts_start, 
         pcap_offline_pkthdr_t *pcap_h)
 {
-    int i;
+    uint64_t i;
     struct timeval cur;
 
     if (c->flags & CPPIP_CTRL_DEBUG)
@@ -392,8 +1232,7 @@ linear_search_ts(cppip_t *c, struct timeval *ts_start,
     }
     for (i = 1; i ; i++)
     {
-        if (bgzf_read(c->pcap, (pcap_offline_pkthdr_t *)pcap_h, PCAP_PKTH_SIZ) 
-            != PCAP_PKTH_SIZ)
+        if (extract_hdr(c, pcap_h) != PCAP_PKTH_SIZ)
         {
             /** if we get here we ran out of file without finding a match */
             if (bgzf_check_EOF(c->pcap))
@@ -413,7 +1252,8 @@ linear_search_ts(cppip_t *c, struct timeval *ts_start,
         {
             if (c->flags & CPPIP_CTRL_DEBUG)
             {
-                fprintf(stderr, "DBG: match at iteration:\t%d\n", i);
+                fprintf(stderr, "DBG: match at iteration:\t%llu\n",
+                        (unsigned long long)i);
             }
             return 1;
         }
@@ -425,7 +1265,8 @@ linear_search_ts(cppip_t *c, struct timeval *ts_start,
             {
                 if (c->flags & CPPIP_CTRL_DEBUG)
                 {
-                    fprintf(stderr, "DBG: fuzzy match at iteration:\t%d\n", i);
+                    fprintf(stderr, "DBG: fuzzy match at iteration:\t%llu\n",
+                            (unsigned long long)i);
                 }
                 /** at some point we should inform the user we made a FM */
                 return 2;
@@ -436,7 +1277,7 @@ linear_search_ts(cppip_t *c, struct timeval *ts_start,
             return -1;
         }
         /** skip past the packet */
-        if (bgzf_skip(c->pcap, pcap_h->caplen) == -1)
+        if (extract_skip(c, pcap_h) == -1)
         {
             snprintf(c->errbuf, BUFSIZ, "bgzf_skip() error.\n");
             return -1;
@@ -0,0 +1,194 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * filter.c: BPF filtering of extracted packets
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include "../include/cppip.h"
+
+#if defined(HAVE_LIBPCAP) && defined(HAVE_PCAP_H)
+#include <pcap.h>
+#include <pthread.h>
+
+/** pcap_compile() isn't thread safe before libpcap 1.8, the server's are */
+static pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The filter compiled once per link type in the capture. A pcap has the
+ * one, a pcapng has one per distinct link type among its interfaces.
+ */
+struct filter
+{
+    int cnt;
+    int linktype[PCAPNG_IF_MAX];
+    struct bpf_program prog[PCAPNG_IF_MAX];
+};
+
+/** compile c->filter_s for a link type, 1 if it takes every packet */
+static int
+filter_compile(cppip_t *c, int linktype, struct bpf_program *prog)
+{
+    pcap_t *p;
+
+    /** no capture, just something to compile against */
+    pthread_mutex_lock(&filter_lock);
+    p = pcap_open_dead(linktype, 262144);
+    if (p == NULL)
+    {
+        pthread_mutex_unlock(&filter_lock);
+        snprintf(c->errbuf, BUFSIZ, "pcap_open_dead() failed\n");
+        return -1;
+    }
+    if (pcap_compile(p, prog, c->filter_s, 1, PCAP_NETMASK_UNKNOWN) == -1)
+    {
+        snprintf(c->errbuf, BUFSIZ, "pcap_compile(): link type %d: %s\n",
+                linktype, pcap_geterr(p));
+        pcap_close(p);
+        pthread_mutex_unlock(&filter_lock);
+        return -1;
+    }
+    pcap_close(p);
+    pthread_mutex_unlock(&filter_lock);
+    if (c->flags & CPPIP_CTRL_DEBUG)
+    {
+        fprintf(stderr, "DBG: filter insns:\t\t%u (link type %d)\n",
+                prog->bf_len, linktype);
+    }
+    return prog->bf_len == 1 &&
+            BPF_CLASS(prog->bf_insns[0].code) == BPF_RET &&
+            BPF_RVAL(prog->bf_insns[0].code) == BPF_K &&
+            prog->bf_insns[0].k;
+}
+
+int
+filter_init(cppip_t *c)
+{
+    int i, k, n, all;
+    struct filter *f;
+
+    f = calloc(1, sizeof (struct filter));
+    if (f == NULL)
+    {
+        snprintf(c->errbuf, BUFSIZ, "calloc(): %s\n", strerror(errno));
+        return -1;
+    }
+    if (c->pcapng)
+    {
+        for (i = 0; i < c->ng_if_cnt; i++)
+        {
+            for (k = 0; k < f->cnt; k++)
+            {
+                if (f->linktype[k] == c->ng_if[i].linktype)
+                {
+                    break;
+                }
+            }
+            if (k == f->cnt)
+            {
+                f->linktype[f->cnt++] = c->ng_if[i].linktype;
+            }
+        }
+    }
+    if (f->cnt == 0)
+    {
+        f->linktype[f->cnt++] = c->linktype;
+    }
+    for (all = 1, k = 0; k < f->cnt; k++)
+    {
+        n = filter_compile(c, f->linktype[k], &f->prog[k]);
+        if (n == -1)
+        {
+            f->cnt = k;
+            c->filter = f;
+            filter_free(c);
+            return -1;
+        }
+        all &= n;
+    }
+    c->filter = f;
+
+    /** a filter that takes everything ("" does) needn't run at all */
+    if (all)
+    {
+        filter_free(c);
+    }
+    return 1;
+}
+
+int
+filter_match(cppip_t *c, const uint8_t *p, uint32_t caplen, uint32_t len)
+{
+    int k;
+    struct filter *f;
+
+    /** pcapng_hdr() sets the link type of the packet's interface */
+    f = (struct filter *)c->filter;
+    for (k = 0; k < f->cnt - 1 && f->linktype[k] != c->linktype; k++)
+        ;
+    return bpf_filter(f->prog[k].bf_insns, p, len, caplen) != 0;
+}
+
+void
+filter_free(cppip_t *c)
+{
+    int k;
+    struct filter *f;
+
+    f = (struct filter *)c->filter;
+    if (f)
+    {
+        for (k = 0; k < f->cnt; k++)
+        {
+            pcap_freecode(&f->prog[k]);
+        }
+        free(f);
+        c->filter = NULL;
+    }
+}
+
+#else
+
+int
+filter_init(cppip_t *c)
+{
+    snprintf(c->errbuf, BUFSIZ,
+            "-F needs libpcap and cppip was built without it\n");
+    return -1;
+}
+
+int
+filter_match(cppip_t *c, const uint8_t *p, uint32_t caplen, uint32_t len)
+{
+    return 1;
+}
+
+void
+filter_free(cppip_t *c)
+{
+}
+
+#endif
+
+/** EOF */
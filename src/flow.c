@@ -0,0 +1,772 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * flow.c: 5-tuple flow index routines
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "../include/cppip.h"
+#include <arpa/inet.h>
+
+/** postings kept in memory at once while writing the flow section */
+#define FLOW_PASS_SIZ   (256 * 1024 * 1024)
+
+/** spooled (flow number, offset) pairs */
+#define FLOW_SPOOL_REC  12
+
+static uint16_t
+be16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+int
+flow_key_get(uint32_t linktype, const uint8_t *p, uint32_t len,
+        flow_key_t *key)
+{
+    int frag;
+    uint8_t nh;
+    uint32_t o, af;
+    uint16_t type;
+    struct flow_endpoint t;
+
+    /** get to the network layer */
+    switch (linktype)
+    {
+        case CPPIP_DLT_EN10MB:
+            if (len < 14)
+            {
+                return 0;
+            }
+            type = be16(p + 12);
+            for (o = 14; (type == 0x8100 || type == 0x88a8 || type == 0x9100)
+                    && o + 4 <= len; o += 4)
+            {
+                type = be16(p + o + 2);
+            }
+            break;
+        case CPPIP_DLT_LINUX_SLL:
+            if (len < 16)
+            {
+                return 0;
+            }
+            type = be16(p + 14);
+            o    = 16;
+            break;
+        case CPPIP_DLT_NULL:
+        case CPPIP_DLT_LOOP:
+            /** address family in whatever byte order the capturer used */
+            if (len < 4)
+            {
+                return 0;
+            }
+            af = p[0] | p[3];
+            type = (af == 2) ? 0x0800 : (af == 24 || af == 28 || af == 30) ?
+                    0x86dd : 0;
+            o    = 4;
+            break;
+        case CPPIP_DLT_RAW:
+        case CPPIP_DLT_RAW_BSD:
+        case CPPIP_DLT_RAW_OBSD:
+            if (len < 1)
+            {
+                return 0;
+            }
+            type = (p[0] >> 4) == 4 ? 0x0800 : (p[0] >> 4) == 6 ? 0x86dd : 0;
+            o    = 0;
+            break;
+        default:
+            return 0;
+    }
+
+    memset(key, 0, FLOW_KEY_SIZ);
+    switch (type)
+    {
+        case 0x0800:
+            if (o + 20 > len || (p[o] >> 4) != 4 || (p[o] & 0x0f) < 5)
+            {
+                return 0;
+            }
+            key->proto = p[o + 9];
+            frag = be16(p + o + 6) & 0x1fff;
+            key->a.addr[10] = key->a.addr[11] = 0xff;
+            key->b.addr[10] = key->b.addr[11] = 0xff;
+            memcpy(key->a.addr + 12, p + o + 12, 4);
+            memcpy(key->b.addr + 12, p + o + 16, 4);
+            o += (p[o] & 0x0f) * 4;
+            break;
+        case 0x86dd:
+            if (o + 40 > len || (p[o] >> 4) != 6)
+            {
+                return 0;
+            }
+            nh = p[o + 6];
+            memcpy(key->a.addr, p + o + 8,  16);
+            memcpy(key->b.addr, p + o + 24, 16);
+            frag = 0;
+            /** hop-by-hop, routing, fragment and destination options */
+            for (o += 40; o + 8 <= len; )
+            {
+                if (nh == 0 || nh == 43 || nh == 60)
+                {
+                    nh = p[o];
+                    o += (p[o + 1] + 1) * 8;
+                }
+                else if (nh == 44)
+                {
+                    frag = be16(p + o + 2) & 0xfff8;
+                    nh = p[o];
+                    o += 8;
+                }
+                else
+                {
+                    break;
+                }
+            }
+            key->proto = nh;
+            break;
+        default:
+            return 0;
+    }
+
+    /** TCP, UDP and SCTP all start with the ports */
+    if (!frag && o + 4 <= len &&
+            (key->proto == 6 || key->proto == 17 || key->proto == 132))
+    {
+        memcpy(key->a.port, p + o,     2);
+        memcpy(key->b.port, p + o + 2, 2);
+    }
+    /** same key both ways */
+    if (memcmp(&key->a, &key->b, sizeof (struct flow_endpoint)) > 0)
+    {
+        t      = key->a;
+        key->a = key->b;
+        key->b = t;
+    }
+    return 1;
+}
+
+/** a decimal port into network byte order */
+static int
+flow_parse_port(char *s, uint8_t *port, char *errbuf)
+{
+    char *end;
+    long n;
+
+    n = strtol(s, &end, 10);
+    if (*s == 0 || *end || n < 0 || n > 65535)
+    {
+        snprintf(errbuf, BUFSIZ, "invalid flow port: %s\n", s);
+        return -1;
+    }
+    port[0] = n >> 8;
+    port[1] = n;
+    return 1;
+}
+
+/** parse "addr:port", "[addr]:port" or just the address */
+static int
+flow_parse_endpoint(char *s, struct flow_endpoint *ep, char *errbuf)
+{
+    char *port, *end;
+    uint8_t v4[4];
+
+    memset(ep, 0, sizeof (struct flow_endpoint));
+    port = NULL;
+    if (*s == '[')
+    {
+        end = strchr(++s, ']');
+        if (end == NULL || (end[1] && end[1] != ':'))
+        {
+            snprintf(errbuf, BUFSIZ, "invalid flow endpoint: %s\n", s);
+            return -1;
+        }
+        *end = 0;
+        port = end[1] ? end + 2 : NULL;
+    }
+    else if ((port = strchr(s, ':')))
+    {
+        *port++ = 0;
+    }
+
+    if (inet_pton(AF_INET, s, v4) == 1)
+    {
+        ep->addr[10] = ep->addr[11] = 0xff;
+        memcpy(ep->addr + 12, v4, 4);
+    }
+    else if (inet_pton(AF_INET6, s, ep->addr) != 1)
+    {
+        snprintf(errbuf, BUFSIZ, "invalid flow address: %s\n", s);
+        return -1;
+    }
+    if (port && flow_parse_port(port, ep->port, errbuf) == -1)
+    {
+        return -1;
+    }
+    return 1;
+}
+
+int
+flow_parse(char *s, flow_key_t *key, char *errbuf)
+{
+    char *proto, *a, *b, *end;
+    long n;
+    struct flow_endpoint t;
+
+    memset(key, 0, FLOW_KEY_SIZ);
+    proto = strsep(&s, ":");
+    a     = strsep(&s, ",");
+    b     = s;
+    if (proto == NULL || a == NULL || b == NULL)
+    {
+        snprintf(errbuf, BUFSIZ,
+                "invalid flow, want proto:addr:port,addr:port\n");
+        return -1;
+    }
+    if (strcmp(proto, "tcp") == 0)
+    {
+        key->proto = 6;
+    }
+    else if (strcmp(proto, "udp") == 0)
+    {
+        key->proto = 17;
+    }
+    else
+    {
+        n = strtol(proto, &end, 10);
+        if (*proto == 0 || *end || n < 0 || n > 255)
+        {
+            snprintf(errbuf, BUFSIZ, "invalid flow protocol: %s\n", proto);
+            return -1;
+        }
+        key->proto = n;
+    }
+    if (flow_parse_endpoint(a, &key->a, errbuf) == -1 ||
+            flow_parse_endpoint(b, &key->b, errbuf) == -1)
+    {
+        return -1;
+    }
+    if (memcmp(&key->a, &key->b, sizeof (struct flow_endpoint)) > 0)
+    {
+        t      = key->a;
+        key->a = key->b;
+        key->b = t;
+    }
+    return 1;
+}
+
+int
+host_parse(char *s, host_target_t *t, char *errbuf)
+{
+    int port;
+
+    memset(t, 0, sizeof (host_target_t));
+    if (strncmp(s, "*:", 2) == 0)
+    {
+        t->fields = HOST_F_PORT;
+        return flow_parse_port(s + 2, t->ep.port, errbuf);
+    }
+    /** a bare IPv6 address has no port */
+    if (inet_pton(AF_INET6, s, t->ep.addr) == 1)
+    {
+        t->fields = HOST_F_ADDR;
+        return 1;
+    }
+    port = (*s == '[') ? strstr(s, "]:") != NULL : strchr(s, ':') != NULL;
+    if (flow_parse_endpoint(s, &t->ep, errbuf) == -1)
+    {
+        return -1;
+    }
+    t->fields = HOST_F_ADDR | (port ? HOST_F_PORT : 0);
+    return 1;
+}
+
+int
+host_match(host_target_t *t, flow_key_t *key)
+{
+    int i;
+    struct flow_endpoint *ep;
+
+    for (i = 0, ep = &key->a; i < 2; i++, ep = &key->b)
+    {
+        if ((!(t->fields & HOST_F_ADDR) ||
+                memcmp(ep->addr, t->ep.addr, 16) == 0) &&
+                (!(t->fields & HOST_F_PORT) ||
+                memcmp(ep->port, t->ep.port, 2) == 0))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** one endpoint into buf */
+static void
+flow_endpoint_str(struct flow_endpoint *ep, char *buf, size_t siz)
+{
+    char addr[INET6_ADDRSTRLEN];
+    static const uint8_t mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0xff, 0xff };
+
+    if (memcmp(ep->addr, mapped, 12) == 0)
+    {
+        inet_ntop(AF_INET, ep->addr + 12, addr, sizeof (addr));
+        snprintf(buf, siz, "%s:%d", addr, be16(ep->port));
+    }
+    else
+    {
+        inet_ntop(AF_INET6, ep->addr, addr, sizeof (addr));
+        snprintf(buf, siz, "[%s]:%d", addr, be16(ep->port));
+    }
+}
+
+char *
+flow_key_str(flow_key_t *key)
+{
+    char a[64], b[64], proto[8];
+    static __thread char buf[160];
+
+    if (key->proto == 6 || key->proto == 17)
+    {
+        snprintf(proto, sizeof (proto), key->proto == 6 ? "tcp" : "udp");
+    }
+    else
+    {
+        snprintf(proto, sizeof (proto), "%d", key->proto);
+    }
+    flow_endpoint_str(&key->a, a, sizeof (a));
+    flow_endpoint_str(&key->b, b, sizeof (b));
+    snprintf(buf, sizeof (buf), "%s:%s,%s", proto, a, b);
+    return buf;
+}
+
+/** FNV-1a, it's what's on disk so it can't change */
+static uint64_t
+flow_hash(flow_key_t *key)
+{
+    uint32_t i;
+    uint64_t h;
+    const uint8_t *p;
+
+    p = (const uint8_t *)key;
+    for (h = 0xcbf29ce484222325ULL, i = 0; i < FLOW_KEY_SIZ; i++)
+    {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/** posting for offset, coded against prev, returns its length */
+static int
+flow_posting_enc(uint8_t *p, uint64_t prev, uint64_t offset)
+{
+    int n;
+
+    n = varint_enc(p, (offset >> 16) - (prev >> 16));
+    n += varint_enc(p + n, (offset >> 16) == (prev >> 16) ?
+            (offset & 0xffff) - (prev & 0xffff) : (offset & 0xffff));
+    return n;
+}
+
+int
+index_flow_init(index_flow_build_t *b, char *errbuf)
+{
+    memset(b, 0, sizeof (index_flow_build_t));
+    b->table_siz = 1024;
+    b->table = calloc(b->table_siz, sizeof (uint32_t));
+    if (b->table == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "calloc(): %s\n", strerror(errno));
+        return -1;
+    }
+    b->spool = tmpfile();
+    if (b->spool == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "tmpfile(): %s\n", strerror(errno));
+        return -1;
+    }
+    return writer_init(&b->w, fileno(b->spool), 0, WRITER_BUF_SIZ, errbuf);
+}
+
+/** double the hash table, keeps it at most half full */
+static int
+index_flow_grow(index_flow_build_t *b, char *errbuf)
+{
+    uint32_t i;
+    uint64_t j, siz;
+    uint32_t *table;
+
+    siz   = b->table_siz * 2;
+    table = calloc(siz, sizeof (uint32_t));
+    if (table == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "calloc(): %s\n", strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < b->flow_cnt; i++)
+    {
+        for (j = b->flows[i].hash & (siz - 1); table[j];
+                j = (j + 1) & (siz - 1))
+            ;
+        table[j] = i + 1;
+    }
+    free(b->table);
+    b->table     = table;
+    b->table_siz = siz;
+    return 1;
+}
+
+int
+index_flow_add(index_flow_build_t *b, flow_key_t *key, uint64_t offset,
+        char *errbuf)
+{
+    uint32_t id;
+    uint64_t h, j;
+    uint8_t rec[FLOW_SPOOL_REC], tmp[20];
+    struct index_flow_ent *f;
+
+    h = flow_hash(key);
+    for (j = h & (b->table_siz - 1); b->table[j]; j = (j + 1) &
+            (b->table_siz - 1))
+    {
+        f = &b->flows[b->table[j] - 1];
+        if (f->hash == h && memcmp(&f->key, key, FLOW_KEY_SIZ) == 0)
+        {
+            break;
+        }
+    }
+
+    /** first packet of a new flow */
+    if (b->table[j] == 0)
+    {
+        if (b->flow_cnt == b->flow_siz)
+        {
+            b->flow_siz = b->flow_siz ? b->flow_siz * 2 : 1024;
+            f = realloc(b->flows, b->flow_siz *
+                    sizeof (struct index_flow_ent));
+            if (f == NULL)
+            {
+                snprintf(errbuf, BUFSIZ, "realloc(): %s\n", strerror(errno));
+                return -1;
+            }
+            b->flows = f;
+        }
+        f = &b->flows[b->flow_cnt];
+        memset(f, 0, sizeof (struct index_flow_ent));
+        f->key  = *key;
+        f->hash = h;
+        b->table[j] = ++b->flow_cnt;
+        if (b->flow_cnt * 2 > b->table_siz &&
+                index_flow_grow(b, errbuf) == -1)
+        {
+            return -1;
+        }
+        f = &b->flows[b->flow_cnt - 1];
+    }
+    else
+    {
+        f = &b->flows[b->table[j] - 1];
+    }
+
+    /** size the posting now so the layout is known before writing it */
+    id = f - b->flows;
+    f->len += flow_posting_enc(tmp, f->prev, offset);
+    f->prev = offset;
+    f->pkt_cnt++;
+    memcpy(rec, &id, 4);
+    memcpy(rec + 4, &offset, 8);
+    return writer_add(&b->w, rec, FLOW_SPOOL_REC, errbuf);
+}
+
+/** header, buckets, flow table, then postings a slice of flows at a time */
+static int
+index_flow_out(void *arg, writer_t *w, char *errbuf)
+{
+    ssize_t n;
+    off_t off;
+    uint32_t id, lo, hi, i;
+    uint64_t b_i, k, len, post_off, offset;
+    uint8_t hdr[CPPIP_FLOW_H_SIZ], ent[CPPIP_FLOW_ENT_SIZ], *buf;
+    index_flow_build_t *b;
+    struct index_flow_ent *f;
+
+    b = (index_flow_build_t *)arg;
+    for (len = 0, i = 0; i < b->flow_cnt; i++)
+    {
+        len += b->flows[i].len;
+    }
+    memset(hdr, 0, sizeof (hdr));
+    le64enc(hdr,      b->flow_cnt);
+    le64enc(hdr + 8,  b->bucket_cnt);
+    le64enc(hdr + 16, len);
+    if (writer_add(w, hdr, sizeof (hdr), errbuf) == -1)
+    {
+        return -1;
+    }
+
+    /** bucket starts, flows are already sorted by bucket in order[] */
+    for (b_i = 0, k = 0; b_i <= b->bucket_cnt; b_i++)
+    {
+        while (k < b->flow_cnt &&
+                (b->flows[b->order[k]].hash & (b->bucket_cnt - 1)) < b_i)
+        {
+            k++;
+        }
+        le64enc(ent, k);
+        if (writer_add(w, ent, 8, errbuf) == -1)
+        {
+            return -1;
+        }
+    }
+
+    /** postings go in flow number order, cur is each one's offset */
+    for (post_off = 0, i = 0; i < b->flow_cnt; i++)
+    {
+        b->flows[i].cur = post_off;
+        post_off += b->flows[i].len;
+    }
+    for (k = 0; k < b->flow_cnt; k++)
+    {
+        f = &b->flows[b->order[k]];
+        memcpy(ent, &f->key, FLOW_KEY_SIZ);
+        le64enc(ent + 40, f->pkt_cnt);
+        le64enc(ent + 48, f->cur);
+        le64enc(ent + 56, f->len);
+        if (writer_add(w, ent, sizeof (ent), errbuf) == -1)
+        {
+            return -1;
+        }
+    }
+
+    for (lo = 0; lo < b->flow_cnt; lo = hi)
+    {
+        /** as many flows as fit, at least one */
+        for (len = 0, hi = lo; hi < b->flow_cnt &&
+                (hi == lo || len + b->flows[hi].len <= FLOW_PASS_SIZ); hi++)
+        {
+            b->flows[hi].cur  = len;
+            b->flows[hi].prev = 0;
+            len += b->flows[hi].len;
+        }
+        buf = malloc(len ? len : 1);
+        if (buf == NULL)
+        {
+            snprintf(errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+            return -1;
+        }
+        for (off = 0; off < b->w.off; off += n)
+        {
+            n = pread(fileno(b->spool), b->w.buf, b->w.siz / FLOW_SPOOL_REC *
+                    FLOW_SPOOL_REC, off);
+            if (n <= 0 || n % FLOW_SPOOL_REC)
+            {
+                snprintf(errbuf, BUFSIZ, "spool read error: %s\n",
+                        n == -1 ? strerror(errno) : "short read");
+                free(buf);
+                return -1;
+            }
+            for (k = 0; k < n; k += FLOW_SPOOL_REC)
+            {
+                memcpy(&id, b->w.buf + k, 4);
+                if (id < lo || id >= hi)
+                {
+                    continue;
+                }
+                memcpy(&offset, b->w.buf + k + 4, 8);
+                f = &b->flows[id];
+                f->cur += flow_posting_enc(buf + f->cur, f->prev, offset);
+                f->prev = offset;
+            }
+        }
+        if (writer_add(w, buf, len, errbuf) == -1)
+        {
+            free(buf);
+            return -1;
+        }
+        free(buf);
+    }
+    return 1;
+}
+
+int
+index_flow_section(index_flow_build_t *b, index_v2_section_t *sect,
+        char *errbuf)
+{
+    uint32_t i;
+    uint64_t j, len, *cnt;
+
+    if (writer_flush(&b->w, errbuf) == -1)
+    {
+        return -1;
+    }
+
+    /** about one flow per bucket, counting sort the flows into them */
+    for (b->bucket_cnt = 1; b->bucket_cnt < b->flow_cnt; b->bucket_cnt *= 2)
+        ;
+    cnt      = calloc(b->bucket_cnt + 1, sizeof (uint64_t));
+    b->order = malloc((b->flow_cnt + 1) * sizeof (uint32_t));
+    if (cnt == NULL || b->order == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+        free(cnt);
+        return -1;
+    }
+    for (i = 0; i < b->flow_cnt; i++)
+    {
+        cnt[(b->flows[i].hash & (b->bucket_cnt - 1)) + 1]++;
+    }
+    for (j = 0; j < b->bucket_cnt; j++)
+    {
+        cnt[j + 1] += cnt[j];
+    }
+    for (i = 0; i < b->flow_cnt; i++)
+    {
+        b->order[cnt[b->flows[i].hash & (b->bucket_cnt - 1)]++] = i;
+    }
+    free(cnt);
+
+    for (len = 0, i = 0; i < b->flow_cnt; i++)
+    {
+        len += b->flows[i].len;
+    }
+    sect->type = CPPIP_INDEX_FLOW;
+    sect->len  = CPPIP_FLOW_H_SIZ + 8 * (b->bucket_cnt + 1) +
+            (uint64_t)CPPIP_FLOW_ENT_SIZ * b->flow_cnt + len;
+    sect->out  = index_flow_out;
+    sect->arg  = b;
+    return 1;
+}
+
+void
+index_flow_free(index_flow_build_t *b)
+{
+    writer_free(&b->w);
+    if (b->spool)
+    {
+        fclose(b->spool);
+        b->spool = NULL;
+    }
+    free(b->flows);
+    free(b->table);
+    free(b->order);
+    b->flows = NULL;
+    b->table = b->order = NULL;
+}
+
+int
+index_flow_load(cppip_t *c, const uint8_t *p, uint64_t len)
+{
+    index_flow_t *fl;
+
+    fl = &c->flow;
+    if (len < CPPIP_FLOW_H_SIZ)
+    {
+        snprintf(c->errbuf, BUFSIZ, "flow section too small\n");
+        return -1;
+    }
+    fl->flow_cnt     = le64dec(p);
+    fl->bucket_cnt   = le64dec(p + 8);
+    fl->postings_len = le64dec(p + 16);
+    if (fl->bucket_cnt == 0 || (fl->bucket_cnt & (fl->bucket_cnt - 1)) ||
+            fl->bucket_cnt > len / 8 ||
+            fl->flow_cnt > len / CPPIP_FLOW_ENT_SIZ ||
+            CPPIP_FLOW_H_SIZ + 8 * (fl->bucket_cnt + 1) +
+            CPPIP_FLOW_ENT_SIZ * fl->flow_cnt + fl->postings_len != len)
+    {
+        snprintf(c->errbuf, BUFSIZ, "flow section has a bad header\n");
+        fl->bucket_cnt = 0;
+        return -1;
+    }
+    fl->buckets  = p + CPPIP_FLOW_H_SIZ;
+    fl->flows    = fl->buckets + 8 * (fl->bucket_cnt + 1);
+    fl->postings = fl->flows + CPPIP_FLOW_ENT_SIZ * fl->flow_cnt;
+    return 1;
+}
+
+int
+index_flow_find(cppip_t *c, flow_key_t *key, index_flow_iter_t *it)
+{
+    uint64_t b, i, end, off, len;
+    const uint8_t *ent;
+    index_flow_t *fl;
+
+    fl  = &c->flow;
+    b   = flow_hash(key) & (fl->bucket_cnt - 1);
+    i   = le64dec(fl->buckets + 8 * b);
+    end = le64dec(fl->buckets + 8 * (b + 1));
+    if (end > fl->flow_cnt || i > end)
+    {
+        snprintf(c->errbuf, BUFSIZ, "corrupt flow index: bucket %llu\n",
+                (unsigned long long)b);
+        return -1;
+    }
+    for (; i < end; i++)
+    {
+        ent = fl->flows + CPPIP_FLOW_ENT_SIZ * i;
+        if (memcmp(ent, key, FLOW_KEY_SIZ))
+        {
+            continue;
+        }
+        off = le64dec(ent + 48);
+        len = le64dec(ent + 56);
+        if (off > fl->postings_len || len > fl->postings_len - off)
+        {
+            snprintf(c->errbuf, BUFSIZ, "corrupt flow index: flow %llu\n",
+                    (unsigned long long)i);
+            return -1;
+        }
+        it->p       = fl->postings + off;
+        it->end     = it->p + len;
+        it->offset  = 0;
+        it->pkt_cnt = le64dec(ent + 40);
+        return 1;
+    }
+    return 0;
+}
+
+int
+index_flow_next(cppip_t *c, index_flow_iter_t *it, uint64_t *offset)
+{
+    uint64_t caddr, v;
+
+    if (it->p == it->end)
+    {
+        return 0;
+    }
+    if (varint_dec(&it->p, it->end, &caddr) == -1 ||
+            varint_dec(&it->p, it->end, &v) == -1)
+    {
+        snprintf(c->errbuf, BUFSIZ, "corrupt flow index: bad posting\n");
+        return -1;
+    }
+    if (caddr)
+    {
+        it->offset = (((it->offset >> 16) + caddr) << 16) | v;
+    }
+    else
+    {
+        it->offset += v;
+    }
+    *offset = it->offset;
+    return 1;
+}
+
+/** EOF */
@@ -0,0 +1,770 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * format.c: version 2 index file format routines
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "../include/cppip.h"
+
+void
+le16enc(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+void
+le32enc(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+void
+le64enc(uint8_t *p, uint64_t v)
+{
+    le32enc(p, (uint32_t)v);
+    le32enc(p + 4, (uint32_t)(v >> 32));
+}
+
+uint16_t
+le16dec(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+uint32_t
+le32dec(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+            ((uint32_t)p[3] << 24);
+}
+
+uint64_t
+le64dec(const uint8_t *p)
+{
+    return (uint64_t)le32dec(p) | ((uint64_t)le32dec(p + 4) << 32);
+}
+
+int
+varint_enc(uint8_t *p, uint64_t v)
+{
+    int n;
+
+    for (n = 0; v >= 0x80; v >>= 7)
+    {
+        p[n++] = (v & 0x7f) | 0x80;
+    }
+    p[n++] = v;
+    return n;
+}
+
+int
+varint_dec(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    int shift;
+    const uint8_t *q;
+
+    for (*v = 0, shift = 0, q = *p; q < end && shift < 64; q++, shift += 7)
+    {
+        *v |= (uint64_t)(*q & 0x7f) << shift;
+        if (!(*q & 0x80))
+        {
+            *p = q + 1;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+uint64_t
+ts_to_usec(struct timeval *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000 + ts->tv_usec;
+}
+
+void
+usec_to_ts(uint64_t usec, struct timeval *ts)
+{
+    ts->tv_sec  = usec / 1000000;
+    ts->tv_usec = usec % 1000000;
+}
+
+/** a record's timestamp in its stream's units, usec or nsec */
+static uint64_t
+stream_ts(int fields, cppip_record_t *r)
+{
+    if (fields & CPPIP_REC_F_NSEC)
+    {
+        return ts_to_usec(&r->pkt_ts) * 1000 + r->pkt_ns;
+    }
+    return ts_to_usec(&r->pkt_ts);
+}
+
+static void
+stream_ts_set(int fields, uint64_t v, cppip_record_t *r)
+{
+    r->pkt_ns = 0;
+    if (fields & CPPIP_REC_F_NSEC)
+    {
+        r->pkt_ns = v % 1000;
+        v /= 1000;
+    }
+    usec_to_ts(v, &r->pkt_ts);
+}
+
+/** signed deltas are zigzagged so small negative ones stay small */
+static uint64_t
+zigzag_enc(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t
+zigzag_dec(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+int
+index_v2_stream_init(index_v2_stream_t *s, int mode, int fields,
+        uint64_t level, char *errbuf)
+{
+    memset(s, 0, sizeof (index_v2_stream_t));
+    s->mode   = mode;
+    s->fields = fields;
+    s->level  = level;
+    s->spool  = tmpfile();
+    if (s->spool == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "tmpfile(): %s\n", strerror(errno));
+        return -1;
+    }
+    return writer_init(&s->w, fileno(s->spool), 0, WRITER_BUF_SIZ, errbuf);
+}
+
+int
+index_v2_stream_add(index_v2_stream_t *s, cppip_record_t *rec, char *errbuf)
+{
+    int n;
+    uint8_t *p, buf[40];
+    uint64_t caddr, prev_caddr;
+    cppip_record_t r;
+
+    /** fields the stream doesn't carry are stored as 0 */
+    memset(&r, 0, sizeof (r));
+    if (s->fields & CPPIP_REC_F_PKT)
+    {
+        r.pkt_num = rec->pkt_num;
+    }
+    if (s->fields & CPPIP_REC_F_TS)
+    {
+        r.pkt_ts = rec->pkt_ts;
+        r.pkt_ns = rec->pkt_ns;
+    }
+    if (s->fields & CPPIP_REC_F_OFF)
+    {
+        r.bgzf_offset = rec->bgzf_offset;
+    }
+
+    /** first record of a seek block goes in the directory, in full */
+    if (s->rec_cnt % CPPIP_V2_BLK_RECS == 0)
+    {
+        if (s->dir_len + CPPIP_V2_DIR_SIZ > s->dir_siz)
+        {
+            s->dir_siz = s->dir_siz ? s->dir_siz * 2 : 64 * CPPIP_V2_DIR_SIZ;
+            p = realloc(s->dir, s->dir_siz);
+            if (p == NULL)
+            {
+                snprintf(errbuf, BUFSIZ, "realloc(): %s\n", strerror(errno));
+                return -1;
+            }
+            s->dir = p;
+        }
+        p = s->dir + s->dir_len;
+        le64enc(p,      r.pkt_num);
+        le64enc(p + 8,  stream_ts(s->fields, &r));
+        le64enc(p + 16, r.bgzf_offset);
+        le64enc(p + 24, s->w.bytes + s->w.len);
+        s->dir_len += CPPIP_V2_DIR_SIZ;
+    }
+    /** the rest are deltas from the one before */
+    else
+    {
+        n = 0;
+        if (s->fields & CPPIP_REC_F_PKT)
+        {
+            n += varint_enc(buf + n, r.pkt_num - s->prev.pkt_num);
+        }
+        if (s->fields & CPPIP_REC_F_TS)
+        {
+            n += varint_enc(buf + n, zigzag_enc((int64_t)
+                    (stream_ts(s->fields, &r) -
+                    stream_ts(s->fields, &s->prev))));
+        }
+        if (s->fields & CPPIP_REC_F_OFF)
+        {
+            caddr      = r.bgzf_offset >> 16;
+            prev_caddr = s->prev.bgzf_offset >> 16;
+            n += varint_enc(buf + n, caddr - prev_caddr);
+            n += varint_enc(buf + n, caddr == prev_caddr ?
+                    (r.bgzf_offset & 0xffff) - (s->prev.bgzf_offset & 0xffff) :
+                    (r.bgzf_offset & 0xffff));
+        }
+        if (writer_add(&s->w, buf, n, errbuf) == -1)
+        {
+            return -1;
+        }
+    }
+    s->prev = r;
+    s->rec_cnt++;
+    return 1;
+}
+
+void
+index_v2_stream_free(index_v2_stream_t *s)
+{
+    writer_free(&s->w);
+    free(s->dir);
+    s->dir = NULL;
+    if (s->spool)
+    {
+        fclose(s->spool);
+        s->spool = NULL;
+    }
+}
+
+/** section header and directory, then the spooled block data */
+static int
+index_v2_stream_out(void *arg, writer_t *w, char *errbuf)
+{
+    ssize_t n;
+    off_t off;
+    index_v2_stream_t *s;
+    uint8_t hdr[CPPIP_V2_STREAM_H_SIZ];
+
+    s = (index_v2_stream_t *)arg;
+    memset(hdr, 0, sizeof (hdr));
+    le64enc(hdr,      s->rec_cnt);
+    le32enc(hdr + 8,  CPPIP_V2_BLK_RECS);
+    le32enc(hdr + 12, s->dir_len / CPPIP_V2_DIR_SIZ);
+    le64enc(hdr + 16, s->level);
+    hdr[24] = s->fields;
+    if (writer_add(w, hdr, sizeof (hdr), errbuf) == -1 ||
+            writer_add(w, s->dir, s->dir_len, errbuf) == -1)
+    {
+        return -1;
+    }
+
+    /** reuse the stream's writer buffer, it's been flushed */
+    for (off = 0; off < s->w.off; off += n)
+    {
+        n = pread(fileno(s->spool), s->w.buf, s->w.siz, off);
+        if (n <= 0)
+        {
+            snprintf(errbuf, BUFSIZ, "spool read error: %s\n",
+                    n == -1 ? strerror(errno) : "short read");
+            return -1;
+        }
+        if (writer_add(w, s->w.buf, n, errbuf) == -1)
+        {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+int
+index_v2_stream_section(index_v2_stream_t *s, index_v2_section_t *sect,
+        char *errbuf)
+{
+    if (writer_flush(&s->w, errbuf) == -1)
+    {
+        return -1;
+    }
+    sect->type = s->mode;
+    sect->len  = CPPIP_V2_STREAM_H_SIZ + s->dir_len + s->w.bytes;
+    sect->out  = index_v2_stream_out;
+    sect->arg  = s;
+    return 1;
+}
+
+int
+index_v2_write(cppip_t *c, index_v2_section_t *sects, int n)
+{
+    int i, ret;
+    uint64_t off, bytes;
+    uint8_t fh[CPPIP_V2_FH_SIZ], sect[CPPIP_V2_SECT_SIZ];
+    writer_t w;
+
+    if (writer_init(&w, c->index, 0, WRITER_BUF_SIZ, c->errbuf) == -1)
+    {
+        return -1;
+    }
+    ret = -1;
+
+    memset(fh, 0, sizeof (fh));
+    le32enc(fh, CPPIP_MAGIC);
+    fh[4] = CPPIP_FORMAT_V2;
+    fh[5] = 0;
+    fh[6] = c->index_mode;
+    fh[7] = CPPIP_V2_ENDIAN_LE;
+    le64enc(fh + 8,  c->pkt_cnt);
+    le64enc(fh + 16, c->cppip_h.ts_created.tv_sec);
+    le32enc(fh + 24, c->cppip_h.ts_created.tv_usec);
+    le32enc(fh + 28, n);
+    if (writer_add(&w, fh, sizeof (fh), c->errbuf) == -1)
+    {
+        goto done;
+    }
+
+    /** section table, sections follow back to back */
+    off = CPPIP_V2_FH_SIZ + n * CPPIP_V2_SECT_SIZ;
+    for (i = 0; i < n; i++)
+    {
+        memset(sect, 0, sizeof (sect));
+        le16enc(sect, sects[i].type);
+        le64enc(sect + 8,  off);
+        le64enc(sect + 16, sects[i].len);
+        if (writer_add(&w, sect, sizeof (sect), c->errbuf) == -1)
+        {
+            goto done;
+        }
+        off += sects[i].len;
+    }
+    for (i = 0; i < n; i++)
+    {
+        bytes = w.bytes + w.len;
+        if (sects[i].out(sects[i].arg, &w, c->errbuf) == -1)
+        {
+            goto done;
+        }
+        if (w.bytes + w.len - bytes != sects[i].len)
+        {
+            snprintf(c->errbuf, BUFSIZ, "section %d: wrote %llu of %llu\n",
+                    i, (unsigned long long)(w.bytes + w.len - bytes),
+                    (unsigned long long)sects[i].len);
+            goto done;
+        }
+    }
+    if (writer_flush(&w, c->errbuf) == -1)
+    {
+        goto done;
+    }
+    if (c->flags & CPPIP_CTRL_DEBUG)
+    {
+        fprintf(stderr, "DBG: index writes:\t\t%u (%llu bytes)\n", w.writes,
+                (unsigned long long)w.bytes);
+    }
+    ret = 1;
+done:
+    writer_free(&w);
+    return ret;
+}
+
+int
+index_verify_v2(cppip_t *c)
+{
+    uint32_t i, n;
+    uint64_t off, len, level, data_off;
+    const uint8_t *p, *sect;
+    struct stat stat_buf;
+    index_stream_t *s;
+
+    if (fstat(c->index, &stat_buf) == -1)
+    {
+        snprintf(c->errbuf, BUFSIZ,
+            "can't stat %s: %s\n", c->index_fname, strerror(errno));
+        return -1;
+    }
+    if (stat_buf.st_size < CPPIP_V2_FH_SIZ)
+    {
+        snprintf(c->errbuf, BUFSIZ,
+            "%s is too small to be a valid cppip index\n", c->index_fname);
+        return -1;
+    }
+    c->index_map = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED,
+            c->index, 0);
+    if (c->index_map == MAP_FAILED)
+    {
+        c->index_map = NULL;
+        snprintf(c->errbuf, BUFSIZ, "mmap(): %s\n", strerror(errno));
+        return -1;
+    }
+    c->index_map_siz = stat_buf.st_size;
+    p = c->index_map;
+
+    if (p[7] != CPPIP_V2_ENDIAN_LE)
+    {
+        snprintf(c->errbuf, BUFSIZ, "unknown byte order: %d\n", p[7]);
+        return -1;
+    }
+    c->format = CPPIP_FORMAT_V2;
+    c->pkt_cnt = le64dec(p + 8);
+
+    /** the v1 headers are what the rest of cppip reports from */
+    c->cppip_h.magic         = le32dec(p);
+    c->cppip_h.version_major = p[4];
+    c->cppip_h.version_minor = p[5];
+    c->cppip_h.index_mode    = p[6];
+    c->cppip_h.pkt_cnt       = c->pkt_cnt;
+    c->cppip_h.ts_created.tv_sec  = le64dec(p + 16);
+    c->cppip_h.ts_created.tv_usec = le32dec(p + 24);
+
+    n = le32dec(p + 28);
+    if (n > (c->index_map_siz - CPPIP_V2_FH_SIZ) / CPPIP_V2_SECT_SIZ)
+    {
+        snprintf(c->errbuf, BUFSIZ, "bad section count: %u\n", n);
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        sect = p + CPPIP_V2_FH_SIZ + i * CPPIP_V2_SECT_SIZ;
+        off  = le64dec(sect + 8);
+        len  = le64dec(sect + 16);
+        if (off > c->index_map_siz || len > c->index_map_siz - off)
+        {
+            snprintf(c->errbuf, BUFSIZ, "section %u out of bounds\n", i);
+            return -1;
+        }
+        switch (le16dec(sect))
+        {
+            case CPPIP_INDEX_PN:
+                s = &c->pn_stream;
+                break;
+            case CPPIP_INDEX_TS:
+                s = &c->ts_stream;
+                break;
+            case CPPIP_INDEX_BYTES:
+                s = &c->by_stream;
+                break;
+            case CPPIP_INDEX_EF:
+                if (index_ef_load(c, p + off, len) == -1)
+                {
+                    return -1;
+                }
+                continue;
+            case CPPIP_INDEX_FLOW:
+                if (index_flow_load(c, p + off, len) == -1)
+                {
+                    return -1;
+                }
+                continue;
+            case CPPIP_INDEX_HOST:
+                if (index_host_load(c, p + off, len) == -1)
+                {
+                    return -1;
+                }
+                continue;
+            default:
+                /** newer section we don't know about, leave it be */
+                continue;
+        }
+        if (len < CPPIP_V2_STREAM_H_SIZ)
+        {
+            snprintf(c->errbuf, BUFSIZ, "section %u too small\n", i);
+            return -1;
+        }
+        memset(s, 0, sizeof (index_stream_t));
+        s->mode     = le16dec(sect);
+        s->rec_cnt  = le64dec(p + off);
+        s->blk_recs = le32dec(p + off + 8);
+        s->blk_cnt  = le32dec(p + off + 12);
+        level       = le64dec(p + off + 16);
+        s->fields   = p[off + 24];
+        s->level    = level;
+        s->dir      = p + off + CPPIP_V2_STREAM_H_SIZ;
+        s->end      = p + off + len;
+        if (s->rec_cnt == 0 || s->blk_recs == 0 ||
+                s->blk_cnt != (s->rec_cnt + s->blk_recs - 1) / s->blk_recs ||
+                (uint64_t)s->blk_cnt * CPPIP_V2_DIR_SIZ >
+                len - CPPIP_V2_STREAM_H_SIZ)
+        {
+            snprintf(c->errbuf, BUFSIZ, "section %u has a bad header\n", i);
+            return -1;
+        }
+        s->data = s->dir + s->blk_cnt * CPPIP_V2_DIR_SIZ;
+
+        /** block data offsets are checked once here, not on every lookup */
+        data_off = le64dec(s->dir + (s->blk_cnt - 1) * CPPIP_V2_DIR_SIZ + 24);
+        if (data_off > (uint64_t)(s->end - s->data))
+        {
+            snprintf(c->errbuf, BUFSIZ, "section %u has a bad directory\n",
+                    i);
+            return -1;
+        }
+
+        if (s->mode == CPPIP_INDEX_PN)
+        {
+            c->cppip_index_pn_hdr.index_mode  = CPPIP_INDEX_PN;
+            c->cppip_index_pn_hdr.rec_cnt     = s->rec_cnt;
+            c->cppip_index_pn_hdr.index_level = level;
+        }
+        else if (s->mode == CPPIP_INDEX_TS)
+        {
+            c->cppip_index_ts_hdr.index_mode  = CPPIP_INDEX_TS;
+            c->cppip_index_ts_hdr.rec_cnt     = s->rec_cnt;
+            usec_to_ts(level, &c->cppip_index_ts_hdr.index_level);
+        }
+    }
+    if (((c->cppip_h.index_mode & CPPIP_INDEX_PN) && !c->pn_stream.dir) ||
+            ((c->cppip_h.index_mode & CPPIP_INDEX_TS) && !c->ts_stream.dir) ||
+            ((c->cppip_h.index_mode & CPPIP_INDEX_EF) && !c->ef.n) ||
+            ((c->cppip_h.index_mode & CPPIP_INDEX_FLOW) &&
+            !c->flow.bucket_cnt) ||
+            ((c->cppip_h.index_mode & CPPIP_INDEX_HOST) && !c->host.ent_cnt) ||
+            ((c->cppip_h.index_mode & CPPIP_INDEX_BYTES) && !c->by_stream.dir))
+    {
+        snprintf(c->errbuf, BUFSIZ, "index mode %d without its section\n",
+                c->cppip_h.index_mode);
+        return -1;
+    }
+    return 1;
+}
+
+/** load the first record of seek block b */
+static int
+stream_block(cppip_t *c, index_stream_t *s, uint32_t b)
+{
+    const uint8_t *p;
+    uint64_t data_off;
+
+    p = s->dir + (uint64_t)b * CPPIP_V2_DIR_SIZ;
+    data_off = le64dec(p + 24);
+    if (data_off > (uint64_t)(s->end - s->data))
+    {
+        snprintf(c->errbuf, BUFSIZ, "corrupt index: bad seek block %u\n", b);
+        return -1;
+    }
+    s->cur.pkt_num = le64dec(p);
+    stream_ts_set(s->fields, le64dec(p + 8), &s->cur);
+    s->cur.bgzf_offset = le64dec(p + 16);
+    s->cur_p = s->data + data_off;
+    s->cur_i = (uint64_t)b * s->blk_recs;
+    return 1;
+}
+
+/** decode the record after cur */
+static int
+stream_next(cppip_t *c, index_stream_t *s)
+{
+    uint64_t v, caddr;
+
+    if (s->fields & CPPIP_REC_F_PKT)
+    {
+        if (varint_dec(&s->cur_p, s->end, &v) == -1)
+        {
+            goto err;
+        }
+        s->cur.pkt_num += v;
+    }
+    if (s->fields & CPPIP_REC_F_TS)
+    {
+        if (varint_dec(&s->cur_p, s->end, &v) == -1)
+        {
+            goto err;
+        }
+        stream_ts_set(s->fields, stream_ts(s->fields, &s->cur) +
+                zigzag_dec(v), &s->cur);
+    }
+    if (s->fields & CPPIP_REC_F_OFF)
+    {
+        if (varint_dec(&s->cur_p, s->end, &caddr) == -1 ||
+                varint_dec(&s->cur_p, s->end, &v) == -1)
+        {
+            goto err;
+        }
+        if (caddr)
+        {
+            s->cur.bgzf_offset = (((s->cur.bgzf_offset >> 16) + caddr) << 16)
+                    | v;
+        }
+        else
+        {
+            s->cur.bgzf_offset += v;
+        }
+    }
+    s->cur_i++;
+    return 1;
+err:
+    snprintf(c->errbuf, BUFSIZ, "corrupt index: record %llu runs past end\n",
+            (unsigned long long)s->cur_i + 1);
+    return -1;
+}
+
+int
+index_stream_get(cppip_t *c, index_stream_t *s, uint64_t i,
+        cppip_record_t *rec)
+{
+    uint64_t b;
+    cppip_record_pn_t rec_pn;
+    cppip_record_ts_t rec_ts;
+
+    if (i >= s->rec_cnt)
+    {
+        snprintf(c->errbuf, BUFSIZ, "index record %llu out of range\n",
+                (unsigned long long)i);
+        return -1;
+    }
+
+    /** v1 records are fixed size, straight off the disk */
+    if (s->dir == NULL)
+    {
+        memset(rec, 0, sizeof (cppip_record_t));
+        if (s->mode == CPPIP_INDEX_PN)
+        {
+            if (pread(c->index, &rec_pn, CPPIP_REC_PN_SIZ,
+                    s->v1_off + (off_t)i * CPPIP_REC_PN_SIZ)
+                    != CPPIP_REC_PN_SIZ)
+            {
+                snprintf(c->errbuf, BUFSIZ, "read() error: %s\n",
+                        strerror(errno));
+                return -1;
+            }
+            rec->pkt_num     = rec_pn.pkt_num;
+            rec->bgzf_offset = rec_pn.bgzf_offset;
+        }
+        else
+        {
+            if (pread(c->index, &rec_ts, CPPIP_REC_TS_SIZ,
+                    s->v1_off + (off_t)i * CPPIP_REC_TS_SIZ)
+                    != CPPIP_REC_TS_SIZ)
+            {
+                snprintf(c->errbuf, BUFSIZ, "read() error: %s\n",
+                        strerror(errno));
+                return -1;
+            }
+            rec->pkt_ts      = rec_ts.pkt_ts;
+            rec->bgzf_offset = rec_ts.bgzf_offset;
+        }
+        return 1;
+    }
+
+    /** v2: jump to the seek block unless we can keep decoding from cur */
+    b = i / s->blk_recs;
+    if (s->cur_p == NULL || i < s->cur_i || b != s->cur_i / s->blk_recs)
+    {
+        if (stream_block(c, s, b) == -1)
+        {
+            return -1;
+        }
+    }
+    while (s->cur_i < i)
+    {
+        if (stream_next(c, s) == -1)
+        {
+            return -1;
+        }
+    }
+    *rec = s->cur;
+    return 1;
+}
+
+/** compare a and b on key */
+static int
+rec_cmp(int key, cppip_record_t *a, cppip_record_t *b)
+{
+    if (key == CPPIP_REC_F_TS)
+    {
+        return timercmp(&a->pkt_ts, &b->pkt_ts, <) ? -1 :
+                timercmp(&a->pkt_ts, &b->pkt_ts, >) ? 1 : 0;
+    }
+    return a->pkt_num < b->pkt_num ? -1 : a->pkt_num > b->pkt_num ? 1 : 0;
+}
+
+int64_t
+index_stream_search(cppip_t *c, index_stream_t *s, int key,
+        cppip_record_t *target, cppip_record_t *rec)
+{
+    uint64_t lo, hi, mid, i, end, blk_recs;
+    cppip_record_t probe;
+
+    /**
+     * Binary search for the last seek block starting at or before target,
+     * then scan that block. v1 files are seek blocks of one record. The
+     * v2 directory is searched without decoding anything.
+     */
+    blk_recs = s->dir ? s->blk_recs : 1;
+    for (lo = 0, hi = s->dir ? s->blk_cnt : s->rec_cnt; hi - lo > 1; )
+    {
+        mid = lo + (hi - lo) / 2;
+        if (index_stream_get(c, s, mid * blk_recs, &probe) == -1)
+        {
+            return -1;
+        }
+        if (rec_cmp(key, &probe, target) <= 0)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    i = lo * blk_recs;
+    if (index_stream_get(c, s, i, rec) == -1)
+    {
+        return -1;
+    }
+    end = i + blk_recs < s->rec_cnt ? i + blk_recs : s->rec_cnt;
+    for (; i + 1 < end; i++)
+    {
+        if (index_stream_get(c, s, i + 1, &probe) == -1)
+        {
+            return -1;
+        }
+        if (rec_cmp(key, &probe, target) > 0)
+        {
+            break;
+        }
+        *rec = probe;
+    }
+    if (c->flags & CPPIP_CTRL_DEBUG)
+    {
+        fprintf(stderr, "DBG: index record:\t\t%llu of %llu\n",
+                (unsigned long long)i + 1, (unsigned long long)s->rec_cnt);
+    }
+    return i;
+}
+
+int64_t
+index_stream_search_ts(cppip_t *c, index_stream_t *s, struct timeval *ts,
+        cppip_record_t *rec)
+{
+    struct timeval one;
+    cppip_record_t target;
+
+    /**
+     * Records can share a microsecond, bytes records more so as they're
+     * placed at the nanosecond, and the packets before the last of them can
+     * be stamped ts too. The last record stamped before ts has none at or
+     * after ts ahead of it.
+     */
+    one.tv_sec  = 0;
+    one.tv_usec = 1;
+    timersub(ts, &one, &target.pkt_ts);
+    return index_stream_search(c, s, CPPIP_REC_F_TS, &target, rec);
+}
+
+/** EOF */
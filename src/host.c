@@ -0,0 +1,393 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * host.c: per interval Bloom filters of hosts and ports
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "../include/cppip.h"
+
+/** item tags, so an address and a port never hash alike */
+#define HOST_TAG_ADDR   'a'
+#define HOST_TAG_PORT   'p'
+
+/** splitmix64's finalizer */
+static uint64_t
+host_mix(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+/** FNV-1a of the tagged item, it's what's on disk so it can't change */
+static uint64_t
+host_hash(uint8_t tag, const uint8_t *p, uint32_t len)
+{
+    uint32_t i;
+    uint64_t h;
+
+    h = (0xcbf29ce484222325ULL ^ tag) * 0x100000001b3ULL;
+    for (i = 0; i < len; i++)
+    {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * The block comes from one mix of the hash, the K 9 bit positions inside
+ * it from another.
+ */
+static uint64_t
+host_blk(uint64_t h, uint32_t blk_cnt)
+{
+    return ((host_mix(h ^ 0x9e3779b97f4a7c15ULL) >> 32) * blk_cnt) >> 32;
+}
+
+static void
+host_set(uint8_t *blks, uint32_t blk_cnt, uint64_t h)
+{
+    int k;
+    uint32_t bit;
+    uint8_t *blk;
+
+    blk = blks + CPPIP_HOST_BLK_SIZ * host_blk(h, blk_cnt);
+    for (h = host_mix(h), k = 0; k < CPPIP_HOST_K; k++, h >>= 9)
+    {
+        bit = h & 511;
+        blk[bit >> 3] |= 1 << (bit & 7);
+    }
+}
+
+static int
+host_test(const uint8_t *blks, uint32_t blk_cnt, uint64_t h)
+{
+    int k;
+    uint32_t bit;
+    const uint8_t *blk;
+
+    blk = blks + CPPIP_HOST_BLK_SIZ * host_blk(h, blk_cnt);
+    for (h = host_mix(h), k = 0; k < CPPIP_HOST_K; k++, h >>= 9)
+    {
+        bit = h & 511;
+        if (!(blk[bit >> 3] & (1 << (bit & 7))))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int
+u64_cmp(const void *a, const void *b)
+{
+    uint64_t x, y;
+
+    x = *(const uint64_t *)a;
+    y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int
+index_host_init(index_host_build_t *b, uint32_t level, char *errbuf)
+{
+    memset(b, 0, sizeof (index_host_build_t));
+    b->level = level;
+    b->spool = tmpfile();
+    if (b->spool == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "tmpfile(): %s\n", strerror(errno));
+        return -1;
+    }
+    return writer_init(&b->w, fileno(b->spool), 0, WRITER_BUF_SIZ, errbuf);
+}
+
+static int
+index_host_item(index_host_build_t *b, uint64_t h, char *errbuf)
+{
+    uint64_t *p;
+
+    /** packets of a flow tend to come in runs, drop the easy duplicates */
+    if (b->item_cnt && b->items[b->item_cnt - 1] == h)
+    {
+        return 1;
+    }
+    if (b->item_cnt == b->item_siz)
+    {
+        b->item_siz = b->item_siz ? b->item_siz * 2 : 1024;
+        p = realloc(b->items, b->item_siz * sizeof (uint64_t));
+        if (p == NULL)
+        {
+            snprintf(errbuf, BUFSIZ, "realloc(): %s\n", strerror(errno));
+            return -1;
+        }
+        b->items = p;
+    }
+    b->items[b->item_cnt++] = h;
+    return 1;
+}
+
+/** filter the current interval and append its entry */
+static int
+index_host_close(index_host_build_t *b, char *errbuf)
+{
+    uint8_t *blks, *ent;
+    uint64_t i, n, blk_cnt;
+
+    if (b->pkt_cnt == 0)
+    {
+        return 1;
+    }
+
+    /** size the filter to the distinct items, not the packets */
+    qsort(b->items, b->item_cnt, sizeof (uint64_t), u64_cmp);
+    for (n = 0, i = 0; i < b->item_cnt; i++)
+    {
+        if (i == 0 || b->items[i] != b->items[i - 1])
+        {
+            b->items[n++] = b->items[i];
+        }
+    }
+    blk_cnt = (n * CPPIP_HOST_BITS + CPPIP_HOST_BLK_SIZ * 8 - 1) /
+            (CPPIP_HOST_BLK_SIZ * 8);
+    blks = calloc(blk_cnt ? blk_cnt : 1, CPPIP_HOST_BLK_SIZ);
+    if (blks == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "calloc(): %s\n", strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        host_set(blks, blk_cnt, b->items[i]);
+    }
+    if (writer_add(&b->w, blks, blk_cnt * CPPIP_HOST_BLK_SIZ, errbuf) == -1)
+    {
+        free(blks);
+        return -1;
+    }
+    free(blks);
+
+    if (b->ent_cnt == b->ent_siz)
+    {
+        b->ent_siz = b->ent_siz ? b->ent_siz * 2 : 1024;
+        ent = realloc(b->ents, b->ent_siz * CPPIP_HOST_ENT_SIZ);
+        if (ent == NULL)
+        {
+            snprintf(errbuf, BUFSIZ, "realloc(): %s\n", strerror(errno));
+            return -1;
+        }
+        b->ents = ent;
+    }
+    ent = b->ents + CPPIP_HOST_ENT_SIZ * b->ent_cnt++;
+    le64enc(ent,      b->pkt_num);
+    le64enc(ent + 8,  b->offset);
+    le64enc(ent + 16, b->blk_cnt);
+    le32enc(ent + 24, b->pkt_cnt);
+    le32enc(ent + 28, blk_cnt);
+
+    b->blk_cnt  += blk_cnt;
+    b->pkt_cnt   = 0;
+    b->item_cnt  = 0;
+    return 1;
+}
+
+int
+index_host_add(index_host_build_t *b, uint64_t pkt_num, uint64_t offset,
+        flow_key_t *key, char *errbuf)
+{
+    int i;
+    struct flow_endpoint *ep;
+
+    if (b->pkt_cnt == 0)
+    {
+        b->pkt_num = pkt_num;
+        b->offset  = offset;
+    }
+    for (i = 0, ep = key ? &key->a : NULL; ep && i < 2; i++, ep = &key->b)
+    {
+        if (index_host_item(b, host_hash(HOST_TAG_ADDR, ep->addr, 16),
+                errbuf) == -1)
+        {
+            return -1;
+        }
+        /** port 0 is what portless protocols get */
+        if ((ep->port[0] || ep->port[1]) && index_host_item(b,
+                host_hash(HOST_TAG_PORT, ep->port, 2), errbuf) == -1)
+        {
+            return -1;
+        }
+    }
+    if (++b->pkt_cnt == b->level)
+    {
+        return index_host_close(b, errbuf);
+    }
+    return 1;
+}
+
+/** header, interval entries, then the filters straight from the spool */
+static int
+index_host_out(void *arg, writer_t *w, char *errbuf)
+{
+    ssize_t n;
+    off_t off;
+    uint8_t hdr[CPPIP_HOST_H_SIZ];
+    index_host_build_t *b;
+
+    b = (index_host_build_t *)arg;
+    memset(hdr, 0, sizeof (hdr));
+    le64enc(hdr,      b->ent_cnt);
+    le32enc(hdr + 8,  b->level);
+    le64enc(hdr + 16, b->blk_cnt);
+    if (writer_add(w, hdr, sizeof (hdr), errbuf) == -1 ||
+            writer_add(w, b->ents, b->ent_cnt * CPPIP_HOST_ENT_SIZ,
+            errbuf) == -1)
+    {
+        return -1;
+    }
+
+    /** reuse the spool writer's buffer to read it back */
+    for (off = 0; off < b->w.off; off += n)
+    {
+        n = pread(fileno(b->spool), b->w.buf, b->w.siz, off);
+        if (n <= 0)
+        {
+            snprintf(errbuf, BUFSIZ, "spool read error: %s\n",
+                    n == -1 ? strerror(errno) : "short read");
+            return -1;
+        }
+        if (writer_add(w, b->w.buf, n, errbuf) == -1)
+        {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+int
+index_host_section(index_host_build_t *b, index_v2_section_t *sect,
+        char *errbuf)
+{
+    if (index_host_close(b, errbuf) == -1 ||
+            writer_flush(&b->w, errbuf) == -1)
+    {
+        return -1;
+    }
+    sect->type = CPPIP_INDEX_HOST;
+    sect->len  = CPPIP_HOST_H_SIZ + CPPIP_HOST_ENT_SIZ * b->ent_cnt +
+            CPPIP_HOST_BLK_SIZ * b->blk_cnt;
+    sect->out  = index_host_out;
+    sect->arg  = b;
+    return 1;
+}
+
+void
+index_host_free(index_host_build_t *b)
+{
+    writer_free(&b->w);
+    if (b->spool)
+    {
+        fclose(b->spool);
+        b->spool = NULL;
+    }
+    free(b->ents);
+    free(b->items);
+    b->ents  = NULL;
+    b->items = NULL;
+}
+
+int
+index_host_load(cppip_t *c, const uint8_t *p, uint64_t len)
+{
+    uint64_t i;
+    const uint8_t *ent;
+    index_host_t *h;
+
+    h = &c->host;
+    if (len < CPPIP_HOST_H_SIZ)
+    {
+        snprintf(c->errbuf, BUFSIZ, "host section too small\n");
+        return -1;
+    }
+    h->ent_cnt = le64dec(p);
+    h->level   = le32dec(p + 8);
+    h->blk_cnt = le64dec(p + 16);
+    if (h->ent_cnt == 0 || h->level == 0 ||
+            h->ent_cnt > len / CPPIP_HOST_ENT_SIZ ||
+            h->blk_cnt > len / CPPIP_HOST_BLK_SIZ ||
+            CPPIP_HOST_H_SIZ + CPPIP_HOST_ENT_SIZ * h->ent_cnt +
+            CPPIP_HOST_BLK_SIZ * h->blk_cnt != len)
+    {
+        snprintf(c->errbuf, BUFSIZ, "host section has a bad header\n");
+        h->ent_cnt = 0;
+        return -1;
+    }
+    h->ents = p + CPPIP_HOST_H_SIZ;
+    h->blks = h->ents + CPPIP_HOST_ENT_SIZ * h->ent_cnt;
+
+    /** check every filter is in bounds now so lookups needn't */
+    for (i = 0; i < h->ent_cnt; i++)
+    {
+        ent = h->ents + CPPIP_HOST_ENT_SIZ * i;
+        if (le64dec(ent + 16) > h->blk_cnt ||
+                le32dec(ent + 28) > h->blk_cnt - le64dec(ent + 16))
+        {
+            snprintf(c->errbuf, BUFSIZ, "corrupt host index: interval %llu\n",
+                    (unsigned long long)i);
+            h->ent_cnt = 0;
+            return -1;
+        }
+    }
+    return 1;
+}
+
+int
+index_host_maybe(cppip_t *c, uint64_t i, host_target_t *t)
+{
+    uint32_t blk_cnt;
+    const uint8_t *ent, *blks;
+
+    ent     = c->host.ents + CPPIP_HOST_ENT_SIZ * i;
+    blks    = c->host.blks + CPPIP_HOST_BLK_SIZ * le64dec(ent + 16);
+    blk_cnt = le32dec(ent + 28);
+
+    /** nothing but non-IP packets */
+    if (blk_cnt == 0)
+    {
+        return 0;
+    }
+    if ((t->fields & HOST_F_ADDR) && !host_test(blks, blk_cnt,
+            host_hash(HOST_TAG_ADDR, t->ep.addr, 16)))
+    {
+        return 0;
+    }
+    if ((t->fields & HOST_F_PORT) && !host_test(blks, blk_cnt,
+            host_hash(HOST_TAG_PORT, t->ep.port, 2)))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/** EOF */
@@ -31,38 +31,93 @@
 int
 index_dump(cppip_t *c, int mode)
 {
-    int i, n;
-    char time_buf[27];
-    cppip_record_pn_t rec_pn;
-    cppip_record_ts_t rec_ts;
+    uint64_t i;
+    cppip_record_t rec;
+    flow_key_t key;
+    const uint8_t *ent;
 
-    switch (mode)
+    if (mode & CPPIP_INDEX_PN)
     {
-        case CPPIP_INDEX_PN:
-            for (i = 0; (n = read(c->index, &rec_pn, CPPIP_REC_PN_SIZ)); i++)
+        for (i = 0; i < c->pn_stream.rec_cnt; i++)
+        {
+            if (index_stream_get(c, &c->pn_stream, i, &rec) == -1)
             {
-                if (n == -1)
-                {
-                    snprintf(c->errbuf, BUFSIZ, "read() error: %s\n",
-                            strerror(errno));
-                    return -1;
-                }
-                printf("%d, %llx\n", rec_pn.pkt_num, rec_pn.bgzf_offset);
+                return -1;
             }
-            break;
-        case CPPIP_INDEX_TS:
-            for (i = 0; (n = read(c->index, &rec_ts, CPPIP_REC_TS_SIZ)); i++)
+            printf("%llu, %llx\n", (unsigned long long)rec.pkt_num,
+                    (unsigned long long)rec.bgzf_offset);
+        }
+    }
+    if (mode & CPPIP_INDEX_TS)
+    {
+        for (i = 0; i < c->ts_stream.rec_cnt; i++)
+        {
+            if (index_stream_get(c, &c->ts_stream, i, &rec) == -1)
+            {
+                return -1;
+            }
+            /** a nanosecond capture's records have three digits more */
+            if (c->ts_stream.fields & CPPIP_REC_F_NSEC)
             {
-                if (n == -1)
-                {
-                    snprintf(c->errbuf, BUFSIZ, "read() error: %s\n",
-                            strerror(errno));
-                    return -1;
-                }
-                printf("%s, %llx\n", ctime_usec(&rec_ts.pkt_ts), 
-                        rec_ts.bgzf_offset);
+                printf("%s%03u, %llx\n", ctime_usec(&rec.pkt_ts), rec.pkt_ns,
+                        (unsigned long long)rec.bgzf_offset);
+                continue;
             }
-            break;
+            printf("%s, %llx\n", ctime_usec(&rec.pkt_ts), 
+                    (unsigned long long)rec.bgzf_offset);
+        }
+    }
+    if (mode & CPPIP_INDEX_BYTES)
+    {
+        for (i = 0; i < c->by_stream.rec_cnt; i++)
+        {
+            if (index_stream_get(c, &c->by_stream, i, &rec) == -1)
+            {
+                return -1;
+            }
+            printf("%llu, %s", (unsigned long long)rec.pkt_num,
+                    ctime_usec(&rec.pkt_ts));
+            if (c->by_stream.fields & CPPIP_REC_F_NSEC)
+            {
+                printf("%03u", rec.pkt_ns);
+            }
+            printf(", %llx\n", (unsigned long long)rec.bgzf_offset);
+        }
+    }
+    if (mode & CPPIP_INDEX_EF)
+    {
+        for (i = 1; i <= c->ef.n; i++)
+        {
+            if (index_ef_get(c, i, &rec.bgzf_offset) == -1)
+            {
+                return -1;
+            }
+            printf("%llu, %llx\n", (unsigned long long)i,
+                    (unsigned long long)rec.bgzf_offset);
+        }
+    }
+    if (mode & CPPIP_INDEX_FLOW)
+    {
+        /** flows aren't in any useful order, one line each */
+        for (i = 0; i < c->flow.flow_cnt; i++)
+        {
+            ent = c->flow.flows + CPPIP_FLOW_ENT_SIZ * i;
+            memcpy(&key, ent, FLOW_KEY_SIZ);
+            printf("%s, %llu\n", flow_key_str(&key),
+                    (unsigned long long)le64dec(ent + 40));
+        }
+    }
+    if (mode & CPPIP_INDEX_HOST)
+    {
+        /** first packet, its offset, packets and filter blocks */
+        for (i = 0; i < c->host.ent_cnt; i++)
+        {
+            ent = c->host.ents + CPPIP_HOST_ENT_SIZ * i;
+            printf("%llu, %llx, %u, %u\n",
+                    (unsigned long long)le64dec(ent),
+                    (unsigned long long)le64dec(ent + 8),
+                    le32dec(ent + 24), le32dec(ent + 28));
+        }
     }
     return 1;
 }
@@ -77,47 +132,86 @@ index_print_info(cppip_t *c, int mode)
     printf("version:\t%d.%d\n", c->cppip_h.version_major,
                                          c->cppip_h.version_minor);
     printf("created:\t%s\n", ctime_usec(&c->cppip_h.ts_created));
-    printf("packets in pcap:%d\n", c->cppip_h.pkt_cnt);
+    printf("packets in pcap:%llu\n", (unsigned long long)c->pkt_cnt);
     
-    switch (mode)
+    if (mode & CPPIP_INDEX_PN)
     {
-        case CPPIP_INDEX_PN:
-            printf("indexing mode:\tpacket-number\n");
-            printf("index level:\t%d\n", c->cppip_index_pn_hdr.index_level);
-            printf("record count:\t%d\n", c->cppip_index_pn_hdr.rec_cnt);
-            break;
-        case CPPIP_INDEX_TS:
-            printf("indexing mode:\ttimestamp\n");
-            convert_timeval(&c->cppip_index_ts_hdr.index_level, 
-                &d, &h, &m, &s, &u);
-            //printf("index level:\t%d:%d:%d:%d:%d\n", d, h, m, s, u);
-            printf("index level:\t%d:%d:%d:%d\n", d, h, m, s);
-            printf("record count:\t%d\n", c->cppip_index_ts_hdr.rec_cnt);
-            break;
+        printf("indexing mode:\tpacket-number\n");
+        printf("index level:\t%d\n", c->cppip_index_pn_hdr.index_level);
+        printf("record count:\t%llu\n",
+                (unsigned long long)c->pn_stream.rec_cnt);
+    }
+    if (mode & CPPIP_INDEX_TS)
+    {
+        printf("indexing mode:\ttimestamp\n");
+        convert_timeval(&c->cppip_index_ts_hdr.index_level, 
+            &d, &h, &m, &s, &u);
+        //printf("index level:\t%d:%d:%d:%d:%d\n", d, h, m, s, u);
+        printf("index level:\t%d:%d:%d:%d\n", d, h, m, s);
+        printf("record count:\t%llu\n",
+                (unsigned long long)c->ts_stream.rec_cnt);
+    }
+    if (mode & CPPIP_INDEX_EF)
+    {
+        printf("indexing mode:\tpacket-offset\n");
+        printf("record count:\t%llu\n", (unsigned long long)c->ef.n);
+        printf("bits per pkt:\t%.2f\n", 64.0 * (c->ef.blk_cnt +
+                c->ef.sample_cnt + (c->ef.n * c->ef.l + 63) / 64 +
+                c->ef.hi_words) / c->ef.n);
+    }
+    if (mode & CPPIP_INDEX_FLOW)
+    {
+        printf("indexing mode:\tflow\n");
+        printf("flow count:\t%llu\n", (unsigned long long)c->flow.flow_cnt);
+    }
+    if (mode & CPPIP_INDEX_HOST)
+    {
+        printf("indexing mode:\thost\n");
+        printf("index level:\t%u\n", c->host.level);
+        printf("record count:\t%llu\n", (unsigned long long)c->host.ent_cnt);
+        printf("filter bytes:\t%llu\n",
+                (unsigned long long)c->host.blk_cnt * CPPIP_HOST_BLK_SIZ);
+    }
+    if (mode & CPPIP_INDEX_BYTES)
+    {
+        printf("indexing mode:\tbytes\n");
+        if (c->by_stream.level)
+        {
+            printf("index level:\t%llu\n",
+                    (unsigned long long)c->by_stream.level);
+        }
+        else
+        {
+            printf("index level:\tblock\n");
+        }
+        printf("record count:\t%llu\n",
+                (unsigned long long)c->by_stream.rec_cnt);
     }
 }
 
-int
+int64_t
 index_dispatch(cppip_t *c)
 {
-    switch (c->index_mode)
+    if (c->index_mode == 0 || 
+            (c->index_mode & ~(CPPIP_INDEX_PN | CPPIP_INDEX_TS |
+            CPPIP_INDEX_EF | CPPIP_INDEX_FLOW | CPPIP_INDEX_HOST |
+            CPPIP_INDEX_BYTES)))
     {
-        case CPPIP_INDEX_PN:
-            /** ensure index_level is valid */
-            if (c->index_level.num <= 0)
-            {
-                snprintf(c->errbuf, BUFSIZ, "index_level too small: %d\n", 
-                c->index_level.num);
-                return -1;
-            }
-            return index_create(c);
-        case CPPIP_INDEX_TS:
-            return index_create(c);
-        default:
-            snprintf(c->errbuf, BUFSIZ, "unknown packet indexing mode: %d\n", 
-                c->index_mode);
+        snprintf(c->errbuf, BUFSIZ, "unknown packet indexing mode: %d\n", 
+            c->index_mode);
+        return -1;
+    }
+    if (c->index_mode & CPPIP_INDEX_PN)
+    {
+        /** ensure index_level is valid */
+        if (c->index_level.num <= 0)
+        {
+            snprintf(c->errbuf, BUFSIZ, "index_level too small: %d\n", 
+            c->index_level.num);
             return -1;
+        }
     }
+    return index_create(c);
 }
 
 
@@ -136,9 +230,25 @@ index_open(char *index_fname, int mode, cppip_t *c, char *errbuf)
                     strerror(errno), index_fname);
             }
             break;
+        case CATALOG:
+            /** kept as is, catalog_build() reuses what it can */
+            c->index = open(index_fname, O_RDWR   | O_CREAT,
+                                         S_IRUSR  | S_IWUSR | S_IRGRP |
+                                         S_IWGRP  | S_IROTH | S_IWOTH);
+            if (c->index == -1)
+            {
+                snprintf(errbuf, BUFSIZ, "can't open catalog %s: %s\n",
+                    index_fname, strerror(errno));
+            }
+            break;
+        case MERGE:
+        case SERVE:
+            /** the inputs bring their own */
+            return 0;
         case DUMP:
         case EXTRACT:
         case VERIFY:
+        case CATALOG_EXTRACT:
             c->index = open(index_fname, O_RDWR);
             if (c->index == -1)
             {
@@ -154,285 +264,356 @@ index_open(char *index_fname, int mode, cppip_t *c, char *errbuf)
     return c->index;
 }
 
-int
-index_create(cppip_t *c)
+off_t
+index_records_offset(cppip_t *c, int mode)
 {
-    int n;
-    cppip_file_hdr_t cppip_hdr;
-    off_t cppip_hdr_index_pn_offset;
-    off_t cppip_hdr_index_ts_offset;
-    cppip_index_pn_hdr_t cppip_hdr_index_pn;
-    cppip_index_ts_hdr_t cppip_hdr_index_ts;
+    off_t offset;
 
-    /** build/write cppip file header */
-    if (gettimeofday(&cppip_hdr.ts_created, NULL) == -1)
+    /** records follow the headers, pkt-num records come first */
+    offset = c->cppip_h.hdr_size * 4;
+    if (mode == CPPIP_INDEX_TS && (c->cppip_h.index_mode & CPPIP_INDEX_PN))
     {
-        snprintf(c->errbuf, BUFSIZ, "gettimeofday(): %s", strerror(errno));
-        return -1;
+        offset += (off_t)c->cppip_index_pn_hdr.rec_cnt * CPPIP_REC_PN_SIZ;
     }
-    cppip_hdr.magic         = CPPIP_MAGIC;
-    cppip_hdr.version_major = CPPIP_VERSION_MAJOR;
-    cppip_hdr.version_minor = CPPIP_VERSION_MINOR;
-    cppip_hdr.index_mode    = c->index_mode;
-    cppip_hdr.hdr_size      = CPPIP_FH_SIZ / 4;
+    return offset;
+}
 
-    /** prepare index record headers */
-    if ((c->index_mode) & CPPIP_INDEX_PN)
-    {
-        cppip_hdr.hdr_size += (CPPIP_INDEX_PN_H_SIZ / 4);
-        memset(&cppip_hdr_index_pn, 0, CPPIP_INDEX_PN_H_SIZ);
-    }
-    if ((c->index_mode) & CPPIP_INDEX_TS)
-    {
-        cppip_hdr.hdr_size += (CPPIP_INDEX_TS_H_SIZ / 4);
-        memset(&cppip_hdr_index_ts, 0, CPPIP_INDEX_TS_H_SIZ);
-    }
-    if (write(c->index, &cppip_hdr, CPPIP_FH_SIZ) == -1)
+/** state for the single indexing pass over the pcap */
+struct index_state
+{
+    index_v2_stream_t pn;       /** pkt-num records */
+    index_v2_stream_t ts;       /** timestamp records */
+    index_ef_build_t ef;        /** every packet's offset */
+    index_flow_build_t flow;    /** packets of each flow */
+    index_host_build_t host;    /** hosts and ports per interval */
+    struct timeval ts_prev;     /** timestamp of the last ts record */
+    index_v2_stream_t by;       /** bytes records */
+    uint64_t by_len;            /** bytes since the last bytes record */
+    uint64_t by_off;            /** offset of the last bytes record */
+    uint64_t by_ts;             /** latest timestamp yet, in nanoseconds */
+};
+
+/** add a pkt-num record if this packet is on an index_level mark */
+static int
+index_pn_add(cppip_t *c, struct index_state *s, uint64_t pkt_num,
+        uint64_t offset)
+{
+    cppip_record_t cppip_rec;
+
+    /** write first packet then write as per index_level */
+    if (pkt_num == 1 || pkt_num % c->index_level.num == 0)
     {
-        snprintf(c->errbuf, BUFSIZ, "write() error: %s", strerror(errno));
-        return -1;
+        memset(&cppip_rec, 0, sizeof (cppip_rec));
+        cppip_rec.pkt_num     = pkt_num;
+        cppip_rec.bgzf_offset = offset;
+        if (index_v2_stream_add(&s->pn, &cppip_rec, c->errbuf) == -1)
+        {
+            return -1;
+        }
+        if (c->flags & CPPIP_CTRL_DEBUG)
+        {
+            fprintf(stderr, "DBG: add> [%llu]: %llu @ %llx\n",
+                    (unsigned long long)s->pn.rec_cnt,
+                    (unsigned long long)pkt_num, (unsigned long long)offset);
+        }
     }
-    /** 
-     *  Write index headers -- as placeholders for now, fill in the goods
-     *  shortly when we have the data we need. To do this we'll save the
-     *  position of the file pointer via lseek() and re-write the header again
-     *  later, this time with the data. Seems inefficient, wam -- better idea?
+    return 1;
+}
+
+/** add a timestamp record if we're more than index_level past the last */
+static int
+index_ts_add(cppip_t *c, struct index_state *s, uint64_t pkt_num,
+        uint64_t offset, pcap_offline_pkthdr_t *pcap_h)
+{
+    cppip_record_t cppip_rec;
+    struct timeval ts_dif;
+
+    memset(&cppip_rec, 0, sizeof (cppip_rec));
+    cppip_rec.pkt_num        = pkt_num;
+    cppip_rec.pkt_ts.tv_sec  = pcap_h->tv_sec;
+    cppip_rec.pkt_ts.tv_usec = pcap_h->tv_usec;
+    cppip_rec.pkt_ns         = c->pcap_ns;
+
+    /**
+     *  we want to check if: ts(pkt_cur) - ts(pkt_prev) > index
+     *  we'll always write at least the first packet to the index
      */
-    if ((c->index_mode) & CPPIP_INDEX_PN)
+    timersub(&cppip_rec.pkt_ts, &s->ts_prev, &ts_dif);
+
+    /** write to the index as per index */
+    if (timercmp(&ts_dif, &c->index_level.ts, >))
     {
-        cppip_hdr_index_pn_offset = lseek(c->index, 0, SEEK_CUR);
-        if (cppip_hdr_index_pn_offset == -1)
+        cppip_rec.bgzf_offset = offset;
+        if (index_v2_stream_add(&s->ts, &cppip_rec, c->errbuf) == -1)
         {
-            snprintf(c->errbuf, BUFSIZ, "lseek(): %s", strerror(errno));
             return -1;
         }
-        if (write(c->index, &cppip_hdr_index_pn, CPPIP_INDEX_PN_H_SIZ) == -1)
+        if (c->flags & CPPIP_CTRL_DEBUG)
         {
-            snprintf(c->errbuf, BUFSIZ, "write() error: %s", strerror(errno));
-            return -1;
+            fprintf(stderr, "DBG: add> [%llu]: %s @ %llx\n",
+                    (unsigned long long)s->ts.rec_cnt,
+                    ctime_usec(&cppip_rec.pkt_ts), (unsigned long long)offset);
         }
+
+        /** remember the last written packet's timestamp */
+        memcpy(&s->ts_prev, &cppip_rec.pkt_ts, sizeof (struct timeval));
+    }
+    return 1;
+}
+
+/**
+ * Add a bytes record if index_level.bytes of pcap have gone by since the
+ * last, or with a level of 0 if this is the first packet to start in its
+ * BGZF block. The timestamp recorded is the latest seen so far, not the
+ * packet's own, so the records stay in order for index_stream_search()
+ * even if the capture's timestamps step back now and then.
+ */
+static int
+index_by_add(cppip_t *c, struct index_state *s, uint64_t pkt_num,
+        uint64_t offset, pcap_offline_pkthdr_t *pcap_h)
+{
+    uint64_t ts;
+    cppip_record_t cppip_rec;
+
+    ts = ((uint64_t)pcap_h->tv_sec * 1000000 + pcap_h->tv_usec) * 1000 +
+            c->pcap_ns;
+    if (pkt_num == 1 || ts > s->by_ts)
+    {
+        s->by_ts = ts;
     }
-    if ((c->index_mode) & CPPIP_INDEX_TS)
+    if (pkt_num == 1 || (c->index_level.bytes ?
+            s->by_len >= c->index_level.bytes :
+            (offset >> 16) != (s->by_off >> 16)))
     {
-        cppip_hdr_index_ts_offset = lseek(c->index, 0, SEEK_CUR);
-        if (cppip_hdr_index_ts_offset == -1)
+        memset(&cppip_rec, 0, sizeof (cppip_rec));
+        cppip_rec.pkt_num     = pkt_num;
+        cppip_rec.pkt_ns      = s->by_ts % 1000;
+        cppip_rec.bgzf_offset = offset;
+        usec_to_ts(s->by_ts / 1000, &cppip_rec.pkt_ts);
+        if (index_v2_stream_add(&s->by, &cppip_rec, c->errbuf) == -1)
         {
-            snprintf(c->errbuf, BUFSIZ, "lseek(): %s", strerror(errno));
             return -1;
         }
-        if (write(c->index, &cppip_hdr_index_ts, CPPIP_INDEX_TS_H_SIZ) == -1)
+        if (c->flags & CPPIP_CTRL_DEBUG)
         {
-            snprintf(c->errbuf, BUFSIZ, "write() error: %s", strerror(errno));
-            return -1;
+            fprintf(stderr, "DBG: add> [%llu]: %llu %s @ %llx\n",
+                    (unsigned long long)s->by.rec_cnt,
+                    (unsigned long long)pkt_num,
+                    ctime_usec(&cppip_rec.pkt_ts), (unsigned long long)offset);
         }
+        s->by_len = 0;
+        s->by_off = offset;
     }
+    /** what a search that seeks here would inflate to get past it */
+    s->by_len += c->pcapng ? c->ng_len : PCAP_PKTH_SIZ + pcap_h->caplen;
+    return 1;
+}
 
-    /** skip past the pcap file header of pcap we're indexing */
-    if (bgzf_skip(c->pcap, 24) == -1)
+/** per-packet walker callback, feeds every requested index mode */
+static int
+index_add(cppip_t *c, uint64_t pkt_num, uint64_t offset,
+        pcap_offline_pkthdr_t *pcap_h, const uint8_t *data, uint32_t data_len,
+        void *arg)
+{
+    int ip;
+    flow_key_t key;
+    struct index_state *s;
+
+    s = (struct index_state *)arg;
+    if ((c->index_mode & CPPIP_INDEX_PN) &&
+            index_pn_add(c, s, pkt_num, offset) == -1)
+    {
+        return -1;
+    }
+    if ((c->index_mode & CPPIP_INDEX_TS) &&
+            index_ts_add(c, s, pkt_num, offset, pcap_h) == -1)
+    {
+        return -1;
+    }
+    if ((c->index_mode & CPPIP_INDEX_EF) &&
+            index_ef_add(&s->ef, offset, c->errbuf) == -1)
     {
-        snprintf(c->errbuf, BUFSIZ, "bgzf_skip() error\n");
         return -1;
     }
+    if ((c->index_mode & CPPIP_INDEX_BYTES) &&
+            index_by_add(c, s, pkt_num, offset, pcap_h) == -1)
+    {
+        return -1;
+    }
+    if (!(c->index_mode & (CPPIP_INDEX_FLOW | CPPIP_INDEX_HOST)))
+    {
+        return 1;
+    }
 
-    /** handle packet number index header and data */
-    if ((c->index_mode) & CPPIP_INDEX_PN)
+    /** packets that aren't IP have no flow, they're just not in this one */
+    ip = flow_key_get(c->linktype, data, data_len, &key);
+    if ((c->index_mode & CPPIP_INDEX_FLOW) && ip &&
+            index_flow_add(&s->flow, &key, offset, c->errbuf) == -1)
     {
-        n = index_by_pn(c);
-        if (n == -1)
-        {
-            return -1;
-        }
-        cppip_hdr_index_pn.index_mode    = CPPIP_INDEX_PN;
-        cppip_hdr_index_pn.reserved1     = 0;
-        cppip_hdr_index_pn.reserved2     = 0;
-        cppip_hdr_index_pn.rec_cnt       = n;
-        cppip_hdr_index_pn.index_level   = c->index_level.num;
-
-        lseek(c->index, cppip_hdr_index_pn_offset, SEEK_SET);
-        if (write(c->index, &cppip_hdr_index_pn, 
-                        CPPIP_INDEX_PN_H_SIZ) == -1)
+        return -1;
+    }
+    if ((c->index_mode & CPPIP_INDEX_HOST) &&
+            index_host_add(&s->host, pkt_num, offset, ip ? &key : NULL,
+            c->errbuf) == -1)
+    {
+        return -1;
+    }
+    return 1;
+}
+
+int64_t
+index_create(cppip_t *c)
+{
+    int k;
+    int64_t n;
+    uint8_t pcap_fh[BUFSIZ];
+    struct index_state s;
+    index_v2_section_t sects[6];
+
+    /** the header fields we keep in memory, the file is written last */
+    memset(&c->cppip_h, 0, CPPIP_FH_SIZ);
+    if (gettimeofday(&c->cppip_h.ts_created, NULL) == -1)
+    {
+        snprintf(c->errbuf, BUFSIZ, "gettimeofday(): %s", strerror(errno));
+        return -1;
+    }
+    c->cppip_h.magic         = CPPIP_MAGIC;
+    c->cppip_h.version_major = CPPIP_FORMAT_V2;
+    c->cppip_h.index_mode    = c->index_mode;
+
+    /** read past the file header, we want the link type */
+    if (extract_open(c, pcap_fh) == -1)
+    {
+        return -1;
+    }
+
+    /**
+     *  One pass over the pcap feeds every index mode. Each mode's records
+     *  are delta encoded into its own spool and the index file is laid out
+     *  in one go at the end, once all the counts are known.
+     */
+    memset(&s, 0, sizeof (s));
+    n = -1;
+    k = 0;
+    if (c->index_mode & CPPIP_INDEX_PN)
+    {
+        if (index_v2_stream_init(&s.pn, CPPIP_INDEX_PN, 
+                CPPIP_REC_F_PKT | CPPIP_REC_F_OFF, c->index_level.num,
+                c->errbuf) == -1)
         {
-            snprintf(c->errbuf, BUFSIZ, "write() error: %s", strerror(errno));
-            return -1;
+            goto done;
         }
-        /** XXX clean this up */
-        cppip_hdr.pkt_cnt = c->cppip_h.pkt_cnt;
-        lseek(c->index, 0, SEEK_SET);
-        write(c->index, &cppip_hdr, CPPIP_FH_SIZ);
     }
-    if ((c->index_mode) & CPPIP_INDEX_TS)
+    if (c->index_mode & CPPIP_INDEX_TS)
     {
-        n = index_by_ts(c);
-        if (n == -1)
+        if (index_v2_stream_init(&s.ts, CPPIP_INDEX_TS,
+                CPPIP_REC_F_TS | CPPIP_REC_F_OFF |
+                (c->pcap_nsec ? CPPIP_REC_F_NSEC : 0),
+                (uint64_t)c->index_level.ts.tv_sec * 1000000 +
+                c->index_level.ts.tv_usec, c->errbuf) == -1)
         {
-            return -1;
+            goto done;
         }
-        cppip_hdr_index_ts.index_mode    = CPPIP_INDEX_TS;
-        cppip_hdr_index_ts.reserved1     = 0;
-        cppip_hdr_index_ts.reserved2     = 0;
-        cppip_hdr_index_ts.rec_cnt       = n;
-        cppip_hdr_index_ts.index_level.tv_sec  = c->index_level.ts.tv_sec;
-        cppip_hdr_index_ts.index_level.tv_usec = c->index_level.ts.tv_usec;
-
-        lseek(c->index, cppip_hdr_index_ts_offset, SEEK_SET);
-        if (write(c->index, &cppip_hdr_index_ts, 
-                        CPPIP_INDEX_TS_H_SIZ) == -1)
+    }
+    if (c->index_mode & CPPIP_INDEX_BYTES)
+    {
+        if (index_v2_stream_init(&s.by, CPPIP_INDEX_BYTES,
+                CPPIP_REC_F_PKT | CPPIP_REC_F_TS | CPPIP_REC_F_OFF |
+                (c->pcap_nsec ? CPPIP_REC_F_NSEC : 0), c->index_level.bytes,
+                c->errbuf) == -1)
         {
-            snprintf(c->errbuf, BUFSIZ, "write() error: %s", strerror(errno));
-            return -1;
+            goto done;
         }
-        /** XXX clean this up */
-        cppip_hdr.pkt_cnt = c->cppip_h.pkt_cnt;
-        lseek(c->index, 0, SEEK_SET);
-        write(c->index, &cppip_hdr, CPPIP_FH_SIZ);
     }
-    return n;
-}
+    if ((c->index_mode & CPPIP_INDEX_EF) &&
+            index_ef_init(&s.ef, c->errbuf) == -1)
+    {
+        goto done;
+    }
+    if ((c->index_mode & CPPIP_INDEX_FLOW) &&
+            index_flow_init(&s.flow, c->errbuf) == -1)
+    {
+        goto done;
+    }
+    if ((c->index_mode & CPPIP_INDEX_HOST) &&
+            index_host_init(&s.host, c->index_level.host, c->errbuf) == -1)
+    {
+        goto done;
+    }
 
-int
-index_by_pn(cppip_t *c)
-{
-    int done, rec_cnt;
-    uint32_t pkt_cnt;
-    uint64_t offset;
-    uint8_t buf[BUFSIZ * 2];
-    cppip_record_pn_t cppip_rec;
-    pcap_offline_pkthdr_t *pcap_h;
-
-    memset(&buf, 0, sizeof (buf));
-    for (rec_cnt = 0, pkt_cnt = 1, done = 0; !done; pkt_cnt++)
-    {
-        /**  ...[pcap packet header][packet]...
-         *      ^
-         *      bgzf fp is pointing here, the BGZF offset to this 
-         *      packet.. This is
-         *      the offset we will record in our index
-         */
-        offset = bgzf_tell(c->pcap);
-        switch (bgzf_read(c->pcap, buf, PCAP_PKTH_SIZ))
-        {
-            case -1:
-                snprintf(c->errbuf, BUFSIZ, "bgzf_read() error\n");
-                return -1;
-            case 0:
-                /* all done */
-                done = 1;
-                break;
-            default:
-                pcap_h = (pcap_offline_pkthdr_t *)buf;
-                /** write first packet then write as per index_level */
-                if (pkt_cnt == 1 || pkt_cnt % c->index_level.num == 0)
-                {
-                    cppip_rec.pkt_num     = pkt_cnt;
-                    cppip_rec.bgzf_offset = offset;
-                    if (write(c->index, &cppip_rec, CPPIP_REC_PN_SIZ) == -1)
-                    {
-                        snprintf(c->errbuf, BUFSIZ, "write(): %s", 
-                                strerror(errno));
-                        return -1;
-                    }
-                    rec_cnt++;
-                    if (c->flags & CPPIP_CTRL_DEBUG)
-                    {
-                        fprintf(stderr, "DBG: add> [%d]: %d @ %llx\n",
-                                rec_cnt, pkt_cnt, offset);
-                    }
-                }
-                /** 
-                 *  we don't care about the contents -- we skip past the 
-                 *  packet
-                 */
-                if (bgzf_skip(c->pcap, pcap_h->caplen) == -1)
-                {
-                    snprintf(c->errbuf, BUFSIZ, "bgzf_skip() error\n");
-                    return -1;
-                }
-        }
+    /** only the flow and host indices need to look inside packets */
+    n = pcap_walk(c, (c->index_mode & (CPPIP_INDEX_FLOW | CPPIP_INDEX_HOST)) ?
+            FLOW_SNAP : 0, index_add, &s);
+    if (n == -1)
+    {
+        goto done;
     }
-    if (rec_cnt == 0)
+    if (((c->index_mode & CPPIP_INDEX_PN) && s.pn.rec_cnt == 0) ||
+            ((c->index_mode & CPPIP_INDEX_TS) && s.ts.rec_cnt == 0) ||
+            ((c->index_mode & CPPIP_INDEX_EF) && s.ef.n == 0) ||
+            ((c->index_mode & CPPIP_INDEX_BYTES) && s.by.rec_cnt == 0) ||
+            ((c->index_mode & CPPIP_INDEX_FLOW) && s.flow.flow_cnt == 0))
     {
         snprintf(c->errbuf, BUFSIZ, 
                 "wrote 0 records, index_level too large for this pcap?\n");
-        return -1;
+        n = -1;
+        goto done;
     }
-    c->cppip_h.pkt_cnt = pkt_cnt;
-    return rec_cnt;
-}
+    c->pkt_cnt          = n;
+    c->cppip_h.pkt_cnt  = n;
 
-int
-index_by_ts(cppip_t *c)
-{
-    int pkt_cnt, done, rec_cnt;
-    uint64_t offset;
-    uint8_t buf[BUFSIZ * 2];
-    cppip_record_ts_t cppip_rec;
-    pcap_offline_pkthdr_t *pcap_h;
-    struct timeval ts_dif, ts_prev;
-
-    memset(&buf, 0, sizeof (buf));
-    memset(&ts_prev, 0, sizeof (struct timeval));
-    for (rec_cnt = 0, pkt_cnt = 1, done = 0; !done; pkt_cnt++)
-    {
-        /**  ...[pcap packet header][packet]...
-         *      ^
-         *      bgzf fp is pointing here, the BGZF offset to this 
-         *      packet.. This is the offset we will record in our index
-         */
-        offset = bgzf_tell(c->pcap);
-        switch (bgzf_read(c->pcap, buf, PCAP_PKTH_SIZ))
-        {
-            case -1:
-                snprintf(c->errbuf, BUFSIZ, "bgzf_read() error\n");
-                return -1;
-            case 0:
-                /* all done */
-                done = 1;
-                break;
-            default:
-                pcap_h = (pcap_offline_pkthdr_t *)buf;
-                cppip_rec.pkt_ts.tv_sec  = pcap_h->tv_sec;
-                cppip_rec.pkt_ts.tv_usec = pcap_h->tv_usec;
-
-                /**
-                 *  we want to check if: ts(pkt_cur) - ts(pkt_prev) > index
-                 *  we'll always write at least the first packet to the index
-                 */
-                timersub(&cppip_rec.pkt_ts, &ts_prev, &ts_dif);
-
-                /** write to the index as per index */
-                if (timercmp(&ts_dif, &c->index_level.ts, >))
-                {
-                    cppip_rec.bgzf_offset = offset;
-                    if (write(c->index, &cppip_rec, CPPIP_REC_TS_SIZ) == -1)
-                    {
-                        snprintf(c->errbuf, BUFSIZ, "write(): %s",
-                                strerror(errno));
-                        return -1;
-                    }
-                    rec_cnt++;
-                    if (c->flags & CPPIP_CTRL_DEBUG)
-                    {
-                        fprintf(stderr, "DBG: add> [%d]: %s @ %llx\n", rec_cnt, 
-                                ctime_usec(&cppip_rec.pkt_ts), offset);
-                    }
-
-                    /** remember the last written packet's timestamp */
-                    memcpy(&ts_prev, &cppip_rec.pkt_ts, 
-                        sizeof (struct timeval));
-                }
-                /** 
-                 *  we don't care about the contents -- we skip past the 
-                 *  packet
-                 */
-                if (bgzf_skip(c->pcap, pcap_h->caplen) == -1)
-                {
-                    snprintf(c->errbuf, BUFSIZ, "bgzf_skip() error\n");
-                    return -1;
-                }
-        }
+    /** sections in index mode order */
+    if ((c->index_mode & CPPIP_INDEX_PN) &&
+            index_v2_stream_section(&s.pn, &sects[k++], c->errbuf) == -1)
+    {
+        n = -1;
+        goto done;
+    }
+    if ((c->index_mode & CPPIP_INDEX_TS) &&
+            index_v2_stream_section(&s.ts, &sects[k++], c->errbuf) == -1)
+    {
+        n = -1;
+        goto done;
     }
-    c->cppip_h.pkt_cnt = pkt_cnt;
-    return rec_cnt;
+    if ((c->index_mode & CPPIP_INDEX_EF) &&
+            index_ef_section(&s.ef, &sects[k++], c->errbuf) == -1)
+    {
+        n = -1;
+        goto done;
+    }
+    if ((c->index_mode & CPPIP_INDEX_FLOW) &&
+            index_flow_section(&s.flow, &sects[k++], c->errbuf) == -1)
+    {
+        n = -1;
+        goto done;
+    }
+    if ((c->index_mode & CPPIP_INDEX_HOST) &&
+            index_host_section(&s.host, &sects[k++], c->errbuf) == -1)
+    {
+        n = -1;
+        goto done;
+    }
+    if ((c->index_mode & CPPIP_INDEX_BYTES) &&
+            index_v2_stream_section(&s.by, &sects[k++], c->errbuf) == -1)
+    {
+        n = -1;
+        goto done;
+    }
+    if (index_v2_write(c, sects, k) == -1)
+    {
+        n = -1;
+        goto done;
+    }
+    n = s.pn.rec_cnt + s.ts.rec_cnt + s.ef.n + s.flow.flow_cnt +
+            s.host.ent_cnt + s.by.rec_cnt;
+done:
+    index_v2_stream_free(&s.pn);
+    index_v2_stream_free(&s.ts);
+    index_v2_stream_free(&s.by);
+    index_ef_free(&s.ef);
+    index_flow_free(&s.flow);
+    index_host_free(&s.host);
+    return n;
 }
 
 /** EOF */
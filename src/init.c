@@ -25,6 +25,29 @@
 
 #include "../include/cppip.h"
 
+/** the new pcap, "-" is stdout so extractions can feed a pipe */
+static int
+pcap_new_open(cppip_t *c, char *pcap_new_fname, char *errbuf)
+{
+    if (strcmp(pcap_new_fname, "-") == 0)
+    {
+        c->pcap_new = STDOUT_FILENO;
+        c->pcap_new_fname = "stdout";
+        return 1;
+    }
+    c->pcap_new = open(pcap_new_fname, O_WRONLY | O_CREAT | O_TRUNC, 
+                                       S_IRUSR  | S_IWUSR | S_IRGRP | 
+                                       S_IWGRP  | S_IROTH | S_IWOTH);
+    if (c->pcap_new == -1)
+    {
+        snprintf(errbuf, BUFSIZ, "can't open pcap %s: %s\n",
+                pcap_new_fname, strerror(errno));
+        return -1;
+    }
+    c->pcap_new_fname = pcap_new_fname;
+    return 1;
+}
+
 cppip_t *
 control_context_init(uint8_t flags, char *index_fname, char *pcap_fname, 
         char *pcap_new_fname, char *opt, int mode, char *errbuf)
@@ -58,7 +81,7 @@ control_context_init(uint8_t flags, char *index_fname, char *pcap_fname,
                         pcap_fname);
                 goto err;
             }
-            c->pcap = bgzf_open(pcap_fname, "r");
+            c->pcap = bgzf_open_fd(pcap_fname, &c->pcap_fd);
             if (c->pcap == NULL)
             {
                 snprintf(errbuf, BUFSIZ, "can't open bgzip pcap file %s: %s", 
@@ -81,7 +104,7 @@ control_context_init(uint8_t flags, char *index_fname, char *pcap_fname,
                         pcap_fname);
                 goto err;
             }
-            c->pcap = bgzf_open(pcap_fname, "r");
+            c->pcap = bgzf_open_fd(pcap_fname, &c->pcap_fd);
             if (c->pcap == NULL)
             {
                 snprintf(errbuf, BUFSIZ, "can't open bgzip pcap file %s: %s", 
@@ -89,16 +112,42 @@ control_context_init(uint8_t flags, char *index_fname, char *pcap_fname,
                 goto err;
             }
             c->pcap_fname = pcap_fname;
-            c->pcap_new = open(pcap_new_fname, O_WRONLY | O_CREAT | O_TRUNC, 
-                                               S_IRUSR  | S_IWUSR | S_IRGRP | 
-                                               S_IWGRP  | S_IROTH | S_IWOTH);
-            if (c->pcap_new == -1)
+            /** -s: every range gets its own new pcap, opened as it's reached */
+            if (c->ranges_fname && (flags & CPPIP_CTRL_SPLIT))
+            {
+                if (strcmp(pcap_new_fname, "-") == 0)
+                {
+                    snprintf(errbuf, BUFSIZ, "-s can't write to stdout\n");
+                    goto err;
+                }
+                c->pcap_new_fname = pcap_new_fname;
+                break;
+            }
+            if (pcap_new_open(c, pcap_new_fname, errbuf) == -1)
+            {
+                goto err;
+            }
+            break;
+        case CATALOG:
+        case SERVE:
+            break;
+        case CATALOG_EXTRACT:
+        case MERGE:
+            if (opt_parse_extract(opt, c) == -1)
+            {
+                memcpy(errbuf, c->errbuf, BUFSIZ);
+                goto err;
+            }
+            if (c->index_mode != CPPIP_INDEX_TS)
+            {
+                snprintf(errbuf, BUFSIZ, "%s can only be done by timestamp\n",
+                        mode == MERGE ? "merging" : "catalog extraction");
+                goto err;
+            }
+            if (pcap_new_open(c, pcap_new_fname, errbuf) == -1)
             {
-                snprintf(c->errbuf, BUFSIZ, "can't open pcap %s: %s",
-                        strerror(errno), pcap_new_fname);
                 goto err;
             }
-            c->pcap_new_fname = pcap_new_fname;
             break;
         default:
             snprintf(errbuf, BUFSIZ, "unknown mode %d\n", mode);
@@ -124,6 +173,26 @@ control_context_destroy(cppip_t *c)
     {
         bgzf_close(c->pcap);
     }
+    if (c->index_map)
+    {
+        munmap(c->index_map, c->index_map_siz);
+    }
+    filter_free(c);
+    if (c->zout)
+    {
+        zout_free(c->zout);
+        free(c->zout);
+    }
+    if (c->pcap_w)
+    {
+        writer_free(c->pcap_w);
+        free(c->pcap_w);
+    }
+    free(c->arena);
+    if (c->bcache)
+    {
+        bcache_free(c->bcache);
+    }
     if (c->index)
     {
         /** try to keep the file system clean and remove empty files */
@@ -24,24 +24,79 @@
  */
 
 #include "../include/cppip.h"
+#include <getopt.h>
+
+static struct option long_opts[] =
+{
+    {"serve",   required_argument,  NULL,   'S'},
+    {NULL,      0,                  NULL,   0}
+};
+
+/** packets copied in compressed form weren't counted, just say where */
+static void
+extract_report(cppip_t *c)
+{
+    if (c->flags & CPPIP_CTRL_SPLIT)
+    {
+        /** batch_extract() reported each range's file */
+        return;
+    }
+    if (c->e_pkts.copied)
+    {
+        fprintf(stderr, "wrote the range to %s.\n", c->pcap_new_fname);
+        return;
+    }
+    fprintf(stderr, "wrote %llu packets to %s.\n",
+            (unsigned long long)c->e_pkts.pkts_w, c->pcap_new_fname);
+}
 
 int
 main(int argc, char **argv)
 {
     cppip_t *c;
-    int n, opt;
+    int n, opt, threads, cache_mb, ra_depth;
     uint8_t mode, flags;
-    char *opt_s, errbuf[BUFSIZ];
+    char *opt_s, *filter_s, errbuf[BUFSIZ];
 
     if (argc == 1)
     {
         return usage();
     }
+    c = NULL;
     mode = flags = 0;
-    while ((opt = getopt(argc, argv, "DdvIi:he:fiV")) >= 0)
+    threads = 1;
+    cache_mb = -1;
+    ra_depth = READAHEAD_DEF_DEPTH;
+    filter_s = NULL;
+    while ((opt = getopt_long(argc, argv, "c:C:DdvIi:he:E:fF:im:R:sS:t:Vz",
+            long_opts, NULL)) >= 0)
     {
         switch (opt)
         {
+            case 'c':
+                /** -c catalog.cppip dir [dir...] */
+                if (argc - optind < 1)
+                {
+                    return usage();
+                }
+                mode = CATALOG;
+                c = control_context_init(flags, optarg, NULL, NULL, NULL,
+                                         mode, errbuf);
+                if (c)
+                {
+                    c->dirs    = &argv[optind];
+                    c->dir_cnt = argc - optind;
+                }
+                optind = argc;
+                break;
+            case 'C':
+                /** megabytes of inflated blocks to cache, 0 for none */
+                cache_mb = strtol(optarg, NULL, 10);
+                if (cache_mb < 0)
+                {
+                    return usage();
+                }
+                break;
             case 'D':
                 flags |= CPPIP_CTRL_DEBUG;
                 break;
@@ -55,7 +110,7 @@ main(int argc, char **argv)
                                          mode, errbuf);
                 break;
             case 'e':
-                /** -e index_mode:n{-m} index pcap.bz new.pcap */
+                /** -e index_mode:n{-m}|ranges:file index pcap.bz new.pcap */
                 if (argc - optind != 3)
                 {
                     return usage();
@@ -65,9 +120,23 @@ main(int argc, char **argv)
                 c = control_context_init(flags, argv[optind], argv[optind + 1], 
                                          argv[optind + 2], opt_s, mode, errbuf);
                 break;
+            case 'E':
+                /** -E timestamp:range catalog.cppip new.pcap */
+                if (argc - optind != 2)
+                {
+                    return usage();
+                }
+                opt_s = optarg;
+                mode  = CATALOG_EXTRACT;
+                c = control_context_init(flags, argv[optind], NULL,
+                                         argv[optind + 1], opt_s, mode, errbuf);
+                break;
             case 'f':
                 flags |= CPPIP_CTRL_TS_FM;
                 break;
+            case 'F':
+                filter_s = optarg;
+                break;
             case 'h':
                 return usage();
             case 'I':
@@ -83,6 +152,63 @@ main(int argc, char **argv)
                 c = control_context_init(flags, argv[optind], argv[optind + 1],
                                          NULL, opt_s, mode, errbuf);
                 break;
+            case 'm':
+                /** -m timestamp:range new.pcap index.cppip pcap.gz ... */
+                if (argc - optind < 3 || (argc - optind) % 2 == 0)
+                {
+                    return usage();
+                }
+                opt_s = optarg;
+                mode  = MERGE;
+                c = control_context_init(flags, NULL, NULL, argv[optind],
+                                         opt_s, mode, errbuf);
+                if (c)
+                {
+                    c->inputs    = &argv[optind + 1];
+                    c->input_cnt = argc - optind - 1;
+                }
+                optind = argc;
+                break;
+            case 'R':
+                /** chunks of pcap.gz to read ahead, 0 for none */
+                ra_depth = strtol(optarg, NULL, 10);
+                if (ra_depth < 0)
+                {
+                    return usage();
+                }
+                break;
+            case 's':
+                flags |= CPPIP_CTRL_SPLIT;
+                break;
+            case 'S':
+                /** --serve socket index.cppip pcap.gz ... */
+                if (argc - optind < 2 || (argc - optind) % 2)
+                {
+                    return usage();
+                }
+                mode = SERVE;
+                c = control_context_init(flags, NULL, NULL, NULL, NULL, mode,
+                                         errbuf);
+                if (c)
+                {
+                    c->sock_fname = optarg;
+                    c->inputs     = &argv[optind];
+                    c->input_cnt  = argc - optind;
+                }
+                optind = argc;
+                break;
+            case 't':
+                /** 0 means one thread per online CPU */
+                threads = strtol(optarg, NULL, 10);
+                if (threads == 0)
+                {
+                    threads = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                if (threads < 1)
+                {
+                    return usage();
+                }
+                break;
             case 'V':
                 return version();
             case 'v':
@@ -94,15 +220,76 @@ main(int argc, char **argv)
                 c = control_context_init(flags, argv[optind], NULL, NULL, NULL,
                                          mode, errbuf);
                 break;
+            case 'z':
+                flags |= CPPIP_CTRL_BGZF;
+                break;
             default:
                 return usage();
         }
     }
+    if (mode == 0)
+    {
+        return usage();
+    }
     if (c == NULL)
     {
         fprintf(stderr, "control_context_init(): %s", errbuf);
         return -1;
     }
+    c->threads  = threads;
+    c->filter_s = filter_s;
+    c->ra_depth = ra_depth;
+
+    /** -C: inflated blocks are cached, a server caches unless told not to */
+    if (cache_mb > 0 || (cache_mb == -1 && mode == SERVE))
+    {
+        c->bcache = bcache_new(cache_mb > 0 ? (size_t)cache_mb << 20 :
+                BCACHE_DEF_SIZ, c->errbuf);
+        if (c->bcache == NULL)
+        {
+            fprintf(stderr, "bcache_new(): %s", c->errbuf);
+            control_context_destroy(c);
+            return -1;
+        }
+    }
+
+    /** -z: what goes to the new pcap is compressed, on `threads` threads */
+    if ((flags & CPPIP_CTRL_BGZF) && c->pcap_new)
+    {
+        c->zout = malloc(sizeof (zout_t));
+        if (c->zout == NULL)
+        {
+            fprintf(stderr, "malloc(): %s\n", strerror(errno));
+            control_context_destroy(c);
+            return -1;
+        }
+        if (zout_init(c->zout, c->pcap_new, threads, c->errbuf) == -1)
+        {
+            fprintf(stderr, "zout_init(): %s", c->errbuf);
+            control_context_destroy(c);
+            return -1;
+        }
+    }
+    /** otherwise it's buffered and goes out a megabyte per write */
+    else if (c->pcap_new)
+    {
+        c->pcap_w = malloc(sizeof (writer_t));
+        if (c->pcap_w == NULL)
+        {
+            fprintf(stderr, "malloc(): %s\n", strerror(errno));
+            control_context_destroy(c);
+            return -1;
+        }
+        if (writer_init(c->pcap_w, c->pcap_new, -1, WRITER_BUF_SIZ,
+                c->errbuf) == -1)
+        {
+            fprintf(stderr, "writer_init(): %s", c->errbuf);
+            free(c->pcap_w);
+            c->pcap_w = NULL;
+            control_context_destroy(c);
+            return -1;
+        }
+    }
 
     if (cppip_dispatch(mode, c) == -1)
     {
@@ -121,6 +308,7 @@ cppip_dispatch(int mode, cppip_t *c)
 {
     void *index_hdr;
     int n;
+    int64_t recs;
 
     switch (mode)
     {
@@ -128,33 +316,56 @@ cppip_dispatch(int mode, cppip_t *c)
             return index_verify(c, V_DUMP);
         case INDEX:
             printf("indexing %s...\n", c->pcap_fname);
-            n = index_dispatch(c);
-            if (n == -1)
+            recs = index_dispatch(c);
+            if (recs == -1)
             {
                 return -1;
             }
             else
             {
-                fprintf(stderr, "wrote %d records to %s\n", n, c->index_fname);
+                fprintf(stderr, "wrote %lld records to %s\n",
+                        (long long)recs, c->index_fname);
             }
-            return n;
+            return 1;
         case EXTRACT:
             if (index_verify(c, 0) == -1)
             {
                 return -1;
             }
-            printf("extracting from %s using %s...\n", c->pcap_fname, 
-                                                       c->index_fname);
+            /** status goes to stderr, the new pcap may be on stdout */
+            fprintf(stderr, "extracting from %s using %s...\n",
+                    c->pcap_fname, c->index_fname);
             n = extract(c);
             if (n == -1)
             {
                 fprintf(stderr, "extract(): %s", c->errbuf);
             }
-            fprintf(stderr, "wrote %d packets to %s.\n", c->e_pkts.pkts_w, 
-                        c->pcap_new_fname);
+            extract_report(c);
             break;
         case VERIFY:
             return index_verify(c, V_DETAILED);
+        case CATALOG:
+            printf("cataloguing into %s...\n", c->index_fname);
+            return catalog_build(c);
+        case MERGE:
+            fprintf(stderr, "merging %d captures...\n", c->input_cnt / 2);
+            n = merge_extract(c);
+            if (n == -1)
+            {
+                fprintf(stderr, "merge_extract(): %s", c->errbuf);
+            }
+            extract_report(c);
+            break;
+        case CATALOG_EXTRACT:
+            n = catalog_extract(c);
+            if (n == -1)
+            {
+                fprintf(stderr, "catalog_extract(): %s", c->errbuf);
+            }
+            extract_report(c);
+            break;
+        case SERVE:
+            return serve(c);
         default:
             snprintf(c->errbuf, BUFSIZ, "unknown mode: %d\n", mode);
             return -1;
@@ -0,0 +1,500 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * merge.c: time ordered extraction from several pcap.gz files at once
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "../include/cppip.h"
+#include <pthread.h>
+
+/** packet bytes handed from a reader to the merge at a time */
+#define MERGE_BATCH_SIZ (256 * 1024)
+
+/** batches in flight per input, the reader fills while the merge drains */
+#define MERGE_BATCHES   4
+
+/** pcap headers and packets back to back */
+struct merge_batch
+{
+    uint8_t *buf;               /** the packets */
+    size_t siz;                 /** capacity of buf */
+    size_t len;                 /** bytes in buf */
+};
+
+/** one input, its reader thread and the ring of batches between them */
+struct merge_input
+{
+    cppip_t *f;                 /** the input's pcap and index */
+    pthread_t tid;              /** its reader */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /** a batch was filled or emptied */
+    struct merge_batch b[MERGE_BATCHES];
+    int head;                   /** oldest filled batch */
+    int cnt;                    /** filled batches */
+    int done;                   /** the reader has finished */
+    int err;                    /** the reader failed, see f->errbuf */
+    int quit;                   /** the merge wants the reader to stop */
+    struct timeval start;       /** first timestamp wanted */
+    struct timeval stop;        /** last timestamp wanted */
+    const uint8_t *pkt;         /** merge: current packet, header first */
+    pcap_offline_pkthdr_t pcap_h; /** merge: its header */
+    uint64_t ts;                /** merge: its timestamp, in nanoseconds */
+    size_t pos;                 /** merge: its offset in b[head] */
+};
+
+/** a free batch for the reader to fill, NULL once the merge is done */
+static struct merge_batch *
+merge_slot(struct merge_input *in, int tail)
+{
+    struct merge_batch *b;
+
+    pthread_mutex_lock(&in->lock);
+    while (in->cnt == MERGE_BATCHES && !in->quit)
+    {
+        pthread_cond_wait(&in->cond, &in->lock);
+    }
+    b = in->quit ? NULL : &in->b[tail];
+    pthread_mutex_unlock(&in->lock);
+    if (b)
+    {
+        b->len = 0;
+    }
+    return b;
+}
+
+/** hand a filled batch to the merge */
+static void
+merge_post(struct merge_input *in)
+{
+    pthread_mutex_lock(&in->lock);
+    in->cnt++;
+    pthread_cond_signal(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+}
+
+/**
+ * Reader thread: decompress the input from where the index put us, keep
+ * the packets in the time range that pass the filter and batch them up.
+ */
+static void *
+merge_reader(void *arg)
+{
+    int n, tail, err;
+    size_t need;
+    uint8_t *p;
+    const uint8_t *pkt;
+    cppip_t *f;
+    struct timeval cur;
+    struct merge_batch *b;
+    struct merge_input *in;
+    pcap_offline_pkthdr_t pcap_h;
+    uint8_t rh[PCAP_PKTH_SIZ];
+
+    in   = (struct merge_input *)arg;
+    f    = in->f;
+    err  = 0;
+    tail = 0;
+    b    = merge_slot(in, tail);
+    while (b)
+    {
+        n = bgzf_read(f->pcap, rh, PCAP_PKTH_SIZ);
+        if (n == 0)
+        {
+            break;
+        }
+        if (n != PCAP_PKTH_SIZ)
+        {
+            snprintf(f->errbuf, BUFSIZ, "%s: can't read pcap hdr\n",
+                    f->pcap_fname);
+            err = 1;
+            break;
+        }
+        memcpy(&pcap_h, rh, PCAP_PKTH_SIZ);
+        f->pcap_dec(&pcap_h);
+        cur.tv_sec  = pcap_h.tv_sec;
+        cur.tv_usec = pcap_h.tv_usec;
+        if (timercmp(&cur, &in->stop, >))
+        {
+            break;
+        }
+        if (timercmp(&cur, &in->start, <))
+        {
+            if (bgzf_skip(f->pcap, f->pcap_fd, pcap_h.caplen) == -1)
+            {
+                snprintf(f->errbuf, BUFSIZ, "%s: bgzf_skip() error\n",
+                        f->pcap_fname);
+                err = 1;
+                break;
+            }
+            continue;
+        }
+
+        /** the filter looks at the packet in the block, only keepers move */
+        pkt = bgzf_view(f->pcap, f->pcap_fd, pcap_h.caplen, &f->arena,
+                &f->arena_siz);
+        if (pkt == NULL)
+        {
+            snprintf(f->errbuf, BUFSIZ, "%s: can't read packet\n",
+                    f->pcap_fname);
+            err = 1;
+            break;
+        }
+        if (f->filter && !filter_match(f, pkt, pcap_h.caplen, pcap_h.len))
+        {
+            continue;
+        }
+        need = PCAP_PKTH_SIZ + pcap_h.caplen;
+        if (b->len + need > b->siz && b->len)
+        {
+            merge_post(in);
+            tail = (tail + 1) % MERGE_BATCHES;
+            b = merge_slot(in, tail);
+            if (b == NULL)
+            {
+                break;
+            }
+        }
+        if (need > b->siz)
+        {
+            p = realloc(b->buf, need);
+            if (p == NULL)
+            {
+                snprintf(f->errbuf, BUFSIZ, "realloc(): %s\n",
+                        strerror(errno));
+                err = 1;
+                break;
+            }
+            b->buf = p;
+            b->siz = need;
+        }
+        p = b->buf + b->len;
+        memcpy(p, rh, PCAP_PKTH_SIZ);
+        memcpy(p + PCAP_PKTH_SIZ, pkt, pcap_h.caplen);
+        b->len += need;
+    }
+    if (b && b->len)
+    {
+        merge_post(in);
+    }
+    pthread_mutex_lock(&in->lock);
+    in->done = 1;
+    in->err  = err;
+    pthread_cond_signal(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+    return NULL;
+}
+
+/**
+ * Move an input on to its next packet, waiting on its reader if need be
+ * returns: 1 if there is one, 0 if the input is exhausted, -1 on error
+ */
+static int
+merge_next(struct merge_input *in, char *errbuf)
+{
+    uint32_t ns;
+    struct merge_batch *b;
+
+    if (in->pkt)
+    {
+        in->pos += PCAP_PKTH_SIZ + in->pcap_h.caplen;
+        if (in->pos == in->b[in->head].len)
+        {
+            /** give the batch back */
+            pthread_mutex_lock(&in->lock);
+            in->head = (in->head + 1) % MERGE_BATCHES;
+            in->cnt--;
+            pthread_cond_signal(&in->cond);
+            pthread_mutex_unlock(&in->lock);
+            in->pos = 0;
+        }
+        in->pkt = NULL;
+    }
+    pthread_mutex_lock(&in->lock);
+    while (in->cnt == 0 && !in->done)
+    {
+        pthread_cond_wait(&in->cond, &in->lock);
+    }
+    if (in->cnt == 0)
+    {
+        pthread_mutex_unlock(&in->lock);
+        if (in->err)
+        {
+            memcpy(errbuf, in->f->errbuf, BUFSIZ);
+            return -1;
+        }
+        return 0;
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    b = &in->b[in->head];
+    in->pkt = b->buf + in->pos;
+    memcpy(&in->pcap_h, in->pkt, PCAP_PKTH_SIZ);
+    ns = in->f->pcap_dec(&in->pcap_h);
+    in->ts = ((uint64_t)in->pcap_h.tv_sec * 1000000 + in->pcap_h.tv_usec) *
+            1000 + ns;
+    return 1;
+}
+
+/** heap order, earliest packet first and the earlier input on a tie */
+static int
+merge_less(struct merge_input *ins, int a, int b)
+{
+    if (ins[a].ts != ins[b].ts)
+    {
+        return ins[a].ts < ins[b].ts;
+    }
+    return a < b;
+}
+
+static void
+merge_down(struct merge_input *ins, int *heap, int n, int i)
+{
+    int l, m, t;
+
+    for (;;)
+    {
+        l = 2 * i + 1;
+        if (l >= n)
+        {
+            break;
+        }
+        m = l + 1 < n && merge_less(ins, heap[l + 1], heap[l]) ? l + 1 : l;
+        if (!merge_less(ins, heap[m], heap[i]))
+        {
+            break;
+        }
+        t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+int
+merge_extract(cppip_t *c)
+{
+    cppip_t *f;
+    uint32_t snaplen, out_snap, linktype;
+    uint8_t pcap_fh[BUFSIZ], hdr[24];
+    int i, j, n, cnt, started, heap_n, ret;
+    int *heap;
+    cppip_record_t rec;
+    struct merge_input *ins, *in;
+
+    ret     = -1;
+    cnt     = c->input_cnt / 2;
+    started = 0;
+    heap    = NULL;
+    ins = calloc(cnt, sizeof (struct merge_input));
+    if (ins == NULL)
+    {
+        snprintf(c->errbuf, BUFSIZ, "calloc(): %s\n", strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < cnt; i++)
+    {
+        in = &ins[i];
+        pthread_mutex_init(&in->lock, NULL);
+        pthread_cond_init(&in->cond, NULL);
+    }
+
+    /** open every input, check they agree and seek each to the range */
+    for (i = 0; i < cnt; i++)
+    {
+        in = &ins[i];
+        f = extract_source(c->flags, c->inputs[2 * i], c->inputs[2 * i + 1],
+                CPPIP_INDEX_TS, c->errbuf);
+        if (f == NULL)
+        {
+            goto done;
+        }
+        in->f       = f;
+        in->start   = c->e_pkts.ts_start;
+        in->stop    = c->e_pkts.ts_stop;
+        f->filter_s = c->filter_s;
+        if (extract_open(f, pcap_fh) == -1)
+        {
+            memcpy(c->errbuf, f->errbuf, BUFSIZ);
+            goto done;
+        }
+        if (f->pcapng)
+        {
+            snprintf(c->errbuf, BUFSIZ, "%s: can't merge pcapng captures\n",
+                    f->pcap_fname);
+            goto done;
+        }
+        snaplen = extract_fh32(f, pcap_fh + 16);
+        if (i == 0)
+        {
+            memcpy(hdr, pcap_fh, 24);
+            linktype = f->linktype;
+        }
+        else if (f->pcap_magic != ins[0].f->pcap_magic)
+        {
+            /** the packets go out with their headers as they are */
+            snprintf(c->errbuf, BUFSIZ, "%s: pcap magic %08x, not %08x\n",
+                    f->pcap_fname, f->pcap_magic, ins[0].f->pcap_magic);
+            goto done;
+        }
+        else if (f->linktype != linktype)
+        {
+            snprintf(c->errbuf, BUFSIZ, "%s: link type %u, not %u\n",
+                    f->pcap_fname, f->linktype, linktype);
+            goto done;
+        }
+        else
+        {
+            /** the output's snaplen has to cover every input's */
+            out_snap = extract_fh32(f, hdr + 16);
+            if (snaplen > out_snap)
+            {
+                memcpy(hdr + 16, pcap_fh + 16, 4);
+            }
+        }
+        if (index_stream_search_ts(f, &f->ts_stream, &c->e_pkts.ts_start,
+                &rec) == -1)
+        {
+            memcpy(c->errbuf, f->errbuf, BUFSIZ);
+            goto done;
+        }
+        if (bgzf_seek(f->pcap, rec.bgzf_offset, SEEK_SET) == -1)
+        {
+            snprintf(c->errbuf, BUFSIZ, "%s: bgzf_seek() error.\n",
+                    f->pcap_fname);
+            goto done;
+        }
+        for (j = 0; j < MERGE_BATCHES; j++)
+        {
+            in->b[j].buf = malloc(MERGE_BATCH_SIZ);
+            if (in->b[j].buf == NULL)
+            {
+                snprintf(c->errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+                goto done;
+            }
+            in->b[j].siz = MERGE_BATCH_SIZ;
+        }
+    }
+    heap = malloc(cnt * sizeof (int));
+    if (heap == NULL)
+    {
+        snprintf(c->errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+        goto done;
+    }
+    if (extract_write(c, hdr, 24) == -1)
+    {
+        goto done;
+    }
+
+    for (; started < cnt; started++)
+    {
+        if (pthread_create(&ins[started].tid, NULL, merge_reader,
+                &ins[started]))
+        {
+            snprintf(c->errbuf, BUFSIZ, "pthread_create() failed\n");
+            goto done;
+        }
+    }
+
+    /** every input's first packet goes in the heap, in input order */
+    for (heap_n = 0, i = 0; i < cnt; i++)
+    {
+        n = merge_next(&ins[i], c->errbuf);
+        if (n == -1)
+        {
+            goto done;
+        }
+        if (n == 1)
+        {
+            heap[heap_n++] = i;
+        }
+    }
+    for (i = heap_n / 2 - 1; i >= 0; i--)
+    {
+        merge_down(ins, heap, heap_n, i);
+    }
+
+    /** write the earliest packet, replace it with the next from its input */
+    c->e_pkts.pkts_w = 0;
+    while (heap_n)
+    {
+        in = &ins[heap[0]];
+        if (extract_write(c, in->pkt, PCAP_PKTH_SIZ + in->pcap_h.caplen)
+                == -1)
+        {
+            goto done;
+        }
+        c->e_pkts.pkts_w++;
+        n = merge_next(in, c->errbuf);
+        if (n == -1)
+        {
+            goto done;
+        }
+        if (n == 0)
+        {
+            heap[0] = heap[--heap_n];
+        }
+        merge_down(ins, heap, heap_n, 0);
+    }
+    if (extract_close(c) == -1)
+    {
+        goto done;
+    }
+    if (c->flags & CPPIP_CTRL_DEBUG)
+    {
+        fprintf(stderr, "DBG: merged inputs:\t\t%d\n", cnt);
+        if (c->pcap_w)
+        {
+            fprintf(stderr, "DBG: writes:\t\t\t%llu\n",
+                    (unsigned long long)c->pcap_w->writes);
+        }
+    }
+    ret = 1;
+done:
+    for (i = 0; i < started; i++)
+    {
+        in = &ins[i];
+        pthread_mutex_lock(&in->lock);
+        in->quit = 1;
+        pthread_cond_broadcast(&in->cond);
+        pthread_mutex_unlock(&in->lock);
+        pthread_join(in->tid, NULL);
+    }
+    for (i = 0; i < cnt; i++)
+    {
+        in = &ins[i];
+        for (j = 0; j < MERGE_BATCHES; j++)
+        {
+            free(in->b[j].buf);
+        }
+        if (in->f)
+        {
+            control_context_destroy(in->f);
+        }
+        pthread_mutex_destroy(&in->lock);
+        pthread_cond_destroy(&in->cond);
+    }
+    free(heap);
+    free(ins);
+    return ret;
+}
+
+/** EOF */
@@ -0,0 +1,379 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * pcapng.c: pcapng blocks read as packets
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "../include/cppip.h"
+
+/** the IDB options we use */
+#define PCAPNG_OPT_END      0
+#define PCAPNG_OPT_TSRESOL  9
+#define PCAPNG_OPT_TSOFFSET 14
+
+/** the smallest block there is: type, length and length again */
+#define PCAPNG_BLK_MIN      12
+
+static uint16_t
+pcapng_16(cppip_t *c, const uint8_t *p)
+{
+    return c->ng_be ? (uint16_t)(p[0] << 8 | p[1]) : le16dec(p);
+}
+
+static uint32_t
+pcapng_32(cppip_t *c, const uint8_t *p)
+{
+    return c->ng_be ? (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+            (uint32_t)p[2] << 8 | p[3] : le32dec(p);
+}
+
+static uint64_t
+pcapng_64(cppip_t *c, const uint8_t *p)
+{
+    return c->ng_be ? (uint64_t)pcapng_32(c, p) << 32 | pcapng_32(c, p + 4) :
+            le64dec(p);
+}
+
+/** the fraction of a second a timestamp has past its seconds, in nsec */
+static uint32_t
+pcapng_nsec(pcapng_if_t *ifp, uint64_t frac)
+{
+    if (ifp->shift > 34)
+    {
+        /** keep frac * 10^9 in 64 bits, the bits lost are below a nsec */
+        return ((frac >> (ifp->shift - 34)) * 1000000000) >> 34;
+    }
+    if (ifp->shift)
+    {
+        return (frac * 1000000000) >> ifp->shift;
+    }
+    if (ifp->units >= 1000000000)
+    {
+        return frac / (ifp->units / 1000000000);
+    }
+    return frac * (1000000000 / ifp->units);
+}
+
+/** note the interface an IDB describes, p is what follows its length */
+static int
+pcapng_if_add(cppip_t *c, const uint8_t *p, uint32_t len)
+{
+    int k;
+    uint8_t res;
+    uint16_t code, olen;
+    uint32_t off;
+    pcapng_if_t *ifp;
+
+    if (c->ng_if_cnt == PCAPNG_IF_MAX)
+    {
+        snprintf(c->errbuf, BUFSIZ, "%s: more than %d interfaces\n",
+                c->pcap_fname, PCAPNG_IF_MAX);
+        return -1;
+    }
+    ifp = &c->ng_if[c->ng_if_cnt];
+    ifp->linktype = pcapng_16(c, p);
+    ifp->units    = 1000000;
+    ifp->shift    = 0;
+    ifp->tsoffset = 0;
+
+    /** the options come after link type, reserved and snaplen */
+    for (off = 8; off + 4 <= len - 4; off += 4 + ((olen + 3) & ~3))
+    {
+        code = pcapng_16(c, p + off);
+        olen = pcapng_16(c, p + off + 2);
+        if (code == PCAPNG_OPT_END)
+        {
+            break;
+        }
+        if (off + 4 + olen > len - 4)
+        {
+            goto bad_block;
+        }
+        if (code == PCAPNG_OPT_TSRESOL && olen == 1)
+        {
+            /** 10^-res seconds, or 2^-res with the top bit set */
+            res = p[off + 4];
+            if (res & 0x80)
+            {
+                if ((res & 0x7f) > 63)
+                {
+                    goto bad_block;
+                }
+                ifp->shift = res & 0x7f;
+                ifp->units = 1ULL << ifp->shift;
+            }
+            else
+            {
+                if (res > 19)
+                {
+                    goto bad_block;
+                }
+                for (ifp->units = 1, k = 0; k < res; k++)
+                {
+                    ifp->units *= 10;
+                }
+            }
+        }
+        else if (code == PCAPNG_OPT_TSOFFSET && olen == 8)
+        {
+            ifp->tsoffset = (int64_t)pcapng_64(c, p + off + 4);
+        }
+    }
+    c->ng_if_cnt++;
+    return 1;
+bad_block:
+    snprintf(c->errbuf, BUFSIZ, "%s: bad pcapng interface block\n",
+            c->pcap_fname);
+    return -1;
+}
+
+int
+pcapng_open(cppip_t *c, uint8_t *fh)
+{
+    int n;
+    int64_t off;
+    uint32_t type, len, fh_len;
+
+    c->ng_if_cnt = 0;
+    fh_len = 0;
+    for (;;)
+    {
+        if (fh_len + PCAPNG_BLK_MIN > BUFSIZ)
+        {
+            goto too_big;
+        }
+        off = bgzf_tell(c->pcap);
+        n = bgzf_read(c->pcap, fh + fh_len, PCAPNG_BLK_MIN);
+        if (n == 0 && fh_len)
+        {
+            /** not a packet in it */
+            break;
+        }
+        if (n != PCAPNG_BLK_MIN)
+        {
+            goto truncated;
+        }
+
+        /** the section's byte order is in its header */
+        if (fh_len == 0)
+        {
+            c->ng_be = 0;
+            if (pcapng_32(c, fh + 8) != PCAPNG_BOM)
+            {
+                c->ng_be = 1;
+            }
+            if (pcapng_32(c, fh + 8) != PCAPNG_BOM)
+            {
+                snprintf(c->errbuf, BUFSIZ, "%s: bad pcapng byte order\n",
+                        c->pcap_fname);
+                return -1;
+            }
+        }
+        type = pcapng_32(c, fh + fh_len);
+        len  = pcapng_32(c, fh + fh_len + 4);
+        if (type == PCAPNG_EPB || type == PCAPNG_SPB || type == PCAPNG_PB)
+        {
+            /** the first packet, leave it for pcapng_hdr() */
+            if (bgzf_seek(c->pcap, off, SEEK_SET) == -1)
+            {
+                snprintf(c->errbuf, BUFSIZ, "bgzf_seek() error.\n");
+                return -1;
+            }
+            break;
+        }
+        if (type == PCAPNG_SHB && fh_len)
+        {
+            snprintf(c->errbuf, BUFSIZ,
+                    "%s: more than one pcapng section, not supported\n",
+                    c->pcap_fname);
+            return -1;
+        }
+        if (len < PCAPNG_BLK_MIN || (len & 3))
+        {
+            snprintf(c->errbuf, BUFSIZ, "%s: bad pcapng block\n",
+                    c->pcap_fname);
+            return -1;
+        }
+        if (fh_len + len > BUFSIZ)
+        {
+            goto too_big;
+        }
+        if (bgzf_read(c->pcap, fh + fh_len + PCAPNG_BLK_MIN,
+                len - PCAPNG_BLK_MIN) != len - PCAPNG_BLK_MIN)
+        {
+            goto truncated;
+        }
+        if (type == PCAPNG_IDB && pcapng_if_add(c, fh + fh_len +
+                PCAPNG_BH_SIZ, len - PCAPNG_BH_SIZ) == -1)
+        {
+            return -1;
+        }
+        fh_len += len;
+    }
+
+    /** pcapng_hdr() moves it to each packet's interface's as it goes */
+    c->linktype = c->ng_if_cnt ? c->ng_if[0].linktype : 0;
+
+    /** as with a nanosecond pcap, finer than usec is kept in c->pcap_ns */
+    for (n = 0; n < c->ng_if_cnt; n++)
+    {
+        if (c->ng_if[n].units > 1000000)
+        {
+            c->pcap_nsec = 1;
+        }
+    }
+    return fh_len;
+too_big:
+    snprintf(c->errbuf, BUFSIZ,
+            "%s: pcapng blocks before the first packet exceed %d bytes\n",
+            c->pcap_fname, BUFSIZ);
+    return -1;
+truncated:
+    snprintf(c->errbuf, BUFSIZ, "%s: truncated pcapng header\n",
+            c->pcap_fname);
+    return -1;
+}
+
+int
+pcapng_hdr(cppip_t *c, pcap_offline_pkthdr_t *pcap_h)
+{
+    int n;
+    uint32_t type, id, caplen, ns;
+    uint64_t ts;
+    pcapng_if_t *ifp;
+
+    for (;;)
+    {
+        n = extract_bytes(c, c->ng_bh, PCAPNG_BH_SIZ);
+        if (n == 0)
+        {
+            return 0;
+        }
+        if (n != PCAPNG_BH_SIZ)
+        {
+            goto truncated;
+        }
+        type      = pcapng_32(c, c->ng_bh);
+        c->ng_len = pcapng_32(c, c->ng_bh + 4);
+        if (c->ng_len < PCAPNG_BLK_MIN || (c->ng_len & 3))
+        {
+            goto bad_block;
+        }
+        c->ng_blk = extract_view(c, c->ng_len - PCAPNG_BH_SIZ);
+        if (c->ng_blk == NULL)
+        {
+            goto truncated;
+        }
+        if (type == PCAPNG_EPB)
+        {
+            break;
+        }
+        switch (type)
+        {
+            case PCAPNG_SHB:
+                snprintf(c->errbuf, BUFSIZ,
+                        "%s: more than one pcapng section, not supported\n",
+                        c->pcap_fname);
+                return -1;
+            case PCAPNG_IDB:
+                snprintf(c->errbuf, BUFSIZ,
+                        "%s: interface added after the first packet, not "
+                        "supported\n", c->pcap_fname);
+                return -1;
+            case PCAPNG_SPB:
+            case PCAPNG_PB:
+                snprintf(c->errbuf, BUFSIZ,
+                        "%s: simple and obsolete packet blocks aren't "
+                        "supported\n", c->pcap_fname);
+                return -1;
+            default:
+                /** statistics, name resolution and the like */
+                break;
+        }
+    }
+
+    /** interface, timestamp high and low, caplen, len, data, length */
+    if (c->ng_len < PCAPNG_BH_SIZ + PCAPNG_EPB_SIZ + 4)
+    {
+        goto bad_block;
+    }
+    id     = pcapng_32(c, c->ng_blk);
+    ts     = (uint64_t)pcapng_32(c, c->ng_blk + 4) << 32 |
+            pcapng_32(c, c->ng_blk + 8);
+    caplen = pcapng_32(c, c->ng_blk + 12);
+    if (caplen > c->ng_len - (PCAPNG_BH_SIZ + PCAPNG_EPB_SIZ + 4))
+    {
+        goto bad_block;
+    }
+    if (id >= (uint32_t)c->ng_if_cnt)
+    {
+        snprintf(c->errbuf, BUFSIZ, "%s: packet on undescribed interface %u\n",
+                c->pcap_fname, id);
+        return -1;
+    }
+    ifp             = &c->ng_if[id];
+    ns              = pcapng_nsec(ifp, ts % ifp->units);
+    pcap_h->tv_sec  = ts / ifp->units + ifp->tsoffset;
+    pcap_h->tv_usec = ns / 1000;
+    c->pcap_ns      = ns % 1000;
+    pcap_h->caplen  = caplen;
+    pcap_h->len     = pcapng_32(c, c->ng_blk + 16);
+    c->linktype     = ifp->linktype;
+    return PCAP_PKTH_SIZ;
+bad_block:
+    snprintf(c->errbuf, BUFSIZ, "%s: bad pcapng block\n", c->pcap_fname);
+    return -1;
+truncated:
+    snprintf(c->errbuf, BUFSIZ, "%s: truncated pcapng block\n", c->pcap_fname);
+    return -1;
+}
+
+int64_t
+pcapng_walk(cppip_t *c, uint32_t snap, pcap_walk_cb_t cb, void *arg)
+{
+    int n;
+    uint64_t pkt_num, offset;
+    pcap_offline_pkthdr_t pcap_h;
+
+    for (pkt_num = 1; ; pkt_num++)
+    {
+        /**
+         * As with pcap, a packet's offset is where the one before it ends.
+         * Any blocks in between are stepped over again on the way to it.
+         */
+        offset = bgzf_tell(c->pcap);
+        n = extract_hdr(c, &pcap_h);
+        if (n != PCAP_PKTH_SIZ)
+        {
+            break;
+        }
+        if (cb(c, pkt_num, offset, &pcap_h, c->ng_blk + PCAPNG_EPB_SIZ,
+                pcap_h.caplen < snap ? pcap_h.caplen : snap, arg) == -1)
+        {
+            return -1;
+        }
+    }
+    return n == 0 ? (int64_t)pkt_num - 1 : -1;
+}
+
+/** EOF */
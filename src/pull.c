@@ -0,0 +1,445 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * pull.c: packet number ranges extracted on several threads
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "../include/cppip.h"
+#include <pthread.h>
+
+/** compressed bytes between the index records a range is split at */
+#define PULL_CHUNK_SIZ  (1024 * 1024)
+
+/** where a piece of the range starts, the index record we enter it at */
+struct pull_part
+{
+    uint64_t pkt;               /** first packet of the piece */
+    uint64_t rec_pkt;           /** packet the record is for, <= pkt */
+    uint64_t off;               /** the record's virtual offset */
+};
+
+/** a piece extracted to memory, waiting its turn to be written */
+struct pull_chunk
+{
+    uint8_t *buf;               /** pcap headers and packets back to back */
+    size_t siz;                 /** capacity of buf */
+    size_t len;                 /** bytes in buf */
+    uint64_t pkts_w;            /** packets in buf */
+    int done;                   /** filled, the writer can have it */
+};
+
+/** pool shared state */
+struct pull_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /** a chunk was written, or we're done */
+    pthread_cond_t done;        /** a chunk was filled */
+    struct pull_part *parts;    /** cnt pieces and where the range ends */
+    uint64_t cnt;
+    struct pull_chunk *chunks;  /** piece k goes to chunks[k % chunk_n] */
+    int chunk_n;
+    uint64_t next;              /** next piece to hand to a worker */
+    uint64_t written;           /** pieces written so far */
+    int quit;                   /** tell the workers to go home */
+    int err;                    /** a worker failed, see errbuf */
+    char errbuf[BUFSIZ];
+};
+
+/** a worker, its own copy of the context and pcap.gz handle */
+struct pull_worker
+{
+    struct pull_pool *pl;
+    pthread_t tid;
+    cppip_t f;
+};
+
+static int
+pull_add(cppip_t *c, struct pull_part **parts, uint64_t *cnt, uint64_t *siz,
+        uint64_t pkt, uint64_t rec_pkt, uint64_t off)
+{
+    struct pull_part *p;
+
+    if (*cnt == *siz)
+    {
+        p = realloc(*parts, (*siz ? *siz * 2 : 64) * sizeof (struct pull_part));
+        if (p == NULL)
+        {
+            snprintf(c->errbuf, BUFSIZ, "realloc(): %s\n", strerror(errno));
+            return -1;
+        }
+        *parts = p;
+        *siz   = *siz ? *siz * 2 : 64;
+    }
+    (*parts)[*cnt].pkt     = pkt;
+    (*parts)[*cnt].rec_pkt = rec_pkt;
+    (*parts)[*cnt].off     = off;
+    (*cnt)++;
+    return 1;
+}
+
+/**
+ * Split pkt_start - pkt_stop into pieces at index records, a new piece
+ * starting once the records are PULL_CHUNK_SIZ compressed bytes apart. With
+ * a pkt-offset index every packet is a record and the split points are
+ * binary searched for, with pkt-num we take the records there are.
+ */
+static int
+pull_plan(cppip_t *c, struct pull_part **parts, uint64_t *cnt)
+{
+    int64_t i;
+    uint64_t siz, lo, hi, mid, off, last;
+    cppip_record_t rec, target;
+
+    *parts = NULL;
+    *cnt   = 0;
+    siz    = 0;
+    if (c->cppip_h.index_mode & CPPIP_INDEX_EF)
+    {
+        if (index_ef_get(c, c->e_pkts.pkt_start, &off) == -1 ||
+                index_ef_get(c, c->e_pkts.pkt_stop, &last) == -1 ||
+                pull_add(c, parts, cnt, &siz, c->e_pkts.pkt_start,
+                c->e_pkts.pkt_start, off) == -1)
+        {
+            return -1;
+        }
+        lo = c->e_pkts.pkt_start;
+        while ((last >> 16) - (off >> 16) >= PULL_CHUNK_SIZ)
+        {
+            /** the first packet far enough on, pkt_stop is */
+            for (lo = lo + 1, hi = c->e_pkts.pkt_stop; lo < hi; )
+            {
+                mid = lo + (hi - lo) / 2;
+                if (index_ef_get(c, mid, &rec.bgzf_offset) == -1)
+                {
+                    return -1;
+                }
+                if ((rec.bgzf_offset >> 16) - (off >> 16) >= PULL_CHUNK_SIZ)
+                {
+                    hi = mid;
+                }
+                else
+                {
+                    lo = mid + 1;
+                }
+            }
+            if (index_ef_get(c, lo, &off) == -1 ||
+                    pull_add(c, parts, cnt, &siz, lo, lo, off) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    else
+    {
+        target.pkt_num = c->e_pkts.pkt_start;
+        i = index_stream_search(c, &c->pn_stream, CPPIP_REC_F_PKT, &target,
+                &rec);
+        if (i == -1 || pull_add(c, parts, cnt, &siz, c->e_pkts.pkt_start,
+                rec.pkt_num, rec.bgzf_offset) == -1)
+        {
+            return -1;
+        }
+        for (off = rec.bgzf_offset, i++; i < c->pn_stream.rec_cnt; i++)
+        {
+            if (index_stream_get(c, &c->pn_stream, i, &rec) == -1)
+            {
+                return -1;
+            }
+            if (rec.pkt_num > c->e_pkts.pkt_stop)
+            {
+                break;
+            }
+            if ((rec.bgzf_offset >> 16) - (off >> 16) >= PULL_CHUNK_SIZ)
+            {
+                if (pull_add(c, parts, cnt, &siz, rec.pkt_num, rec.pkt_num,
+                        rec.bgzf_offset) == -1)
+                {
+                    return -1;
+                }
+                off = rec.bgzf_offset;
+            }
+        }
+    }
+
+    /** where the last piece ends */
+    if (pull_add(c, parts, cnt, &siz, (uint64_t)c->e_pkts.pkt_stop + 1, 0,
+            0) == -1)
+    {
+        return -1;
+    }
+    (*cnt)--;
+    return 1;
+}
+
+/** extract a piece of the range to memory, filter and all */
+static int
+pull_fill(cppip_t *f, struct pull_part *part, struct pull_chunk *ch)
+{
+    uint64_t i;
+    size_t need, siz;
+    uint8_t *p;
+    const uint8_t *pkt;
+    pcap_offline_pkthdr_t pcap_h;
+
+    ch->len    = 0;
+    ch->pkts_w = 0;
+    if (extract_seek(f, part->off) == -1)
+    {
+        snprintf(f->errbuf, BUFSIZ, "bgzf_seek() error.\n");
+        return -1;
+    }
+    if (part->rec_pkt < part->pkt &&
+            linear_search(f, part->rec_pkt, part->pkt) == -1)
+    {
+        return -1;
+    }
+    for (i = part->pkt; i < part[1].pkt; i++)
+    {
+        if (extract_hdr(f, &pcap_h) != PCAP_PKTH_SIZ)
+        {
+            snprintf(f->errbuf, BUFSIZ, 
+                "bgzf_read() error: cant read pcap hdr\n");
+            return -1;
+        }
+        pkt = extract_read(f, &pcap_h);
+        if (pkt == NULL)
+        {
+            return -1;
+        }
+        if (f->filter && !filter_match(f, pkt, pcap_h.caplen, pcap_h.len))
+        {
+            continue;
+        }
+        need = f->pcapng ? f->ng_len : PCAP_PKTH_SIZ + pcap_h.caplen;
+        if (ch->len + need > ch->siz)
+        {
+            siz = ch->siz ? ch->siz : PULL_CHUNK_SIZ;
+            while (siz < ch->len + need)
+            {
+                siz *= 2;
+            }
+            p = realloc(ch->buf, siz);
+            if (p == NULL)
+            {
+                snprintf(f->errbuf, BUFSIZ, "realloc(): %s\n",
+                        strerror(errno));
+                return -1;
+            }
+            ch->buf = p;
+            ch->siz = siz;
+        }
+        if (f->pcapng)
+        {
+            memcpy(ch->buf + ch->len, f->ng_bh, PCAPNG_BH_SIZ);
+            memcpy(ch->buf + ch->len + PCAPNG_BH_SIZ, f->ng_blk,
+                    f->ng_len - PCAPNG_BH_SIZ);
+        }
+        else
+        {
+            memcpy(ch->buf + ch->len, extract_rh(f, &pcap_h), PCAP_PKTH_SIZ);
+            memcpy(ch->buf + ch->len + PCAP_PKTH_SIZ, pkt, pcap_h.caplen);
+        }
+        ch->len += need;
+        ch->pkts_w++;
+    }
+    return 1;
+}
+
+/**
+ * Worker thread: take the next piece, as long as its chunk has been
+ * written, and fill it. Pieces are taken in order so the writer never
+ * waits on one nobody is working on.
+ */
+static void *
+pull_worker(void *arg)
+{
+    int n;
+    uint64_t k;
+    struct pull_chunk *ch;
+    struct pull_worker *wk;
+    struct pull_pool *pl;
+
+    wk = (struct pull_worker *)arg;
+    pl = wk->pl;
+    for (;;)
+    {
+        pthread_mutex_lock(&pl->lock);
+        while (!pl->quit && pl->next < pl->cnt &&
+                pl->next >= pl->written + pl->chunk_n)
+        {
+            pthread_cond_wait(&pl->work, &pl->lock);
+        }
+        if (pl->quit || pl->next == pl->cnt)
+        {
+            pthread_mutex_unlock(&pl->lock);
+            break;
+        }
+        k = pl->next++;
+        pthread_mutex_unlock(&pl->lock);
+
+        ch = &pl->chunks[k % pl->chunk_n];
+        n  = pull_fill(&wk->f, &pl->parts[k], ch);
+
+        pthread_mutex_lock(&pl->lock);
+        if (n == -1 && !pl->err)
+        {
+            pl->err = 1;
+            memcpy(pl->errbuf, wk->f.errbuf, BUFSIZ);
+        }
+        ch->done = 1;
+        pthread_cond_broadcast(&pl->done);
+        pthread_mutex_unlock(&pl->lock);
+    }
+    return NULL;
+}
+
+int
+pull_extract(cppip_t *c)
+{
+    int i, ret, wk_n, started;
+    uint64_t k;
+    struct pull_pool pl;
+    struct pull_chunk *ch;
+    struct pull_worker *wks;
+
+    ret     = -1;
+    wk_n    = 0;
+    started = 0;
+    wks     = NULL;
+    memset(&pl, 0, sizeof (pl));
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.work, NULL);
+    pthread_cond_init(&pl.done, NULL);
+    if (pull_plan(c, &pl.parts, &pl.cnt) == -1)
+    {
+        goto done;
+    }
+    wk_n       = pl.cnt < (uint64_t)c->threads ? (int)pl.cnt : c->threads;
+    pl.chunk_n = 2 * c->threads;
+    if (c->flags & CPPIP_CTRL_DEBUG)
+    {
+        fprintf(stderr, "DBG: range pieces:\t\t%llu\n",
+                (unsigned long long)pl.cnt);
+    }
+    pl.chunks = calloc(pl.chunk_n, sizeof (struct pull_chunk));
+    wks       = calloc(wk_n, sizeof (struct pull_worker));
+    if (pl.chunks == NULL || wks == NULL)
+    {
+        snprintf(c->errbuf, BUFSIZ, "calloc(): %s\n", strerror(errno));
+        goto done;
+    }
+
+    /** each worker reads the pcap.gz with its own handle, the index is shared */
+    if (c->bcache && c->pcap_id == 0)
+    {
+        c->pcap_id = bcache_id(c->pcap_fd);
+    }
+    for (i = 0; i < wk_n; i++)
+    {
+        memcpy(&wks[i].f, c, sizeof (cppip_t));
+        wks[i].pl          = &pl;
+        wks[i].f.flags    &= ~CPPIP_CTRL_DEBUG;
+        wks[i].f.arena     = NULL;
+        wks[i].f.arena_siz = 0;
+        wks[i].f.ra_off    = 0;
+        wks[i].f.pcap      = bgzf_open_fd(c->pcap_fname,
+                &wks[i].f.pcap_fd);
+        if (wks[i].f.pcap == NULL)
+        {
+            snprintf(c->errbuf, BUFSIZ, "can't open bgzip pcap file %s: %s\n",
+                    c->pcap_fname, strerror(errno));
+            goto done;
+        }
+    }
+    for (; started < wk_n; started++)
+    {
+        if (pthread_create(&wks[started].tid, NULL, pull_worker,
+                &wks[started]) != 0)
+        {
+            snprintf(c->errbuf, BUFSIZ, "pthread_create(): %s\n",
+                    strerror(errno));
+            goto done;
+        }
+    }
+
+    /** write the pieces out as they're filled, in order */
+    for (c->e_pkts.pkts_w = 0, k = 0; k < pl.cnt; k++)
+    {
+        ch = &pl.chunks[k % pl.chunk_n];
+        pthread_mutex_lock(&pl.lock);
+        while (!ch->done && !pl.err)
+        {
+            pthread_cond_wait(&pl.done, &pl.lock);
+        }
+        if (pl.err)
+        {
+            memcpy(c->errbuf, pl.errbuf, BUFSIZ);
+            pthread_mutex_unlock(&pl.lock);
+            goto done;
+        }
+        pthread_mutex_unlock(&pl.lock);
+
+        if (ch->len && extract_write(c, ch->buf, ch->len) == -1)
+        {
+            goto done;
+        }
+        c->e_pkts.pkts_w += ch->pkts_w;
+
+        pthread_mutex_lock(&pl.lock);
+        ch->done = 0;
+        pl.written++;
+        pthread_cond_broadcast(&pl.work);
+        pthread_mutex_unlock(&pl.lock);
+    }
+    ret = 1;
+done:
+    pthread_mutex_lock(&pl.lock);
+    pl.quit = 1;
+    pthread_cond_broadcast(&pl.work);
+    pthread_mutex_unlock(&pl.lock);
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(wks[i].tid, NULL);
+    }
+    for (i = 0; wks && i < wk_n; i++)
+    {
+        if (wks[i].f.pcap)
+        {
+            bgzf_close(wks[i].f.pcap);
+        }
+        free(wks[i].f.arena);
+    }
+    for (i = 0; pl.chunks && i < pl.chunk_n; i++)
+    {
+        free(pl.chunks[i].buf);
+    }
+    free(pl.chunks);
+    free(pl.parts);
+    free(wks);
+    pthread_cond_destroy(&pl.done);
+    pthread_cond_destroy(&pl.work);
+    pthread_mutex_destroy(&pl.lock);
+    return ret;
+}
+
+/** EOF */
@@ -0,0 +1,424 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * serve.c: answer extraction requests on a Unix socket
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "../include/cppip.h"
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/** connections waiting for a worker */
+#define SERVE_BACKLOG   64
+
+/** seconds a client has to send its request */
+#define SERVE_TIMEOUT   10
+
+/** a capture being served, its index verified and mapped once */
+struct serve_capture
+{
+    cppip_t *f;                 /** index and pcap.gz, never read from */
+    char *name;                 /** pcap.gz name with no directory */
+};
+
+struct serve_ctx
+{
+    cppip_t *c;
+    int lfd;                    /** listening socket */
+    struct serve_capture *caps;
+    int cap_cnt;
+};
+
+/** a worker, with its own pcap.gz handles and a context to extract with */
+struct serve_worker
+{
+    struct serve_ctx *s;
+    pthread_t tid;
+    BGZF **pcap;                /** per capture, opened on first use */
+    int *pcap_fd;               /** their file descriptors */
+    uint8_t *arena;             /** kept between requests */
+    size_t arena_siz;
+    cppip_t f;                  /** a capture's context, copied per request */
+};
+
+/** read the request line, returns its length or -1 */
+static int
+serve_getline(int fd, char *buf, int siz)
+{
+    int n, len;
+
+    for (len = 0; len < siz - 1; len += n)
+    {
+        n = read(fd, buf + len, siz - 1 - len);
+        if (n == -1 && errno == EINTR)
+        {
+            n = 0;
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        buf[len + n] = 0;
+        if (strchr(buf + len, '\n'))
+        {
+            len += n;
+            break;
+        }
+    }
+    buf[len] = 0;
+    buf[strcspn(buf, "\r\n")] = 0;
+    return len ? len : -1;
+}
+
+/** a capture by its pcap.gz name as given or with no directory */
+static int
+serve_find(struct serve_ctx *s, char *name)
+{
+    int i;
+
+    for (i = 0; i < s->cap_cnt; i++)
+    {
+        if (strcmp(s->caps[i].f->pcap_fname, name) == 0 ||
+                strcmp(s->caps[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Answer one request. The capture's context is copied so the index stream
+ * cursors and the extract state are the worker's own, the mapped index
+ * underneath is shared.
+ */
+static void
+serve_request(struct serve_worker *wk, int fd)
+{
+    int i, n;
+    writer_t w;
+    cppip_t *f;
+    struct serve_ctx *s;
+    char *p, *ext, *name, line[BUFSIZ], opt_s[BUFSIZ], msg[BUFSIZ + 8];
+
+    s = wk->s;
+    f = &wk->f;
+    memset(&w, 0, sizeof (writer_t));
+    if (serve_getline(fd, line, sizeof (line)) == -1)
+    {
+        return;
+    }
+
+    /** "extract_string capture [filter...]" */
+    p    = line;
+    ext  = strsep(&p, " \t");
+    name = p ? strsep(&p, " \t") : NULL;
+    while (p && (*p == ' ' || *p == '\t'))
+    {
+        p++;
+    }
+    if (name == NULL || *ext == 0 || *name == 0)
+    {
+        snprintf(msg, sizeof (msg), "error: bad request, want "
+                "\"extract_string capture [filter]\"\n");
+        goto err;
+    }
+    i = serve_find(s, name);
+    if (i == -1)
+    {
+        snprintf(msg, sizeof (msg), "error: no such capture %s\n", name);
+        goto err;
+    }
+    if (wk->pcap[i] == NULL)
+    {
+        wk->pcap[i] = bgzf_open_fd(s->caps[i].f->pcap_fname,
+                &wk->pcap_fd[i]);
+        if (wk->pcap[i] == NULL)
+        {
+            snprintf(msg, sizeof (msg), "error: can't open %s: %s\n",
+                    s->caps[i].f->pcap_fname, strerror(errno));
+            goto err;
+        }
+    }
+
+    memcpy(f, s->caps[i].f, sizeof (cppip_t));
+    f->pcap           = wk->pcap[i];
+    f->pcap_fd        = wk->pcap_fd[i];
+    f->arena          = wk->arena;
+    f->arena_siz      = wk->arena_siz;
+    f->pcap_new       = fd;
+    f->pcap_new_fname = "socket";
+    f->bcache         = s->c->bcache;
+    f->ra_depth       = s->c->ra_depth;
+    f->filter_s       = p && *p ? p : NULL;
+    n = -1;
+
+    /** parsing takes the string apart, ext is kept for the log */
+    snprintf(opt_s, sizeof (opt_s), "%s", ext);
+    f->errbuf[0] = '\0';
+    if (opt_parse_extract(opt_s, f) == -1)
+    {
+        /** not every rejection says why */
+        if (f->errbuf[0] == '\0')
+        {
+            snprintf(f->errbuf, BUFSIZ, "invalid extract string: %s\n", ext);
+        }
+        goto out;
+    }
+    if (bgzf_seek(f->pcap, 0, SEEK_SET) == -1)
+    {
+        snprintf(f->errbuf, BUFSIZ, "bgzf_seek() error.\n");
+        goto out;
+    }
+    if (writer_init(&w, fd, -1, WRITER_BUF_SIZ, f->errbuf) == -1)
+    {
+        goto out;
+    }
+    f->pcap_w = &w;
+    n = extract(f);
+out:
+    wk->arena     = f->arena;
+    wk->arena_siz = f->arena_siz;
+    filter_free(f);
+    if (n == -1)
+    {
+        fprintf(stderr, "serve: %s %s: %s", ext, name, f->errbuf);
+        /** nothing has gone out yet, the client can be told why */
+        if (w.bytes == 0)
+        {
+            snprintf(msg, sizeof (msg), "error: %s", f->errbuf);
+            write(fd, msg, strlen(msg));
+        }
+    }
+    else if (f->flags & CPPIP_CTRL_DEBUG)
+    {
+        fprintf(stderr, "DBG: serve: %s %s: %llu bytes\n", ext, name,
+                (unsigned long long)w.bytes);
+    }
+    writer_free(&w);
+    return;
+err:
+    fprintf(stderr, "serve: %s", msg + 7);
+    write(fd, msg, strlen(msg));
+}
+
+/** take connections until the listening socket is shut down */
+static void *
+serve_worker(void *arg)
+{
+    int fd;
+    struct timeval tv;
+    struct serve_worker *wk;
+
+    wk = arg;
+    tv.tv_sec  = SERVE_TIMEOUT;
+    tv.tv_usec = 0;
+    for (;;)
+    {
+        fd = accept(wk->s->lfd, NULL, NULL);
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            break;
+        }
+        /** an idle client can't hold a worker, or shutdown, for long */
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+        serve_request(wk, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/** bind and listen, a socket left behind by an earlier server goes */
+static int
+serve_listen(cppip_t *c)
+{
+    int fd;
+    struct stat stat_buf;
+    struct sockaddr_un sun;
+
+    memset(&sun, 0, sizeof (sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(c->sock_fname) >= sizeof (sun.sun_path))
+    {
+        snprintf(c->errbuf, BUFSIZ, "socket name too long: %s\n",
+                c->sock_fname);
+        return -1;
+    }
+    strcpy(sun.sun_path, c->sock_fname);
+    if (lstat(c->sock_fname, &stat_buf) == 0)
+    {
+        if (!S_ISSOCK(stat_buf.st_mode))
+        {
+            snprintf(c->errbuf, BUFSIZ, "%s exists and isn't a socket\n",
+                    c->sock_fname);
+            return -1;
+        }
+        unlink(c->sock_fname);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        snprintf(c->errbuf, BUFSIZ, "socket(): %s\n", strerror(errno));
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&sun, sizeof (sun)) == -1 ||
+            listen(fd, SERVE_BACKLOG) == -1)
+    {
+        snprintf(c->errbuf, BUFSIZ, "can't listen on %s: %s\n",
+                c->sock_fname, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int
+serve(cppip_t *c)
+{
+    int i, j, ret, sig, started;
+    sigset_t sigs;
+    struct serve_ctx s;
+    struct serve_worker *wks;
+
+    ret     = -1;
+    started = 0;
+    wks     = NULL;
+    memset(&s, 0, sizeof (s));
+    s.c     = c;
+    s.lfd   = -1;
+
+    s.cap_cnt = c->input_cnt / 2;
+    s.caps = calloc(s.cap_cnt, sizeof (struct serve_capture));
+    if (s.caps == NULL)
+    {
+        snprintf(c->errbuf, BUFSIZ, "calloc(): %s\n", strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < s.cap_cnt; i++)
+    {
+        /** requests are answered into a socket, one new pcap per request */
+        s.caps[i].f = extract_source(c->flags &
+                ~(CPPIP_CTRL_BGZF | CPPIP_CTRL_SPLIT), c->inputs[2 * i],
+                c->inputs[2 * i + 1], 0, c->errbuf);
+        if (s.caps[i].f == NULL)
+        {
+            goto done;
+        }
+        s.caps[i].f->pcap_id = bcache_id(s.caps[i].f->pcap_fd);
+        s.caps[i].name = strrchr(c->inputs[2 * i + 1], '/');
+        s.caps[i].name = s.caps[i].name ? s.caps[i].name + 1 :
+                c->inputs[2 * i + 1];
+        fprintf(stderr, "serving %s using %s\n", c->inputs[2 * i + 1],
+                c->inputs[2 * i]);
+    }
+
+    wks = calloc(c->threads, sizeof (struct serve_worker));
+    if (wks == NULL)
+    {
+        snprintf(c->errbuf, BUFSIZ, "calloc(): %s\n", strerror(errno));
+        goto done;
+    }
+    for (i = 0; i < c->threads; i++)
+    {
+        wks[i].s       = &s;
+        wks[i].pcap    = calloc(s.cap_cnt, sizeof (BGZF *));
+        wks[i].pcap_fd = calloc(s.cap_cnt, sizeof (int));
+        if (wks[i].pcap == NULL || wks[i].pcap_fd == NULL)
+        {
+            snprintf(c->errbuf, BUFSIZ, "calloc(): %s\n", strerror(errno));
+            goto done;
+        }
+    }
+    s.lfd = serve_listen(c);
+    if (s.lfd == -1)
+    {
+        goto done;
+    }
+
+    /** a client going away mid answer isn't fatal, the signals are ours */
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    for (; started < c->threads; started++)
+    {
+        if (pthread_create(&wks[started].tid, NULL, serve_worker,
+                &wks[started]))
+        {
+            snprintf(c->errbuf, BUFSIZ, "pthread_create() failed\n");
+            goto done;
+        }
+    }
+    fprintf(stderr, "listening on %s with %d workers...\n", c->sock_fname,
+            c->threads);
+    sigwait(&sigs, &sig);
+    fprintf(stderr, "caught signal %d, shutting down...\n", sig);
+    ret = 1;
+done:
+    /** requests being answered are finished, the rest are refused */
+    if (s.lfd != -1)
+    {
+        shutdown(s.lfd, SHUT_RDWR);
+    }
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(wks[i].tid, NULL);
+    }
+    if (s.lfd != -1)
+    {
+        close(s.lfd);
+        unlink(c->sock_fname);
+    }
+    for (i = 0; wks && i < c->threads; i++)
+    {
+        for (j = 0; wks[i].pcap && j < s.cap_cnt; j++)
+        {
+            if (wks[i].pcap[j])
+            {
+                bgzf_close(wks[i].pcap[j]);
+            }
+        }
+        free(wks[i].pcap);
+        free(wks[i].pcap_fd);
+        free(wks[i].arena);
+    }
+    free(wks);
+    for (i = 0; i < s.cap_cnt; i++)
+    {
+        if (s.caps[i].f)
+        {
+            control_context_destroy(s.caps[i].f);
+        }
+    }
+    free(s.caps);
+    return ret;
+}
+
+/** EOF */
@@ -41,20 +41,62 @@ usage()
     printf("\t\t\tindex a bgzip compressed pcap.gz file using `index_mode`\n");
     printf("\t\t\tindex.cppip will be created or overwritten and packets\n");
     printf("\t\t\twill be indexed at every `index_level` mark.\n");
+    printf("\t\t\tseparate several index_mode:index_level pairs with\n");
+    printf("\t\t\tcommas to build them all in one pass\n");
+    printf("\t\t\tpkt-offset and flow take no index_level, they index\n");
+    printf("\t\t\tevery packet\n");
     printf("\t\t\tinvoke with -I for more information/help on indexing\n");
     printf(" -I\t\t\tprint supported index/extract modes/format guidelines\n");
     printf(" -v index.cppip\t\tverify index file\n");
     printf(" -d index.cppip\t\tdump index file\n");
+    printf(" -c catalog.cppip dir [dir...]\n");
+    printf("\t\t\tcatalog the timestamp indexed pcap.gz files in each\n");
+    printf("\t\t\tdir (index next to it as name.cppip or\n");
+    printf("\t\t\tname.pcap.gz.cppip), only new or changed ones are read\n");
     printf("\nExtracting:\n");
     printf(" -e index_mode:n|n-m index.cppip pcap.gz new.pcap\n");
     printf("\t\t\textract using `index_mode` the nth packet or n-m packets\n");
     printf("\t\t\tfrom pcap.gz into new.pcap\n");
+    printf(" -e flow:proto:addr:port,addr:port index.cppip pcap.gz new.pcap\n");
+    printf("\t\t\textract every packet of a flow, both directions\n");
+    printf(" -e host:addr[:port]|*:port index.cppip pcap.gz new.pcap\n");
+    printf("\t\t\textract every packet to or from a host and/or port\n");
     printf("\t\t\tinvoke with -I for more information/help on extracting\n");
+    printf(" -e ranges:file index.cppip pcap.gz new.pcap\n");
+    printf("\t\t\textract every pkt-num and timestamp range in file, one\n");
+    printf("\t\t\tper line as -e takes them, in one pass over pcap.gz\n");
+    printf(" -s\t\t\twith ranges:, write the nth range to new.pcap.n\n");
+    printf(" -E timestamp:range catalog.cppip new.pcap\n");
+    printf("\t\t\textract a timestamp range from every catalogued pcap.gz\n");
+    printf("\t\t\tfile it touches into new.pcap, in catalog order\n");
+    printf(" -m timestamp:range new.pcap index.cppip pcap.gz [index.cppip pcap.gz...]\n");
+    printf("\t\t\tmerge the packets in a timestamp range from several\n");
+    printf("\t\t\tpcap.gz files into new.pcap in time order\n");
     printf(" -f\t\t\tenable fuzzy matching (timestamp extraction only)\n");
     printf("\t\t\tthis is useful if you don't want to specify exact\n");
     printf("\t\t\toffsets\n");
+    printf(" -F expression\t\tonly write packets matching a BPF filter\n");
+    printf("\t\t\texpression (tcpdump syntax, needs libpcap)\n");
+    printf("\t\t\tnew.pcap can be - for stdout, to pipe into other tools\n");
+    printf(" -z\t\t\twrite new.pcap bgzip compressed, packet number and\n");
+    printf("\t\t\ttimestamp ranges copy whole compressed blocks as they\n");
+    printf("\t\t\tare unless -F is given (a pcapng's statistics and\n");
+    printf("\t\t\tname blocks between the packets are kept then)\n");
+    printf("\nServing:\n");
+    printf(" -S|--serve socket index.cppip pcap.gz [index.cppip pcap.gz...]\n");
+    printf("\t\t\tanswer extraction requests on Unix socket `socket`,\n");
+    printf("\t\t\tone line each: \"extract_string pcap.gz [filter]\",\n");
+    printf("\t\t\twith the pcap, on `threads` workers\n");
     printf("\nGeneral Options:\n");
     printf(" -D\t\t\tenable debug messages\n");
+    printf(" -t threads\t\tuse `threads` worker threads (0 = one per CPU)\n");
+    printf("\t\t\tused to inflate in parallel when indexing and to\n");
+    printf("\t\t\tcompress in parallel with -z and to serve requests\n");
+    printf(" -C megabytes\t\tcache up to `megabytes` of inflated pcap.gz blocks\n");
+    printf("\t\t\tfor extractions that read the same blocks again\n");
+    printf("\t\t\t(--serve caches 64 by default, 0 = no cache)\n");
+    printf(" -R megabytes\t\tkeep `megabytes` of pcap.gz being read ahead\n");
+    printf("\t\t\tof the inflating (default 4, 0 = none)\n");
     printf(" -V\t\t\tprogram version\n");
     printf(" -h\t\t\tthis message\n");
 
@@ -92,19 +134,230 @@ version()
 }
 
 
+BGZF *
+bgzf_open_fd(const char *fname, int *fd)
+{
+    BGZF *f;
+
+    *fd = open(fname, O_RDONLY);
+    if (*fd == -1)
+    {
+        return NULL;
+    }
+    /** bgzf_fdopen() hands the descriptor to the BGZF, it's closed with it */
+    f = bgzf_fdopen(*fd, "r");
+    if (f == NULL)
+    {
+        close(*fd);
+        *fd = -1;
+    }
+    return f;
+}
+
 int
-bgzf_skip(BGZF *f, int skip_bytes)
+bgzf_block_info(int fd, int64_t addr, int *bsize, int *isize)
 {
-    for (; skip_bytes; skip_bytes--)
+    ssize_t n;
+    uint8_t hdr[BGZF_BLOCK_HDR_SIZ], *ftr;
+
+    n = pread(fd, hdr, BGZF_BLOCK_HDR_SIZ, addr);
+    if (n == 0)
+    {
+        return 0;
+    }
+    if (n != BGZF_BLOCK_HDR_SIZ)
     {
-        if (bgzf_getc(f) == -1)
+        return -1;
+    }
+    /** gzip magic and the "BC" subfield where bgzip always puts it */
+    if (hdr[0] != 0x1f || hdr[1] != 0x8b || hdr[12] != 'B' || hdr[13] != 'C')
+    {
+        return -1;
+    }
+    *bsize = (hdr[16] | (hdr[17] << 8)) + 1;
+
+    /** ISIZE is the last 4 bytes of the block, little endian */
+    ftr = hdr;
+    if (pread(fd, ftr, 4, addr + *bsize - 4) != 4)
+    {
+        return -1;
+    }
+    *isize = ftr[0] | (ftr[1] << 8) | (ftr[2] << 16) | (ftr[3] << 24);
+    /** a block never inflates to more than 64KB */
+    if (*isize < 0 || *isize > 0x10000)
+    {
+        return -1;
+    }
+    return 1;
+}
+
+int
+bgzf_goto(BGZF *f, int64_t offset)
+{
+    /** already inflated, just move the block offset */
+    if (f->block_length && f->block_address == offset >> 16 &&
+            (offset & 0xffff) <= f->block_length)
+    {
+        f->block_offset = offset & 0xffff;
+        return 1;
+    }
+    if (bgzf_seek(f, offset, SEEK_SET) == -1)
+    {
+        return -1;
+    }
+    return 1;
+}
+
+int
+bgzf_skip(BGZF *f, int fd, size_t skip_bytes)
+{
+    int avail, bsize, isize;
+    int64_t addr;
+
+    /** no pcap record is longer than a 32-bit caplen */
+    if (skip_bytes > UINT32_MAX)
+    {
+        return -1;
+    }
+
+    /** common case: we land inside the block that's already inflated */
+    avail = f->block_length - f->block_offset;
+    if (skip_bytes == 0 || (avail > 0 && skip_bytes < (size_t)avail))
+    {
+        f->block_offset += skip_bytes;
+        return 1;
+    }
+
+    /**
+     *  We're running off the end of the current block. Rather than inflate
+     *  everything in between, hop from block to block using BSIZE and ISIZE
+     *  and only inflate (via bgzf_seek() + the next read) the block we land
+     *  in.
+     */
+    addr = f->block_address;
+    if (f->block_length)
+    {
+        /** eat what's left of the loaded block, then move past it */
+        skip_bytes -= avail;
+        if (bgzf_block_info(fd, addr, &bsize, &isize) != 1)
         {
             return -1;
         }
+        addr += bsize;
+    }
+    else
+    {
+        /** nothing loaded (fresh seek), block_offset is relative to addr */
+        skip_bytes += f->block_offset;
+    }
+    while (skip_bytes)
+    {
+        /** running into EOF with bytes left to skip is an error */
+        if (bgzf_block_info(fd, addr, &bsize, &isize) != 1)
+        {
+            return -1;
+        }
+        if (skip_bytes < (size_t)isize)
+        {
+            break;
+        }
+        skip_bytes -= isize;
+        addr += bsize;
+    }
+    if (bgzf_seek(f, (addr << 16) | (int64_t)skip_bytes, SEEK_SET) == -1)
+    {
+        return -1;
     }
     return 1;
 }
 
+const uint8_t *
+bgzf_view(BGZF *f, int fd, int len, uint8_t **arena, size_t *arena_siz)
+{
+    int avail, bsize, isize;
+    uint8_t *p;
+
+    if (len <= 0)
+    {
+        return len == 0 ? f->uncompressed_block : NULL;
+    }
+    avail = f->block_length - f->block_offset;
+    if (avail <= 0)
+    {
+        /** nothing left of this block, inflate the next one */
+        if (bgzf_read_block(f) != 0)
+        {
+            return NULL;
+        }
+        avail = f->block_length - f->block_offset;
+    }
+
+    /** common case: it's all in the inflated block, hand out a pointer */
+    if (len <= avail)
+    {
+        p = (uint8_t *)f->uncompressed_block + f->block_offset;
+        f->block_offset += len;
+        if (f->block_offset == f->block_length)
+        {
+            /**
+             * Move on to the next block as bgzf_read() would, so bgzf_tell()
+             * stays right. The inflated data stays until the next read.
+             */
+            if (bgzf_block_info(fd, f->block_address, &bsize, &isize) != 1)
+            {
+                return NULL;
+            }
+            f->block_address += bsize;
+            f->block_offset   = 0;
+            f->block_length   = 0;
+        }
+        return p;
+    }
+
+    /** it straddles blocks, stitch it together in the arena */
+    if ((size_t)len > *arena_siz)
+    {
+        p = realloc(*arena, len);
+        if (p == NULL)
+        {
+            return NULL;
+        }
+        *arena     = p;
+        *arena_siz = len;
+    }
+    if (bgzf_read(f, *arena, len) != len)
+    {
+        return NULL;
+    }
+    return *arena;
+}
+
+void
+bgzf_readahead(BGZF *f, int fd, int64_t *ahead, int depth)
+{
+    int64_t want;
+
+    if (depth == 0)
+    {
+        return;
+    }
+    want = f->block_address + (int64_t)depth * READAHEAD_CHUNK_SIZ;
+    if (*ahead < f->block_address || *ahead > want)
+    {
+        /** we've seeked, what was read ahead is no use */
+        *ahead = f->block_address;
+    }
+    if (want - *ahead < READAHEAD_CHUNK_SIZ)
+    {
+        return;
+    }
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, *ahead, want - *ahead,
+            POSIX_FADV_WILLNEED);
+#endif
+    *ahead = want;
+}
+
 int
 opt_parse_extract(char *opt_s, cppip_t *c)
 {
@@ -126,6 +379,15 @@ opt_parse_extract(char *opt_s, cppip_t *c)
         return -1;
     }
 
+    /** "ranges:file", the ranges to extract are in file, see batch.c */
+    if (strcmp(s, "ranges") == 0)
+    {
+        c->index_mode   = 0;
+        c->ranges_fname = opt_s;
+        free(q);
+        return 1;
+    }
+
     /** validate the indexing mode */
     for (c->index_mode = -1, i = 0; index_modes[i]; i++)
     {
@@ -143,9 +405,22 @@ opt_parse_extract(char *opt_s, cppip_t *c)
     }
     switch (c->index_mode)
     {
+        /** extracting by packet offset is extracting by packet number */
+        case CPPIP_INDEX_EF:
+            c->index_mode = CPPIP_INDEX_PN;
+            /* FALLTHROUGH */
         case CPPIP_INDEX_PN:
             return pkt_range_check(opt_s, &(c->e_pkts.pkt_start), 
                         &(c->e_pkts.pkt_stop));
+        case CPPIP_INDEX_FLOW:
+            return flow_parse(opt_s, &c->e_pkts.flow, c->errbuf);
+        case CPPIP_INDEX_HOST:
+            return host_parse(opt_s, &c->e_pkts.host, c->errbuf);
+        case CPPIP_INDEX_BYTES:
+            /** a bytes index is searched by pkt-num and timestamp */
+            snprintf(c->errbuf, BUFSIZ, "invalid extract string: %s\n", q);
+            free(q);
+            return -1;
         case CPPIP_INDEX_TS:
             memset(&tm_s, 0, sizeof (struct tm));
             memset(&tm_e, 0, sizeof (struct tm));
@@ -199,87 +474,147 @@ opt_parse_extract(char *opt_s, cppip_t *c)
 int
 opt_parse_index(char *opt_s, cppip_t *c)
 {
-    int i;
-    char *s, *q;
+    int i, mode;
+    char *s, *t, *q;
 
-    /** expects a string of the form: "index_mode:index_level\n\0" */
+    /** 
+     *  expects a string of the form: "index_mode:index_level\n\0" or a comma
+     *  separated list of them to build several indices in one pass, ie:
+     *  "pkt-num:1000,timestamp:1s"
+     */
     q = strdup(opt_s);
-    s = strsep(&opt_s, ":");
-    if (s == NULL || opt_s == NULL)
+    for (c->index_mode = 0; (t = strsep(&opt_s, ",")); )
     {
-        snprintf(c->errbuf, BUFSIZ, "empty index string\n");
-        return -1;
-    }
+        s = strsep(&t, ":");
 
-    /** validate the indexing mode */
-    for (c->index_mode = -1, i = 0; index_modes[i]; i++)
-    {
-        if (strncmp(index_modes[i], s, strlen(index_modes[i])) == 0)
+        /** validate the indexing mode */
+        for (mode = -1, i = 0; index_modes[i]; i++)
         {
-            c->index_mode = index_types[i];
-            break;
+            if (strncmp(index_modes[i], s, strlen(index_modes[i])) == 0)
+            {
+                mode = index_types[i];
+                break;
+            }
         }
-    }
-    if (c->index_mode == -1 || strlen(opt_s) < 1)
-    {
-        snprintf(c->errbuf, BUFSIZ, "invalid index string: %s\n", q);
-        free(q);
-        return -1;
-    }
-    switch (c->index_mode)
-    {
-        case CPPIP_INDEX_PN:
-            for (i = 0; opt_s[i]; i++)
+        /** pkt-offset and flow record every packet, no index_level */
+        if (mode == CPPIP_INDEX_EF || mode == CPPIP_INDEX_FLOW)
+        {
+            if (t != NULL || (c->index_mode & mode))
             {
-                if (isdigit(opt_s[i]) == 0)
+                snprintf(c->errbuf, BUFSIZ, "invalid index string: %s\n", q);
+                free(q);
+                return -1;
+            }
+            c->index_mode |= mode;
+            continue;
+        }
+        if (t == NULL)
+        {
+            snprintf(c->errbuf, BUFSIZ, "empty index string\n");
+            free(q);
+            return -1;
+        }
+        if (mode == -1 || strlen(t) < 1 || (c->index_mode & mode))
+        {
+            snprintf(c->errbuf, BUFSIZ, "invalid index string: %s\n", q);
+            free(q);
+            return -1;
+        }
+        c->index_mode |= mode;
+        switch (mode)
+        {
+            case CPPIP_INDEX_PN:
+            case CPPIP_INDEX_HOST:
+                for (i = 0; t[i]; i++)
                 {
-                    snprintf(c->errbuf, BUFSIZ, "invalid index string: %s\n", 
+                    if (isdigit(t[i]) == 0)
+                    {
+                        snprintf(c->errbuf, BUFSIZ, 
+                                "invalid index string: %s\n", q);
+                        free(q);
+                        return -1;
+                    }
+                }
+                if (mode == CPPIP_INDEX_PN)
+                {
+                    c->index_level.num = strtol(t, NULL, 10);
+                    break;
+                }
+                c->index_level.host = strtol(t, NULL, 10);
+                if (c->index_level.host == 0)
+                {
+                    snprintf(c->errbuf, BUFSIZ, "invalid index string: %s\n",
                             q);
                     free(q);
                     return -1;
                 }
-            }
-            c->index_level.num = strtol(opt_s, NULL, 10);
-            break;
-        case CPPIP_INDEX_TS:
-            switch (opt_s[strlen(opt_s) - 1])
-            {
-                /** days */
-                case 'd':
-                    c->index_level.ts.tv_sec  = 60 * 60 * 24 * 
-                                                strtol(opt_s, NULL, 10);
-                    c->index_level.ts.tv_usec = 0;
-                    break;
-                /** hours */
-                case 'h':
-                    c->index_level.ts.tv_sec = 60 * 60 * 
-                                               strtol(opt_s, NULL, 10);
-                    c->index_level.ts.tv_usec = 0;
-                    break;
-                /** minutes */
-                case 'm':
-                    c->index_level.ts.tv_sec = 60 * strtol(opt_s, NULL, 10);
-                    c->index_level.ts.tv_usec = 0;
-                    break;
-                /** seconds */
-                case 's':
-                    c->index_level.ts.tv_sec  = strtol(opt_s, NULL, 10);
-                    c->index_level.ts.tv_usec = 0;
-                    break;
-                /** microseconds */
-                case 'u': 
-                    c->index_level.ts.tv_sec  = 0;
-                    c->index_level.ts.tv_usec = strtol(opt_s, NULL, 10);
+                break;
+            case CPPIP_INDEX_BYTES:
+                if (strcmp(t, "block") == 0)
+                {
+                    c->index_level.bytes = 0;
                     break;
-                default:
-                    snprintf(c->errbuf, BUFSIZ, 
-                            "invalid index specifier: `%c`\n", 
-                            opt_s[strlen(opt_s) - 1]);
+                }
+                c->index_level.bytes = strtoull(t, &s, 10);
+                if (*s == 'k')
+                {
+                    c->index_level.bytes *= 1024;
+                    s++;
+                }
+                else if (*s == 'm')
+                {
+                    c->index_level.bytes *= 1024 * 1024;
+                    s++;
+                }
+                if (isdigit(t[0]) == 0 || *s || c->index_level.bytes == 0)
+                {
+                    snprintf(c->errbuf, BUFSIZ, "invalid index string: %s\n",
+                            q);
                     free(q);
                     return -1;
-            }
-            break;
+                }
+                break;
+            case CPPIP_INDEX_TS:
+                switch (t[strlen(t) - 1])
+                {
+                    /** days */
+                    case 'd':
+                        c->index_level.ts.tv_sec  = 60 * 60 * 24 * 
+                                                    strtol(t, NULL, 10);
+                        c->index_level.ts.tv_usec = 0;
+                        break;
+                    /** hours */
+                    case 'h':
+                        c->index_level.ts.tv_sec = 60 * 60 * 
+                                                   strtol(t, NULL, 10);
+                        c->index_level.ts.tv_usec = 0;
+                        break;
+                    /** minutes */
+                    case 'm':
+                        c->index_level.ts.tv_sec = 60 * strtol(t, NULL, 10);
+                        c->index_level.ts.tv_usec = 0;
+                        break;
+                    /** seconds */
+                    case 's':
+                        c->index_level.ts.tv_sec  = strtol(t, NULL, 10);
+                        c->index_level.ts.tv_usec = 0;
+                        break;
+                    /** microseconds */
+                    case 'u': 
+                        c->index_level.ts.tv_sec  = 0;
+                        c->index_level.ts.tv_usec = strtol(t, NULL, 10);
+                        break;
+                    default:
+                        snprintf(c->errbuf, BUFSIZ, 
+                                "invalid index specifier: `%c`\n", 
+                                t[strlen(t) - 1]);
+                        free(q);
+                        return -1;
+                }
+                break;
+        }
     }
+    free(q);
     return 1;
 }
 
@@ -287,19 +622,20 @@ char *
 ctime_usec(struct timeval *ts)
 {
     time_t time;
-    struct tm *timetm;
+    struct tm timetm;
     char *s, tmbuf[64];
-    static uint32_t which;
-    static char buf2[64];
-    static char buf[64];
+    /** per thread, the server's workers format timestamps concurrently */
+    static __thread uint32_t which;
+    static __thread char buf2[64];
+    static __thread char buf[64];
 
     which++;
 
     s = (which % 2) ? buf : buf2;
 
     time = ts->tv_sec;
-    timetm = localtime(&time);
-    strftime(tmbuf, sizeof (tmbuf), "%Y-%m-%d %H:%M:%S", timetm);
+    localtime_r(&time, &timetm);
+    strftime(tmbuf, sizeof (tmbuf), "%Y-%m-%d %H:%M:%S", &timetm);
     snprintf(s, 64, "%s.%06d", tmbuf, ts->tv_usec);
     return s;
 }
@@ -332,7 +668,7 @@ uint32_t *s, uint32_t *u)
 }
 
 int
-pkt_range_check(char *pkt_range, uint32_t *pkt_start, uint32_t *pkt_stop)
+pkt_range_check(char *pkt_range, uint64_t *pkt_start, uint64_t *pkt_stop)
 {
     uint8_t legal_tokens[] = "0123456789-";
     char buf[BUFSIZ], *p;
@@ -358,7 +694,7 @@ pkt_range_check(char *pkt_range, uint32_t *pkt_start, uint32_t *pkt_stop)
     p = buf;
 
     /** still subject to some abuse, this works for most cases */
-    *pkt_start = strtol(pkt_range, &p, 10);
+    *pkt_start = strtoull(pkt_range, &p, 10);
     if (*pkt_start == 0)
     {
         return -1;
@@ -366,7 +702,7 @@ pkt_range_check(char *pkt_range, uint32_t *pkt_start, uint32_t *pkt_stop)
     if (p[0] == '-')
     {
         p++;
-        *pkt_stop = strtol(p, NULL, 10);
+        *pkt_stop = strtoull(p, NULL, 10);
     }
     else
     {
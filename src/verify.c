@@ -29,9 +29,25 @@ int
 index_verify(cppip_t *c, int mode)
 {
     int n;
-    uint8_t type;
+    uint8_t type, peek[8];
     struct stat stat_buf;
 
+    /** both formats start with the magic number and major version */
+    if (pread(c->index, peek, sizeof (peek), 0) != sizeof (peek))
+    {
+        snprintf(c->errbuf, BUFSIZ, 
+            "%s is too small to be a valid cppip index\n", c->index_fname);
+        return -1;
+    }
+    if (le32dec(peek) == CPPIP_MAGIC && peek[4] == CPPIP_FORMAT_V2)
+    {
+        if (index_verify_v2(c) == -1)
+        {
+            return -1;
+        }
+        goto verified;
+    }
+
     /** sanity check */
     if (fstat(c->index, &stat_buf) == -1)
     {
@@ -113,13 +129,47 @@ index_verify(cppip_t *c, int mode)
                 return -1;
         }
     }
+
+    /** v1 records are fixed size and read in place */
+    c->format  = CPPIP_FORMAT_V1;
+    c->pkt_cnt = c->cppip_h.pkt_cnt;
+    c->pn_stream.mode    = CPPIP_INDEX_PN;
+    c->pn_stream.fields  = CPPIP_REC_F_PKT | CPPIP_REC_F_OFF;
+    c->pn_stream.rec_cnt = c->cppip_index_pn_hdr.rec_cnt;
+    c->pn_stream.v1_off  = index_records_offset(c, CPPIP_INDEX_PN);
+    c->ts_stream.mode    = CPPIP_INDEX_TS;
+    c->ts_stream.fields  = CPPIP_REC_F_TS | CPPIP_REC_F_OFF;
+    c->ts_stream.rec_cnt = c->cppip_index_ts_hdr.rec_cnt;
+    c->ts_stream.v1_off  = index_records_offset(c, CPPIP_INDEX_TS);
+verified:
     if (mode & V_DETAILED)
     {
-        index_print_info(c, type);
+        index_print_info(c, c->cppip_h.index_mode);
     }
     if (mode & V_DUMP)
     {
-        return index_dump(c, type);
+        return index_dump(c, c->cppip_h.index_mode);
+    }
+
+    /**
+     *  A bytes index answers pkt-num and timestamp lookups as well. It
+     *  stands in for either index when there's none or it's the finer of
+     *  the two, and as far as extracting goes the index then has that mode.
+     */
+    if (c->by_stream.dir)
+    {
+        if ((c->by_stream.fields & CPPIP_REC_F_PKT) &&
+                c->by_stream.rec_cnt > c->pn_stream.rec_cnt)
+        {
+            c->pn_stream = c->by_stream;
+            c->cppip_h.index_mode |= CPPIP_INDEX_PN;
+        }
+        if ((c->by_stream.fields & CPPIP_REC_F_TS) &&
+                c->by_stream.rec_cnt > c->ts_stream.rec_cnt)
+        {
+            c->ts_stream = c->by_stream;
+            c->cppip_h.index_mode |= CPPIP_INDEX_TS;
+        }
     }
     return 1;
 }
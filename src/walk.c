@@ -0,0 +1,713 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * walk.c: pcap packet walkers
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "../include/cppip.h"
+#include <pthread.h>
+
+/** compressed bytes read per batch, per worker thread */
+#define WALK_CHUNK_SIZ  (1024 * 1024)
+
+/** a single BGZF block inside a batch */
+struct walk_block
+{
+    int64_t addr;               /** compressed file offset of the block */
+    uint32_t coff;              /** offset of the block in the batch cbuf */
+    uint32_t bsize;             /** total compressed size */
+    uint32_t isize;             /** uncompressed size */
+    uint64_t uoff;              /** offset of the inflated data in ubuf */
+};
+
+/** a run of whole BGZF blocks read with one pread() and inflated together */
+struct walk_batch
+{
+    uint8_t *cbuf;              /** compressed bytes */
+    size_t cbuf_siz;            /** capacity of cbuf */
+    uint8_t *ubuf;              /** inflated bytes, blocks back to back */
+    uint64_t usiz;              /** bytes they'll take */
+    struct walk_block *blks;    /** blocks in this batch */
+    int blks_siz;               /** capacity of blks */
+    int n;                      /** number of blocks in this batch */
+    int next;                   /** next block to hand to a worker */
+    int done;                   /** number of blocks inflated */
+    int err;                    /** set if a worker failed to inflate */
+};
+
+/** worker pool shared state */
+struct walk_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /** signalled when a batch is posted */
+    pthread_cond_t idle;        /** signalled when a batch is inflated */
+    struct walk_batch *cur;     /** batch being inflated, if any */
+    int shutdown;               /** tell the workers to go home */
+    int err;                    /** a worker couldn't start, don't wait */
+};
+
+/** where batches are inflated to, two so one can be walked meanwhile */
+struct walk_ubuf
+{
+    uint8_t *buf;
+    size_t siz;
+};
+
+/**
+ * Batches read ahead of the inflaters by a thread of their own, so the
+ * disk is kept busy while blocks are inflated and packets walked. With a
+ * depth of 0 there's no thread and each batch is read when it's needed.
+ */
+struct walk_ra
+{
+    int fd;                     /** the pcap.gz */
+    int64_t addr;               /** where the next batch starts */
+    size_t chunk;               /** compressed bytes per batch */
+    struct walk_batch *ring;    /** depth + 2 batches */
+    int ring_n;
+    int threaded;               /** the reader thread is running */
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /** a batch was read or given back */
+    uint64_t loaded;            /** batches read so far */
+    uint64_t released;          /** batches walked and given back */
+    int eof;                    /** nothing more to read, or err */
+    int err;                    /** the read failed, see errbuf */
+    int quit;                   /** the walk is over */
+    char errbuf[BUFSIZ];
+};
+
+/** packet boundary state carried from block to block */
+struct walk_state
+{
+    uint64_t need;              /** bytes left to skip in the current packet */
+    uint8_t hdr[PCAP_PKTH_SIZ]; /** pcap header, may straddle blocks */
+    pcap_offline_pkthdr_t pcap_h; /** hdr, decoded */
+    uint32_t ns;                /** its nanoseconds */
+    uint32_t hdr_have;          /** bytes of hdr we have so far */
+    uint64_t hdr_off;           /** virtual offset of the header */
+    uint64_t pkt_num;           /** packets seen so far */
+    uint8_t *snap_buf;          /** leading packet bytes for the callback */
+    uint32_t snap;              /** how many the callback wants */
+    uint32_t snap_want;         /** bytes of the current packet we want */
+    uint32_t snap_have;         /** bytes of it we have so far */
+};
+
+int64_t
+pcap_walk(cppip_t *c, uint32_t snap, pcap_walk_cb_t cb, void *arg)
+{
+    int n;
+    uint32_t len;
+    uint64_t pkt_num;
+    uint64_t offset;
+    int64_t ahead;
+    uint8_t *data;
+    pcap_offline_pkthdr_t pcap_h;
+
+    if (c->pcapng)
+    {
+        return pcapng_walk(c, snap, cb, arg);
+    }
+    if (c->threads > 1)
+    {
+        return pcap_walk_mt(c, snap, cb, arg);
+    }
+    data = malloc(snap ? snap : 1);
+    if (data == NULL)
+    {
+        snprintf(c->errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+        return -1;
+    }
+    ahead = 0;
+    for (pkt_num = 1; ; pkt_num++)
+    {
+        /**  ...[pcap packet header][packet]...
+         *      ^
+         *      bgzf fp is pointing here, the BGZF offset to this
+         *      packet.. This is the offset we hand to the callback
+         */
+        offset = bgzf_tell(c->pcap);
+        bgzf_readahead(c->pcap, c->pcap_fd, &ahead, c->ra_depth);
+        n = bgzf_read(c->pcap, &pcap_h, PCAP_PKTH_SIZ);
+        if (n == 0)
+        {
+            /* all done */
+            break;
+        }
+        if (n != PCAP_PKTH_SIZ)
+        {
+            snprintf(c->errbuf, BUFSIZ, "bgzf_read() error\n");
+            break;
+        }
+        c->pcap_ns = c->pcap_dec(&pcap_h);
+        len = pcap_h.caplen < snap ? pcap_h.caplen : snap;
+        if (len && bgzf_read(c->pcap, data, len) != len)
+        {
+            snprintf(c->errbuf, BUFSIZ, "bgzf_read() error\n");
+            break;
+        }
+        if (cb(c, pkt_num, offset, &pcap_h, data, len, arg) == -1)
+        {
+            break;
+        }
+        /** we don't care about the rest -- we skip past the packet */
+        if (bgzf_skip(c->pcap, c->pcap_fd, pcap_h.caplen - len) == -1)
+        {
+            snprintf(c->errbuf, BUFSIZ, "bgzf_skip() error\n");
+            break;
+        }
+    }
+    free(data);
+    return n == 0 ? (int64_t)pkt_num - 1 : -1;
+}
+
+static void *
+walk_worker(void *arg)
+{
+    int i;
+    z_stream zs;
+    struct walk_block *b;
+    struct walk_batch *batch;
+    struct walk_pool *pool;
+
+    pool = (struct walk_pool *)arg;
+    memset(&zs, 0, sizeof (zs));
+    if (inflateInit2(&zs, -15) != Z_OK)
+    {
+        /** the blocks we'd have inflated never will be, wake the walk */
+        pthread_mutex_lock(&pool->lock);
+        pool->err = 1;
+        pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (!pool->shutdown &&
+                (pool->cur == NULL || pool->cur->next == pool->cur->n))
+        {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->shutdown)
+        {
+            break;
+        }
+        batch = pool->cur;
+        i     = batch->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        /** inflate outside the lock, this is where the time goes */
+        b = &batch->blks[i];
+        inflateReset(&zs);
+        zs.next_in   = batch->cbuf + b->coff + BGZF_BLOCK_HDR_SIZ;
+        zs.avail_in  = b->bsize - BGZF_BLOCK_HDR_SIZ - BGZF_BLOCK_FTR_SIZ;
+        zs.next_out  = batch->ubuf + b->uoff;
+        zs.avail_out = b->isize;
+        if (b->isize && (inflate(&zs, Z_FINISH) != Z_STREAM_END ||
+                zs.total_out != b->isize))
+        {
+            batch->err = 1;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (++batch->done == batch->n)
+        {
+            pthread_cond_signal(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    inflateEnd(&zs);
+    return NULL;
+}
+
+/**
+ * Fill a batch with as many whole blocks as fit in one chunk starting at
+ * addr. Returns the number of blocks read (0 at EOF) or -1 on error, addr is
+ * advanced past the last whole block.
+ */
+static int
+walk_batch_load(int fd, struct walk_batch *batch, size_t chunk,
+        int64_t *addr, char *errbuf)
+{
+    ssize_t n;
+    uint8_t *p, *q;
+    uint32_t o, bsize, isize;
+    uint64_t usiz;
+    struct walk_block *b;
+
+    if (batch->cbuf_siz < chunk)
+    {
+        batch->cbuf = realloc(batch->cbuf, chunk);
+        if (batch->cbuf == NULL)
+        {
+            snprintf(errbuf, BUFSIZ, "realloc(): %s\n", strerror(errno));
+            return -1;
+        }
+        batch->cbuf_siz = chunk;
+    }
+    n = pread(fd, batch->cbuf, chunk, *addr);
+    if (n == -1)
+    {
+        snprintf(errbuf, BUFSIZ, "pread(): %s\n", strerror(errno));
+        return -1;
+    }
+
+    /** carve the chunk up into blocks, a partial block waits for next time */
+    for (batch->n = 0, o = 0, usiz = 0; o + BGZF_BLOCK_HDR_SIZ <= n; )
+    {
+        p     = batch->cbuf + o;
+        bsize = (p[16] | (p[17] << 8)) + 1;
+        if (p[0] != 0x1f || p[1] != 0x8b || p[12] != 'B' || p[13] != 'C' ||
+                bsize < BGZF_BLOCK_HDR_SIZ + BGZF_BLOCK_FTR_SIZ)
+        {
+            snprintf(errbuf, BUFSIZ, "bad BGZF block header at %llx\n",
+                    (unsigned long long)(*addr + o));
+            return -1;
+        }
+        if (o + bsize > n)
+        {
+            break;
+        }
+        /** a block never inflates to more than 64KB */
+        q     = p + bsize - 4;
+        isize = q[0] | (q[1] << 8) | (q[2] << 16) | ((uint32_t)q[3] << 24);
+        if (isize > BGZF_BLOCK_MAX_SIZ)
+        {
+            snprintf(errbuf, BUFSIZ, "bad BGZF block header at %llx\n",
+                    (unsigned long long)(*addr + o));
+            return -1;
+        }
+        if (batch->n == batch->blks_siz)
+        {
+            batch->blks_siz = batch->blks_siz ? batch->blks_siz * 2 : 256;
+            batch->blks = realloc(batch->blks,
+                    batch->blks_siz * sizeof (struct walk_block));
+            if (batch->blks == NULL)
+            {
+                snprintf(errbuf, BUFSIZ, "realloc(): %s\n",
+                        strerror(errno));
+                return -1;
+            }
+        }
+        b = &batch->blks[batch->n++];
+        b->addr  = *addr + o;
+        b->coff  = o;
+        b->bsize = bsize;
+        b->isize = isize;
+        b->uoff  = usiz;
+        usiz    += b->isize;
+        o       += b->bsize;
+    }
+    if (batch->n == 0 && n)
+    {
+        snprintf(errbuf, BUFSIZ, "truncated BGZF block at %llx\n",
+                (unsigned long long)*addr);
+        return -1;
+    }
+    batch->usiz = usiz;
+    batch->next = batch->done = batch->err = 0;
+    *addr += o;
+    return batch->n;
+}
+
+/** the reader: keeps up to ring_n batches read and not yet walked */
+static void *
+walk_reader(void *arg)
+{
+    int n;
+    struct walk_batch *batch;
+    struct walk_ra *ra;
+
+    ra = (struct walk_ra *)arg;
+    pthread_mutex_lock(&ra->lock);
+    for (;;)
+    {
+        while (!ra->quit && ra->loaded - ra->released == (uint64_t)ra->ring_n)
+        {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        }
+        if (ra->quit)
+        {
+            break;
+        }
+        batch = &ra->ring[ra->loaded % ra->ring_n];
+        pthread_mutex_unlock(&ra->lock);
+
+        /** the read, while the inflaters and the walk get on with theirs */
+        n = walk_batch_load(ra->fd, batch, ra->chunk, &ra->addr, ra->errbuf);
+
+        pthread_mutex_lock(&ra->lock);
+        if (n <= 0)
+        {
+            ra->eof = 1;
+            ra->err = n == -1;
+            pthread_cond_broadcast(&ra->cond);
+            break;
+        }
+        ra->loaded++;
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+/** the kth batch, read, NULL at EOF or on error */
+static struct walk_batch *
+walk_ra_get(struct walk_ra *ra, uint64_t k)
+{
+    int n;
+    struct walk_batch *batch;
+
+    if (!ra->threaded)
+    {
+        if (ra->eof)
+        {
+            return NULL;
+        }
+        batch = &ra->ring[k % ra->ring_n];
+        n = walk_batch_load(ra->fd, batch, ra->chunk, &ra->addr, ra->errbuf);
+        if (n <= 0)
+        {
+            ra->eof = 1;
+            ra->err = n == -1;
+            return NULL;
+        }
+        ra->loaded++;
+        return batch;
+    }
+    pthread_mutex_lock(&ra->lock);
+    while (ra->loaded <= k && !ra->eof)
+    {
+        pthread_cond_wait(&ra->cond, &ra->lock);
+    }
+    batch = ra->loaded > k ? &ra->ring[k % ra->ring_n] : NULL;
+    pthread_mutex_unlock(&ra->lock);
+    return batch;
+}
+
+/** done walking the oldest batch, the reader can have its slot */
+static void
+walk_ra_put(struct walk_ra *ra)
+{
+    pthread_mutex_lock(&ra->lock);
+    ra->released++;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+/** give a batch somewhere to inflate to */
+static int
+walk_ubuf(struct walk_ubuf *ub, struct walk_batch *batch, char *errbuf)
+{
+    uint8_t *p;
+
+    if (ub->siz < batch->usiz)
+    {
+        p = realloc(ub->buf, batch->usiz);
+        if (p == NULL)
+        {
+            snprintf(errbuf, BUFSIZ, "realloc(): %s\n", strerror(errno));
+            return -1;
+        }
+        ub->buf = p;
+        ub->siz = batch->usiz;
+    }
+    batch->ubuf = ub->buf;
+    return 1;
+}
+
+/** a packet's header and wanted bytes are in, hand them over */
+static int
+walk_cb(cppip_t *c, struct walk_state *s, pcap_walk_cb_t cb, void *arg)
+{
+    pcap_offline_pkthdr_t pcap_h;
+
+    pcap_h     = s->pcap_h;
+    c->pcap_ns = s->ns;
+    return cb(c, ++s->pkt_num, s->hdr_off, &pcap_h, s->snap_buf,
+            s->snap_want, arg);
+}
+
+/**
+ * Walk the packets of one inflated batch, carrying the packet boundary
+ * state across block boundaries. Runs on the main thread, in block order.
+ */
+static int
+walk_batch_packets(cppip_t *c, struct walk_batch *batch, struct walk_state *s,
+        pcap_walk_cb_t cb, void *arg)
+{
+    int i;
+    uint8_t *data;
+    uint32_t o, k;
+    struct walk_block *b;
+
+    for (i = 0; i < batch->n; i++)
+    {
+        b    = &batch->blks[i];
+        data = batch->ubuf + b->uoff;
+        for (o = 0; o < b->isize; )
+        {
+            /** collecting the bytes the callback wants, then call it */
+            if (s->snap_have < s->snap_want)
+            {
+                k = s->snap_want - s->snap_have;
+                k = (k < b->isize - o) ? k : b->isize - o;
+                memcpy(s->snap_buf + s->snap_have, data + o, k);
+                s->snap_have += k;
+                s->need      -= k;
+                o            += k;
+                if (s->snap_have == s->snap_want &&
+                        walk_cb(c, s, cb, arg) == -1)
+                {
+                    return -1;
+                }
+                continue;
+            }
+            /** still inside the previous packet's payload */
+            if (s->need)
+            {
+                k = (s->need < b->isize - o) ? s->need : b->isize - o;
+                s->need -= k;
+                o       += k;
+                continue;
+            }
+            if (s->hdr_have == 0)
+            {
+                s->hdr_off = ((uint64_t)b->addr << 16) | o;
+            }
+            k = PCAP_PKTH_SIZ - s->hdr_have;
+            k = (k < b->isize - o) ? k : b->isize - o;
+            memcpy(s->hdr + s->hdr_have, data + o, k);
+            s->hdr_have += k;
+            o           += k;
+            if (s->hdr_have == PCAP_PKTH_SIZ)
+            {
+                memcpy(&s->pcap_h, s->hdr, PCAP_PKTH_SIZ);
+                s->ns        = c->pcap_dec(&s->pcap_h);
+                s->need      = s->pcap_h.caplen;
+                s->hdr_have  = 0;
+                s->snap_want = (s->pcap_h.caplen < s->snap) ?
+                        s->pcap_h.caplen : s->snap;
+                s->snap_have = 0;
+                if (s->snap_want == 0 && walk_cb(c, s, cb, arg) == -1)
+                {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+/** hand a loaded batch to the workers */
+static void
+walk_post(struct walk_pool *pool, struct walk_batch *batch)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->cur = batch;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/** wait for the workers to finish inflating a batch, -1 if one can't */
+static int
+walk_wait(struct walk_pool *pool, struct walk_batch *batch)
+{
+    int err;
+
+    pthread_mutex_lock(&pool->lock);
+    while (batch->done != batch->n && !pool->err)
+    {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pool->cur = NULL;
+    err       = pool->err;
+    pthread_mutex_unlock(&pool->lock);
+    return err ? -1 : 1;
+}
+
+int64_t
+pcap_walk_mt(cppip_t *c, uint32_t snap, pcap_walk_cb_t cb, void *arg)
+{
+    int i, ret, workers;
+    uint64_t k;
+    pthread_t *tids;
+    struct walk_pool pool;
+    struct walk_state s;
+    struct walk_ra ra;
+    struct walk_ubuf ub[2];
+    struct walk_batch *cur, *next;
+
+    memset(&s, 0, sizeof (s));
+    memset(&ra, 0, sizeof (ra));
+    memset(ub, 0, sizeof (ub));
+    /** c->ra_depth is in megabytes, the batches are c->threads of them */
+    ra.ring_n  = 2 + (c->ra_depth + c->threads - 1) / c->threads;
+    ra.ring    = calloc(ra.ring_n, sizeof (struct walk_batch));
+    tids       = malloc(c->threads * sizeof (pthread_t));
+    s.snap_buf = malloc(snap ? snap : 1);
+    s.snap     = snap;
+    if (ra.ring == NULL || tids == NULL || s.snap_buf == NULL)
+    {
+        snprintf(c->errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+        free(ra.ring);
+        free(tids);
+        free(s.snap_buf);
+        return -1;
+    }
+    memset(&pool, 0, sizeof (pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.idle, NULL);
+    pthread_mutex_init(&ra.lock, NULL);
+    pthread_cond_init(&ra.cond, NULL);
+
+    /**
+     *  Pick up wherever the BGZF handle is (ie: just past the pcap file
+     *  header) by starting at its block and skipping into it.
+     */
+    ra.fd    = c->pcap_fd;
+    ra.addr  = bgzf_tell(c->pcap) >> 16;
+    s.need   = bgzf_tell(c->pcap) & 0xffff;
+    ra.chunk = (size_t)c->threads * WALK_CHUNK_SIZ;
+
+    ret = -1;
+    for (workers = 0; workers < c->threads; workers++)
+    {
+        if (pthread_create(&tids[workers], NULL, walk_worker, &pool))
+        {
+            snprintf(c->errbuf, BUFSIZ, "pthread_create() failed\n");
+            goto done;
+        }
+    }
+    if (c->ra_depth)
+    {
+        if (pthread_create(&ra.tid, NULL, walk_reader, &ra))
+        {
+            snprintf(c->errbuf, BUFSIZ, "pthread_create() failed\n");
+            goto done;
+        }
+        ra.threaded = 1;
+    }
+
+    /**
+     *  Double buffer: while the workers inflate batch k + 1 the main thread
+     *  walks packet boundaries through batch k, and the reader is ahead of
+     *  them both by about c->ra_depth megabytes.
+     */
+    ret = 1;
+    k   = 0;
+    cur = walk_ra_get(&ra, k);
+    if (cur)
+    {
+        if (walk_ubuf(&ub[0], cur, c->errbuf) == -1)
+        {
+            ret = -1;
+            goto done;
+        }
+        walk_post(&pool, cur);
+    }
+    while (cur)
+    {
+        if (walk_wait(&pool, cur) == -1)
+        {
+            snprintf(c->errbuf, BUFSIZ, "inflateInit2() failed\n");
+            ret = -1;
+            break;
+        }
+        if (cur->err)
+        {
+            snprintf(c->errbuf, BUFSIZ, "inflate() error in BGZF block\n");
+            ret = -1;
+            break;
+        }
+        /** queue up the next batch before walking this one */
+        next = walk_ra_get(&ra, k + 1);
+        if (next)
+        {
+            if (walk_ubuf(&ub[(k + 1) & 1], next, c->errbuf) == -1)
+            {
+                ret = -1;
+                break;
+            }
+            walk_post(&pool, next);
+        }
+        if (walk_batch_packets(c, cur, &s, cb, arg) == -1)
+        {
+            ret = -1;
+            break;
+        }
+        walk_ra_put(&ra);
+        cur = next;
+        k++;
+    }
+    if (ret == 1 && ra.err)
+    {
+        memcpy(c->errbuf, ra.errbuf, BUFSIZ);
+        ret = -1;
+    }
+    if (ret == 1 && (s.need || s.hdr_have || s.snap_have < s.snap_want))
+    {
+        snprintf(c->errbuf, BUFSIZ, "truncated packet %llu at end of file\n",
+                (unsigned long long)s.pkt_num + 1);
+        ret = -1;
+    }
+done:
+    if (ra.threaded)
+    {
+        pthread_mutex_lock(&ra.lock);
+        ra.quit = 1;
+        pthread_cond_broadcast(&ra.cond);
+        pthread_mutex_unlock(&ra.lock);
+        pthread_join(ra.tid, NULL);
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < workers; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+    for (i = 0; i < ra.ring_n; i++)
+    {
+        free(ra.ring[i].cbuf);
+        free(ra.ring[i].blks);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        free(ub[i].buf);
+    }
+    free(ra.ring);
+    free(tids);
+    free(s.snap_buf);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.work);
+    pthread_cond_destroy(&pool.idle);
+    pthread_mutex_destroy(&ra.lock);
+    pthread_cond_destroy(&ra.cond);
+    return ret == 1 ? (int64_t)s.pkt_num : -1;
+}
+
+/** EOF */
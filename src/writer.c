@@ -0,0 +1,123 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * writer.c: buffered output routines
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "../include/cppip.h"
+
+int
+writer_init(writer_t *w, int fd, off_t off, size_t siz, char *errbuf)
+{
+    memset(w, 0, sizeof (writer_t));
+    w->buf = malloc(siz);
+    if (w->buf == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+        return -1;
+    }
+    w->fd  = fd;
+    w->off = off;
+    w->siz = siz;
+    w->seq = off == -1;
+    return 1;
+}
+
+/** write len bytes from data at the writer's offset, retrying short writes */
+static int
+writer_out(writer_t *w, const void *data, size_t len, char *errbuf)
+{
+    ssize_t n;
+    size_t done;
+
+    for (done = 0; done < len; done += n)
+    {
+        if (w->seq)
+        {
+            n = write(w->fd, (uint8_t *)data + done, len - done);
+        }
+        else
+        {
+            n = pwrite(w->fd, (uint8_t *)data + done, len - done,
+                    w->off + done);
+        }
+        w->writes++;
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                n = 0;
+                continue;
+            }
+            snprintf(errbuf, BUFSIZ, "%s(): %s\n",
+                    w->seq ? "write" : "pwrite", strerror(errno));
+            return -1;
+        }
+    }
+    w->off   += len;
+    w->bytes += len;
+    return 1;
+}
+
+int
+writer_add(writer_t *w, const void *data, size_t len, char *errbuf)
+{
+    /** make room, anything bigger than the buffer goes straight out */
+    if (w->len + len > w->siz)
+    {
+        if (writer_flush(w, errbuf) == -1)
+        {
+            return -1;
+        }
+        if (len > w->siz)
+        {
+            return writer_out(w, data, len, errbuf);
+        }
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+    return 1;
+}
+
+int
+writer_flush(writer_t *w, char *errbuf)
+{
+    if (w->len == 0)
+    {
+        return 1;
+    }
+    if (writer_out(w, w->buf, w->len, errbuf) == -1)
+    {
+        return -1;
+    }
+    w->len = 0;
+    return 1;
+}
+
+void
+writer_free(writer_t *w)
+{
+    free(w->buf);
+    w->buf = NULL;
+}
+
+/** EOF */
@@ -0,0 +1,510 @@
+/**
+ * Compressed pcap packet indexing program (CPPIP)
+ * zout.c: bgzip compressed output
+ *
+ * Copyright (c) 2013 - 2015, Mike Schiffman <themikeschiffman@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include "../include/cppip.h"
+#include <pthread.h>
+
+/** the empty block bgzip ends every file with */
+static const uint8_t zout_eof[28] =
+{
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+    0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00
+};
+
+/** ring states of a block in the pool */
+#define ZOUT_FREE       0       /** empty or being filled */
+#define ZOUT_QUEUED     1       /** full, waiting for a worker */
+#define ZOUT_BUSY       2       /** a worker is compressing it */
+#define ZOUT_DONE       3       /** compressed, waiting to be written */
+#define ZOUT_FAILED     4       /** didn't compress */
+
+/** a block on its way through the pool */
+struct zout_blk
+{
+    uint8_t *ubuf;              /** the data */
+    size_t ulen;                /** bytes of it */
+    uint8_t *cbuf;              /** the whole compressed block */
+    size_t clen;                /** its size */
+    int state;                  /** as above */
+};
+
+/**
+ * Compression threads. Blocks go round a ring: filled in order by the
+ * caller, compressed by whichever worker is free and written back by the
+ * caller in the order they were filled.
+ */
+struct zout_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /** a block was queued */
+    pthread_cond_t done;        /** a block was compressed */
+    pthread_t *tids;            /** the workers */
+    int threads;                /** how many of them */
+    struct zout_blk *blks;      /** the ring */
+    int n;                      /** blocks in the ring */
+    int cur;                    /** block being filled */
+    int next;                   /** oldest block in flight, written next */
+    int flight;                 /** blocks queued, compressing or done */
+    int shutdown;               /** tell the workers to go home */
+};
+
+/** write all of it, retrying short writes */
+static int
+zout_write(int fd, const uint8_t *p, size_t len, char *errbuf)
+{
+    ssize_t n;
+
+    while (len)
+    {
+        n = write(fd, p, len);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            snprintf(errbuf, BUFSIZ, "write() error: %s\n", strerror(errno));
+            return -1;
+        }
+        p   += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/**
+ * Compress ulen bytes of u into a whole BGZF block at p, zs is a raw
+ * deflate stream
+ * returns: the block's size, 0 on error
+ */
+static size_t
+zout_deflate(z_stream *zs, const uint8_t *u, size_t ulen, uint8_t *p)
+{
+    int n;
+    size_t bsize;
+
+    memcpy(p, zout_eof, BGZF_BLOCK_HDR_SIZ);
+
+    /**
+     * Anything that deflates to more than a block holds (incompressible
+     * data can) goes in again stored, which always fits.
+     */
+    zs->next_in   = (uint8_t *)u;
+    zs->avail_in  = ulen;
+    zs->next_out  = p + BGZF_BLOCK_HDR_SIZ;
+    zs->avail_out = BGZF_BLOCK_MAX_SIZ - BGZF_BLOCK_HDR_SIZ -
+            BGZF_BLOCK_FTR_SIZ;
+    n = deflate(zs, Z_FINISH);
+    if (n != Z_STREAM_END)
+    {
+        deflateReset(zs);
+        deflateParams(zs, Z_NO_COMPRESSION, Z_DEFAULT_STRATEGY);
+        zs->next_in   = (uint8_t *)u;
+        zs->avail_in  = ulen;
+        zs->next_out  = p + BGZF_BLOCK_HDR_SIZ;
+        zs->avail_out = BGZF_BLOCK_MAX_SIZ - BGZF_BLOCK_HDR_SIZ -
+                BGZF_BLOCK_FTR_SIZ;
+        n = deflate(zs, Z_FINISH);
+        deflateReset(zs);
+        deflateParams(zs, Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY);
+        if (n != Z_STREAM_END)
+        {
+            return 0;
+        }
+    }
+    bsize = BGZF_BLOCK_MAX_SIZ - BGZF_BLOCK_FTR_SIZ - zs->avail_out;
+    deflateReset(zs);
+
+    le32enc(p + bsize, crc32(crc32(0, NULL, 0), u, ulen));
+    le32enc(p + bsize + 4, ulen);
+    bsize += BGZF_BLOCK_FTR_SIZ;
+    p[16] = (bsize - 1) & 0xff;
+    p[17] = (bsize - 1) >> 8;
+    return bsize;
+}
+
+static void *
+zout_worker(void *arg)
+{
+    int i, j, ok;
+    z_stream zs;
+    struct zout_blk *b;
+    struct zout_pool *pool;
+
+    pool = (struct zout_pool *)arg;
+    memset(&zs, 0, sizeof (zs));
+
+    /** without a stream we still take blocks, to fail them */
+    ok = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+            Z_DEFAULT_STRATEGY) == Z_OK;
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        /** oldest queued block first, it's the one that'll be waited on */
+        for (b = NULL, i = 0; i < pool->flight; i++)
+        {
+            j = (pool->next + i) % pool->n;
+            if (pool->blks[j].state == ZOUT_QUEUED)
+            {
+                b = &pool->blks[j];
+                break;
+            }
+        }
+        if (b == NULL)
+        {
+            if (pool->shutdown)
+            {
+                break;
+            }
+            pthread_cond_wait(&pool->work, &pool->lock);
+            continue;
+        }
+        b->state = ZOUT_BUSY;
+        pthread_mutex_unlock(&pool->lock);
+        b->clen = ok ? zout_deflate(&zs, b->ubuf, b->ulen, b->cbuf) : 0;
+        pthread_mutex_lock(&pool->lock);
+        b->state = b->clen ? ZOUT_DONE : ZOUT_FAILED;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (ok)
+    {
+        deflateEnd(&zs);
+    }
+    return NULL;
+}
+
+/** start the workers, blocks are filled in place in the ring */
+static int
+zout_pool_init(zout_t *z, int threads, char *errbuf)
+{
+    int i;
+    struct zout_pool *pool;
+
+    pool = calloc(1, sizeof (struct zout_pool));
+    if (pool == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "calloc(): %s\n", strerror(errno));
+        return -1;
+    }
+    z->pool = pool;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    /** enough in flight to keep every worker busy while we write */
+    pool->n    = threads * 4;
+    pool->blks = calloc(pool->n, sizeof (struct zout_blk));
+    pool->tids = calloc(threads, sizeof (pthread_t));
+    if (pool->blks == NULL || pool->tids == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "calloc(): %s\n", strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < pool->n; i++)
+    {
+        pool->blks[i].ubuf = malloc(BGZF_BLOCK_DATA_SIZ);
+        pool->blks[i].cbuf = malloc(BGZF_BLOCK_MAX_SIZ);
+        if (pool->blks[i].ubuf == NULL || pool->blks[i].cbuf == NULL)
+        {
+            snprintf(errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    for (; pool->threads < threads; pool->threads++)
+    {
+        if (pthread_create(&pool->tids[pool->threads], NULL, zout_worker,
+                pool))
+        {
+            snprintf(errbuf, BUFSIZ, "pthread_create() failed\n");
+            return -1;
+        }
+    }
+    z->ubuf = pool->blks[0].ubuf;
+    return 1;
+}
+
+int
+zout_init(zout_t *z, int fd, int threads, char *errbuf)
+{
+    memset(z, 0, sizeof (zout_t));
+    z->fd   = fd;
+    z->cbuf = malloc(BGZF_BLOCK_MAX_SIZ);
+    if (z->cbuf == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+        return -1;
+    }
+    /** raw deflate, we write the gzip framing ourselves */
+    if (deflateInit2(&z->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+            Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        snprintf(errbuf, BUFSIZ, "deflateInit2() failed\n");
+        return -1;
+    }
+    if (threads > 1)
+    {
+        return zout_pool_init(z, threads, errbuf);
+    }
+    z->ubuf = malloc(BGZF_BLOCK_DATA_SIZ);
+    if (z->ubuf == NULL)
+    {
+        snprintf(errbuf, BUFSIZ, "malloc(): %s\n", strerror(errno));
+        return -1;
+    }
+    return 1;
+}
+
+/** wait for the oldest block in flight and write it */
+static int
+zout_pool_write(zout_t *z, char *errbuf)
+{
+    struct zout_blk *b;
+    struct zout_pool *pool;
+
+    pool = (struct zout_pool *)z->pool;
+    b = &pool->blks[pool->next];
+    pthread_mutex_lock(&pool->lock);
+    while (b->state != ZOUT_DONE && b->state != ZOUT_FAILED)
+    {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (b->state == ZOUT_FAILED)
+    {
+        snprintf(errbuf, BUFSIZ, "deflate() failed\n");
+        return -1;
+    }
+    if (zout_write(z->fd, b->cbuf, b->clen, errbuf) == -1)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&pool->lock);
+    b->state = ZOUT_FREE;
+    pool->next = (pool->next + 1) % pool->n;
+    pool->flight--;
+    pthread_mutex_unlock(&pool->lock);
+    z->blocks++;
+    return 1;
+}
+
+/** the block in ubuf is full (or being flushed), send it on its way */
+static int
+zout_block(zout_t *z, char *errbuf)
+{
+    size_t bsize;
+    struct zout_pool *pool;
+
+    if (z->pool == NULL)
+    {
+        bsize = zout_deflate(&z->zs, z->ubuf, z->ulen, z->cbuf);
+        if (bsize == 0)
+        {
+            snprintf(errbuf, BUFSIZ, "deflate() failed\n");
+            return -1;
+        }
+        if (zout_write(z->fd, z->cbuf, bsize, errbuf) == -1)
+        {
+            return -1;
+        }
+        z->blocks++;
+        z->ulen = 0;
+        return 1;
+    }
+
+    pool = (struct zout_pool *)z->pool;
+    pthread_mutex_lock(&pool->lock);
+    pool->blks[pool->cur].ulen  = z->ulen;
+    pool->blks[pool->cur].state = ZOUT_QUEUED;
+    pool->flight++;
+    pool->cur = (pool->cur + 1) % pool->n;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    /** the ring is full when the next block to fill is still in flight */
+    if (pool->flight == pool->n && zout_pool_write(z, errbuf) == -1)
+    {
+        return -1;
+    }
+    z->ubuf = pool->blks[pool->cur].ubuf;
+    z->ulen = 0;
+    return 1;
+}
+
+int
+zout_add(zout_t *z, const void *data, size_t len, char *errbuf)
+{
+    size_t n;
+    const uint8_t *p;
+
+    for (p = data; len; p += n, len -= n)
+    {
+        n = BGZF_BLOCK_DATA_SIZ - z->ulen;
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy(z->ubuf + z->ulen, p, n);
+        z->ulen += n;
+        if (z->ulen == BGZF_BLOCK_DATA_SIZ && zout_block(z, errbuf) == -1)
+        {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+int
+zout_flush(zout_t *z, char *errbuf)
+{
+    if (z->ulen && zout_block(z, errbuf) == -1)
+    {
+        return -1;
+    }
+    while (z->pool && ((struct zout_pool *)z->pool)->flight)
+    {
+        if (zout_pool_write(z, errbuf) == -1)
+        {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+int
+zout_copy(zout_t *z, int fd, off_t off, off_t len, char *errbuf)
+{
+    ssize_t n;
+    size_t want;
+    uint8_t *buf;
+
+    if (zout_flush(z, errbuf) == -1)
+    {
+        return -1;
+    }
+    z->copied += len;
+#ifdef HAVE_COPY_FILE_RANGE
+    /** the kernel moves the bytes, possibly without reading them at all */
+    while (len)
+    {
+        n = copy_file_range(fd, &off, z->fd, NULL, len, 0);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            /** not across these file systems, do it by hand */
+            break;
+        }
+        len -= n;
+    }
+    if (len == 0)
+    {
+        return 1;
+    }
+#endif
+    /** the compressed block buffer is free while we're copying */
+    buf = z->cbuf;
+    while (len)
+    {
+        want = len < BGZF_BLOCK_MAX_SIZ ? len : BGZF_BLOCK_MAX_SIZ;
+        n = pread(fd, buf, want, off);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            snprintf(errbuf, BUFSIZ, "pread() error: %s\n",
+                    n ? strerror(errno) : "unexpected EOF");
+            return -1;
+        }
+        if (zout_write(z->fd, buf, n, errbuf) == -1)
+        {
+            return -1;
+        }
+        off += n;
+        len -= n;
+    }
+    return 1;
+}
+
+int
+zout_close(zout_t *z, char *errbuf)
+{
+    if (zout_flush(z, errbuf) == -1)
+    {
+        return -1;
+    }
+    return zout_write(z->fd, zout_eof, sizeof (zout_eof), errbuf);
+}
+
+void
+zout_free(zout_t *z)
+{
+    int i;
+    struct zout_pool *pool;
+
+    pool = (struct zout_pool *)z->pool;
+    if (pool)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->shutdown = 1;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+        for (i = 0; i < pool->threads; i++)
+        {
+            pthread_join(pool->tids[i], NULL);
+        }
+        for (i = 0; pool->blks && i < pool->n; i++)
+        {
+            free(pool->blks[i].ubuf);
+            free(pool->blks[i].cbuf);
+        }
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->work);
+        pthread_cond_destroy(&pool->done);
+        free(pool->blks);
+        free(pool->tids);
+        free(pool);
+        z->pool = NULL;
+    }
+    else
+    {
+        free(z->ubuf);
+    }
+    deflateEnd(&z->zs);
+    free(z->cbuf);
+    z->ubuf = NULL;
+    z->cbuf = NULL;
+}
+
+/** EOF */